@@ -0,0 +1,123 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "mm.h"
+
+/*
+ * Microbenchmarks of the public allocator interface. Every benchmark sets up
+ * and tears down its own heap so that runs do not see each other's blocks.
+ */
+
+/*
+ * mm_malloc immediately followed by mm_free, for one block size per run.
+ */
+static void BM_MallocFree(benchmark::State& state) {
+  std::size_t size = static_cast<std::size_t>(state.range(0));
+  mm_init();
+  for (auto _ : state) {
+    std::byte* ptr = mm_malloc(size);
+    benchmark::DoNotOptimize(ptr);
+    mm_free(ptr);
+  }
+  state.SetItemsProcessed(state.iterations());
+  mm_teardown();
+}
+BENCHMARK(BM_MallocFree)->RangeMultiplier(4)->Range(8, 1 << 20);
+
+/*
+ * A batch of state.range(1) blocks allocated and then freed in the same order,
+ * so that free has neighbours to coalesce with.
+ */
+static void BM_MallocFreeBatch(benchmark::State& state) {
+  std::size_t size = static_cast<std::size_t>(state.range(0));
+  std::vector<std::byte*> blocks(static_cast<std::size_t>(state.range(1)));
+  mm_init();
+  for (auto _ : state) {
+    for (std::byte*& block : blocks) {
+      block = mm_malloc(size);
+    }
+    for (std::byte* block : blocks) {
+      mm_free(block);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(1));
+  mm_teardown();
+}
+BENCHMARK(BM_MallocFreeBatch)
+    ->ArgsProduct({{16, 64, 256, 4096}, {1024}});
+
+/*
+ * Grow a block from 16 bytes to state.range(0) bytes, doubling every step, as
+ * a growing vector would.
+ */
+static void BM_ReallocGrowth(benchmark::State& state) {
+  std::size_t max_size = static_cast<std::size_t>(state.range(0));
+  mm_init();
+  for (auto _ : state) {
+    std::byte* ptr = nullptr;
+    for (std::size_t size = 16; size <= max_size; size *= 2) {
+      ptr = mm_realloc(ptr, size);
+      benchmark::DoNotOptimize(ptr);
+    }
+    mm_free(ptr);
+  }
+  state.SetItemsProcessed(state.iterations());
+  mm_teardown();
+}
+BENCHMARK(BM_ReallocGrowth)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+
+/*
+ * Random churn: a working set of state.range(0) slots where every iteration
+ * frees a random slot and refills it with a block of random size (mostly
+ * small, occasionally up to 64 KB).
+ */
+static void BM_RandomChurn(benchmark::State& state) {
+  std::size_t num_slots = static_cast<std::size_t>(state.range(0));
+  std::vector<std::byte*> slots(num_slots, nullptr);
+  std::mt19937_64 rng(42);
+  std::uniform_int_distribution<std::size_t> slot_dist(0, num_slots - 1);
+  std::geometric_distribution<int> log_size_dist(0.3);
+  mm_init();
+  for (auto _ : state) {
+    std::size_t slot = slot_dist(rng);
+    std::size_t size = std::size_t{8} << std::min(log_size_dist(rng), 13);
+    mm_free(slots[slot]);
+    slots[slot] = mm_malloc(size + rng() % size);
+    benchmark::DoNotOptimize(slots[slot]);
+  }
+  for (std::byte* block : slots) {
+    mm_free(block);
+  }
+  state.SetItemsProcessed(state.iterations());
+  mm_teardown();
+}
+BENCHMARK(BM_RandomChurn)->Arg(1 << 8)->Arg(1 << 12)->Arg(1 << 16);
+
+/*
+ * Churn from several threads at once. The arenas initialize themselves on
+ * first use, so the threads need no common setup.
+ */
+static void BM_RandomChurnThreaded(benchmark::State& state) {
+  static constexpr std::size_t num_slots = 1 << 10;
+  std::vector<std::byte*> slots(num_slots, nullptr);
+  std::mt19937_64 rng(42 + static_cast<uint64_t>(state.thread_index()));
+  for (auto _ : state) {
+    std::size_t slot = rng() % num_slots;
+    std::size_t size = 8 + rng() % 512;
+    mm_free(slots[slot]);
+    slots[slot] = mm_malloc(size);
+    benchmark::DoNotOptimize(slots[slot]);
+  }
+  for (std::byte* block : slots) {
+    mm_free(block);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_RandomChurnThreaded)->ThreadRange(1, 8)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,250 @@
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mm.h"
+
+/*
+ * Trace replayer: runs allocation traces against the allocator and reports
+ * throughput, per-operation latency percentiles and peak utilization.
+ *
+ * Usage: replay [-n repeats] trace...
+ *
+ * Two trace formats are understood, one operation per line:
+ *   a <id> <size>   allocate size bytes as block id
+ *   r <id> <size>   realloc block id to size bytes
+ *   f <id>          free block id
+ * CS:APP .rep traces start with four numbers (suggested heap size, number of
+ * ids, number of operations and weight) which are skipped. Traces captured
+ * from services have no such header and may use any (64 bit) ids. Empty lines
+ * and lines starting with '#' are ignored.
+ *
+ * Peak utilization is the peak of the live payload (the sizes requested by
+ * the trace) over the peak of the memory the allocator holds: its heaps, slab
+ * runs and huge block mappings as reported by mm_stats.
+ */
+
+enum class OpType { alloc, realloc, free };
+
+struct Op {
+  OpType type;
+  uint64_t id;
+  std::size_t size;
+};
+
+struct Block {
+  std::byte* ptr = nullptr;
+  std::size_t size = 0;
+};
+
+struct ReplayResult {
+  std::size_t num_ops = 0;
+  double seconds = 0;                 /* time spent in allocator calls */
+  std::vector<uint64_t> latencies_ns; /* one entry per operation */
+  std::size_t peak_payload = 0;
+  std::size_t peak_heap = 0;
+};
+
+// forward declarations
+static bool load_trace(const char* path, std::vector<Op>* ops);
+static bool replay(const std::vector<Op>& ops, ReplayResult* result);
+static uint64_t percentile(std::vector<uint64_t>* sorted, double fraction);
+static std::size_t heap_bytes();
+
+int main(int argc, char** argv) {
+  int repeats = 1;
+  int first_trace = 1;
+  if (argc > 2 && std::strcmp(argv[1], "-n") == 0) {
+    repeats = std::max(std::atoi(argv[2]), 1);
+    first_trace = 3;
+  }
+  if (first_trace >= argc) {
+    fmt::print(stderr, "usage: {} [-n repeats] trace...\n", argv[0]);
+    return 2;
+  }
+
+  int status = 0;
+  for (int i = first_trace; i < argc; ++i) {
+    std::vector<Op> ops;
+    if (!load_trace(argv[i], &ops)) {
+      status = 1;
+      continue;
+    }
+
+    ReplayResult total;
+    for (int run = 0; run < repeats; ++run) {
+      ReplayResult result;
+      if (!replay(ops, &result)) {
+        fmt::print(stderr, "{}: allocator ran out of memory\n", argv[i]);
+        status = 1;
+        break;
+      }
+      total.num_ops += result.num_ops;
+      total.seconds += result.seconds;
+      total.latencies_ns.insert(total.latencies_ns.end(),
+                                result.latencies_ns.begin(),
+                                result.latencies_ns.end());
+      total.peak_payload = std::max(total.peak_payload, result.peak_payload);
+      total.peak_heap = std::max(total.peak_heap, result.peak_heap);
+    }
+    if (total.num_ops == 0) {
+      continue;
+    }
+
+    std::sort(total.latencies_ns.begin(), total.latencies_ns.end());
+    double utilization =
+        total.peak_heap > 0
+            ? 100.0 * static_cast<double>(total.peak_payload) /
+                  static_cast<double>(total.peak_heap)
+            : 0.0;
+    fmt::print(
+        "{}: {} ops, {:.0f} ops/sec, latency p50 {} ns, p99 {} ns, p999 {} "
+        "ns, peak utilization {:.1f}%\n",
+        argv[i], total.num_ops,
+        static_cast<double>(total.num_ops) / total.seconds,
+        percentile(&total.latencies_ns, 0.5),
+        percentile(&total.latencies_ns, 0.99),
+        percentile(&total.latencies_ns, 0.999), utilization);
+  }
+  return status;
+}
+
+/*
+ * Read a trace in either format.
+ *
+ * @return false (after printing an error) if the trace cannot be read.
+ */
+static bool load_trace(const char* path, std::vector<Op>* ops) {
+  std::ifstream trace(path);
+  if (!trace) {
+    fmt::print(stderr, "{}: cannot open trace\n", path);
+    return false;
+  }
+
+  std::string line;
+  std::size_t line_number = 0;
+  int header_values = 0;
+  bool in_header = true;
+  while (std::getline(trace, line)) {
+    ++line_number;
+    std::istringstream fields(line);
+    std::string type;
+    if (!(fields >> type) || type[0] == '#') {
+      continue;
+    }
+    // the CS:APP header is four numbers before the first operation
+    if (in_header && header_values < 4 &&
+        std::isdigit(static_cast<unsigned char>(type[0]))) {
+      ++header_values;
+      continue;
+    }
+    in_header = false;
+
+    Op op{};
+    bool valid = static_cast<bool>(fields >> op.id);
+    if (type == "a" || type == "r") {
+      op.type = type == "a" ? OpType::alloc : OpType::realloc;
+      valid = valid && static_cast<bool>(fields >> op.size);
+    } else if (type == "f") {
+      op.type = OpType::free;
+    } else {
+      valid = false;
+    }
+    if (!valid) {
+      fmt::print(stderr, "{}:{}: bad operation '{}'\n", path, line_number,
+                 line);
+      return false;
+    }
+    ops->push_back(op);
+  }
+  return true;
+}
+
+/*
+ * Replay a trace on a fresh heap.
+ *
+ * @return false if an allocation failed.
+ */
+static bool replay(const std::vector<Op>& ops, ReplayResult* result) {
+  std::unordered_map<uint64_t, Block> blocks;
+  blocks.reserve(ops.size());
+  result->latencies_ns.assign(ops.size(), 0);
+
+  mm_init();
+  std::size_t payload = 0;
+  bool ok = true;
+
+  for (const Op& op : ops) {
+    Block& block = blocks[op.id];
+    std::byte* ptr = nullptr;
+
+    auto start = std::chrono::steady_clock::now();
+    switch (op.type) {
+      case OpType::alloc:
+        ptr = mm_malloc(op.size);
+        break;
+      case OpType::realloc:
+        ptr = mm_realloc(block.ptr, op.size);
+        break;
+      case OpType::free:
+        mm_free(block.ptr);
+        break;
+    }
+    auto end = std::chrono::steady_clock::now();
+    uint64_t latency = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+            .count());
+    result->latencies_ns[result->num_ops] = latency;
+    result->seconds += static_cast<double>(latency) * 1e-9;
+    ++result->num_ops;
+
+    payload -= block.size;
+    if (op.type == OpType::free) {
+      block = Block{};
+      continue;
+    }
+    if (ptr == nullptr && op.size > 0) {
+      ok = false;
+      break;
+    }
+    block = Block{ptr, op.size};
+    payload += op.size;
+
+    result->peak_payload = std::max(result->peak_payload, payload);
+    result->peak_heap = std::max(result->peak_heap, heap_bytes());
+  }
+
+  mm_teardown();
+  return ok;
+}
+
+/*
+ * Value at fraction of a sorted vector.
+ */
+static uint64_t percentile(std::vector<uint64_t>* sorted, double fraction) {
+  if (sorted->empty()) {
+    return 0;
+  }
+  std::size_t index =
+      static_cast<std::size_t>(fraction * static_cast<double>(sorted->size()));
+  return (*sorted)[std::min(index, sorted->size() - 1)];
+}
+
+/*
+ * Memory the allocator holds.
+ */
+static std::size_t heap_bytes() {
+  MmStats stats = mm_stats();
+  return stats.heap_size + stats.slab_size + stats.mapped_size;
+}
@@ -1,5 +1,11 @@
 #! /usr/bin/bash
 
-cd build
-conan install ../conanfile.txt --build=missing --profile default -s build_type=Debug -of ./
-cmake ../ -DCMAKE_BUILD_TYPE=Debug -DCMAKE_EXPORT_COMPILE_COMMANDS=ON -DCMAKE_TOOLCHAIN_FILE=conan_toolchain.cmake && make -j 8
+# usage: build.sh [Debug|Release], Release by default. The allocator libraries
+# and the tests set their own optimization flags, the build type only affects
+# everything else (benchmarks, dependencies built by conan).
+BUILD_TYPE=${1:-Release}
+
+mkdir -p build/${BUILD_TYPE}
+cd build/${BUILD_TYPE}
+conan install ../../conanfile.txt --build=missing --profile default -s build_type=${BUILD_TYPE} -of ./
+cmake ../../ -DCMAKE_BUILD_TYPE=${BUILD_TYPE} -DCMAKE_EXPORT_COMPILE_COMMANDS=ON -DCMAKE_TOOLCHAIN_FILE=conan_toolchain.cmake && make -j 8
@@ -0,0 +1,206 @@
+#ifndef HEAP_H_
+#define HEAP_H_
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+#include "mm.h"
+
+struct Arena;
+
+/*
+ * A heap of its own: a memory region, free lists and slab runs that belong
+ * to this object alone and are independent of the process-wide heaps behind
+ * mm_malloc. Blocks are placed exactly as the arenas of mm_malloc place them,
+ * except that every request, however large, is served from the heap's own
+ * region (there are no huge block mappings to track). The heap's memory is
+ * reserved on its first allocation.
+ *
+ * release() and the destructor give the whole region back at once, which
+ * frees every block of the heap without visiting any of them. This makes the
+ * heap a good fit for request-scoped allocations that die together.
+ *
+ * checkpoint() and rollback() do the same for the blocks allocated in
+ * between: rollback frees all of them at once while the blocks from before
+ * the checkpoint stay. While a checkpoint is set, free memory from before it
+ * is not reused; small requests get heap blocks instead of slab slots; and
+ * blocks from before the checkpoint that are freed stay allocated until the
+ * checkpoint is rolled back or committed. Resizing such a block can move it,
+ * which makes it a block allocated since the checkpoint.
+ *
+ * A heap is not synchronized: like std::pmr::unsynchronized_pool_resource it
+ * must only be used by one thread at a time. Its calls are neither counted by
+ * mm_stats nor sampled by the heap profiler.
+ */
+class MM_API ExplicitFreeListHeap {
+ public:
+  ExplicitFreeListHeap();
+  ~ExplicitFreeListHeap();
+
+  ExplicitFreeListHeap(const ExplicitFreeListHeap&) = delete;
+  ExplicitFreeListHeap& operator=(const ExplicitFreeListHeap&) = delete;
+
+  /*
+   * Allocate size bytes, see mm_malloc.
+   *
+   * @return pointer to the block or nullptr if size is 0 or the heap's region
+   * is full.
+   */
+  std::byte* malloc(std::size_t size);
+
+  /*
+   * Allocate size bytes aligned to alignment bytes, see mm_memalign.
+   *
+   * @param alignment a power of two. Alignments up to MM_ALIGNMENT cost
+   * nothing over malloc.
+   * @return pointer to the block or nullptr if size is 0, the region is full
+   * or (with errno set to EINVAL) alignment is not a power of two.
+   */
+  std::byte* memalign(std::size_t alignment, std::size_t size);
+
+  /*
+   * Resize a block of this heap, see mm_realloc. The block stays in the heap.
+   */
+  std::byte* realloc(std::byte* ptr, std::size_t size);
+
+  /*
+   * Free a block of this heap. ptr may be nullptr.
+   */
+  void free(std::byte* ptr);
+
+  /*
+   * Number of bytes the user can use in a block of this heap, 0 for nullptr.
+   */
+  std::size_t usable_size(std::byte* ptr) const;
+
+  /*
+   * Does ptr point into this heap's memory?
+   */
+  bool contains(const std::byte* ptr) const;
+
+  /*
+   * Check the heap for correctness, see mm_checkheap.
+   *
+   * @return 0 if the heap is fine, -1 if it is corrupted.
+   */
+  int checkheap(int verbose) const;
+
+  /*
+   * The heap's memory and the work it did, see MmStats. The call counters
+   * (allocs, frees, reallocs, bytes_in_use and allocs_by_class) are 0.
+   */
+  MmStats stats() const;
+
+  /*
+   * Set a checkpoint at the current top of the heap.
+   *
+   * @return 0 on success, -1 if a checkpoint is already set or the heap could
+   * not get any memory.
+   */
+  int checkpoint();
+
+  /*
+   * Free every block allocated since the checkpoint and clear it. This takes
+   * the same time however many blocks were allocated; the heap above the
+   * checkpoint becomes a single free block.
+   *
+   * @return 0 on success, -1 if no checkpoint is set.
+   */
+  int rollback();
+
+  /*
+   * Clear the checkpoint and keep all blocks.
+   *
+   * @return 0 on success, -1 if no checkpoint is set.
+   */
+  int commit();
+
+  /*
+   * Free every block of the heap at once and give its memory back to the OS.
+   * The heap can be used again afterwards, it starts over empty and without
+   * a checkpoint.
+   */
+  void release();
+
+ private:
+  Arena* arena_; /* the heap's state, see src/arena.h */
+};
+
+/*
+ * std::pmr::memory_resource that allocates from an ExplicitFreeListHeap, so
+ * that std::pmr containers can use a heap of their own:
+ *
+ *   ExplicitFreeListHeap heap;
+ *   HeapResource resource(&heap);
+ *   std::pmr::vector<int> values(&resource);
+ *
+ * Deallocating is optional if the heap is released afterwards anyway.
+ */
+class MM_API HeapResource : public std::pmr::memory_resource {
+ public:
+  explicit HeapResource(ExplicitFreeListHeap* heap) : heap_(heap) {}
+
+  ExplicitFreeListHeap* heap() const { return heap_; }
+
+ private:
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+  void do_deallocate(void* ptr, std::size_t bytes,
+                     std::size_t alignment) override;
+  bool do_is_equal(const std::pmr::memory_resource& other)
+      const noexcept override;
+
+  ExplicitFreeListHeap* heap_;
+};
+
+/*
+ * Standard allocator that allocates from an ExplicitFreeListHeap, for
+ * containers that take an allocator type instead of a memory resource:
+ *
+ *   std::vector<int, HeapAllocator<int>> values(HeapAllocator<int>(&heap));
+ *
+ * Allocators compare equal if they use the same heap.
+ */
+template <typename T>
+class HeapAllocator {
+ public:
+  using value_type = T;
+
+  explicit HeapAllocator(ExplicitFreeListHeap* heap) noexcept : heap_(heap) {}
+
+  template <typename U>
+  HeapAllocator(const HeapAllocator<U>& other) noexcept
+      : heap_(other.heap()) {}
+
+  ExplicitFreeListHeap* heap() const noexcept { return heap_; }
+
+  /*
+   * @throws std::bad_array_new_length if n * sizeof(T) overflows,
+   * std::bad_alloc if the heap is out of memory.
+   */
+  T* allocate(std::size_t n) {
+    std::size_t size;
+    if (__builtin_mul_overflow(n, sizeof(T), &size)) {
+      throw std::bad_array_new_length();
+    }
+    std::byte* ptr = heap_->memalign(alignof(T), size > 0 ? size : 1);
+    if (ptr == nullptr) {
+      throw std::bad_alloc();
+    }
+    return reinterpret_cast<T*>(ptr);
+  }
+
+  void deallocate(T* ptr, std::size_t) noexcept {
+    heap_->free(reinterpret_cast<std::byte*>(ptr));
+  }
+
+  template <typename U>
+  bool operator==(const HeapAllocator<U>& other) const noexcept {
+    return heap_ == other.heap();
+  }
+
+ private:
+  ExplicitFreeListHeap* heap_;
+};
+
+#endif
@@ -2,24 +2,126 @@
 #define MEM_LIB_H_
 
 #include <cstddef>
+#include <cstdint>
 
-void mem_init();
+/*
+ * A memory region that the allocator grows like a traditional sbrk heap.
+ * Every arena owns one of these.
+ */
+struct MemRegion {
+  std::byte* heap_start = nullptr; /* beginning of the heap (mem_heap)*/
+  std::byte* heap_brk = nullptr;   /* one past the end of the heap (mem_brk) */
+  std::byte* heap_commit = nullptr; /* end of the committed pages, the pages
+                                       from here to heap_max_addr are only
+                                       reserved */
+  std::byte* heap_max_addr = nullptr; /* The heap has a maximum size and this
+                                         points one byte beyond it*/
+};
+
+/*
+ * Initialize a memory region.
+ *
+ * @param region Region to initialize.
+ *
+ * @return 0 on success, -1 if the memory for the region could not be
+ * obtained.
+ */
+int mem_init(MemRegion* region);
 
 /*
  * Increment the amount of virtual memory allocated by
  * the allocator. Note that this allocator works by
- * malloc-ing a fixed size of memory at once and then using that
- * for responding to malloc requests.
+ * reserving a fixed size of address space at once and committing pages of
+ * it as the heap grows.
  *
+ * @param region Region to grow.
  * @param increment Number of bytes to grow the heap by.
  *
  * @return pointer to block of memory at least 'increment'
  * bytes. On out of memory, the allocator returns a nullptr.
  */
-std::byte* mem_sbrk(std::size_t increment);
+std::byte* mem_sbrk(MemRegion* region, std::size_t increment);
+
+/*
+ * Shrink the heap by moving the break down and give the pages above the new
+ * break back to the OS.
+ *
+ * @param region Region to shrink.
+ * @param decrement Number of bytes to shrink the heap by.
+ *
+ * @return 0 on success, -1 if decrement is larger than the heap.
+ */
+int mem_trim(MemRegion* region, std::size_t decrement);
+
+/*
+ * Tell the OS that the whole pages (huge pages with -DMM_HUGEPAGES=1) in
+ * [addr, addr + size) are unused so that it can reclaim their memory. The
+ * pages stay committed; their contents are lost.
+ *
+ * @return Number of bytes released.
+ */
+std::size_t mem_release(MemRegion* region, std::byte* addr, std::size_t size);
+
+/*
+ * Map size bytes (a multiple of mem_pagesize()) of fresh, zeroed memory
+ * outside of any region.
+ *
+ * @return pointer to the mapping or nullptr (with errno set to ENOMEM) if the
+ * OS is out of memory.
+ */
+std::byte* mem_map(std::size_t size);
+
+/*
+ * Resize a mapping obtained from mem_map, moving it if needed.
+ *
+ * @return new address of the mapping or nullptr if it could not be resized
+ * (in which case the old mapping is left untouched).
+ */
+std::byte* mem_remap(std::byte* addr, std::size_t old_size,
+                     std::size_t new_size);
+
+/*
+ * Unmap a mapping obtained from mem_map.
+ */
+void mem_unmap(std::byte* addr, std::size_t size);
+
+/*
+ * Size of a page.
+ */
+std::size_t mem_pagesize();
+
+/*
+ * Prefer NUMA node node for the memory of a region: its pages are taken from
+ * that node when they are first touched, and from other nodes only when the
+ * node is out of memory.
+ *
+ * @param node node number, less than 63.
+ * @return 0 on success, -1 if the kernel does not support memory policies.
+ */
+int mem_bind(MemRegion* region, int node);
 
 /*
- * Free allocated heap.
+ * NUMA nodes the process may allocate memory on.
+ *
+ * @return bit n is set if node n is allowed, for nodes below 63. 0 if the
+ * kernel does not support NUMA.
+ */
+uint64_t mem_numa_nodes();
+
+/*
+ * NUMA node of the cpu the calling thread is running on, -1 if unknown.
+ */
+int mem_current_node();
+
+/*
+ * Free a region's heap.
+ */
+void mem_teardown(MemRegion* region);
+
+/*
+ * Same as above but operating on a single, process wide region.
  */
+void mem_init();
+std::byte* mem_sbrk(std::size_t increment);
 void mem_teardown();
 #endif
@@ -3,37 +3,192 @@
 
 #include <cstddef>
 
+/*
+ * The library is built with -fvisibility=hidden, these are the only functions
+ * it exports.
+ */
+#define MM_API __attribute__((visibility("default")))
+
 /*
  * Initilialize the allocator.
+ *
+ * mm_malloc, mm_free, mm_realloc and mm_checkheap may be called from multiple
+ * threads at once. mm_init and mm_teardown must not race with any other call.
  */
-extern int mm_init();
+extern MM_API int mm_init();
 
 /*
  * Allocates size bytes and returns a pointer to the beginning of the block.
  *
  * @param size number of bytes to allocate.
  *
+ * Blocks are aligned to MM_ALIGNMENT bytes (16 by default, 8 when built with
+ * -DMM_ALIGNMENT=8). Requests of MM_MMAP_THRESHOLD bytes or more (128 KB by
+ * default) are mapped on their own and unmapped again by mm_free.
+ *
  * @return pointer to the first byte of the allocated block. If the allocator
  * runs out of memory, this function will return null.
  *
  */
-extern std::byte* mm_malloc(std::size_t size);
+extern MM_API std::byte* mm_malloc(std::size_t size);
+
+/*
+ * Largest request of the small size classes: requests of up to this many
+ * bytes (non-zero) have their block size looked up in a table, and
+ * mm_malloc<N> can skip the checks of mm_malloc for them.
+ */
+constexpr std::size_t MM_SMALL_SIZE_MAX = 1024;
+
+/*
+ * Same as mm_malloc for a size of 1 to MM_SMALL_SIZE_MAX bytes, which the
+ * caller guarantees. Called by mm_malloc<N>.
+ */
+extern MM_API std::byte* mm_malloc_small(std::size_t size);
+
+/*
+ * Allocates N bytes, a size known at compile time (e.g. sizeof(T)): small
+ * sizes go straight to the allocator's small block path.
+ *
+ *   Node* node = reinterpret_cast<Node*>(mm_malloc<sizeof(Node)>());
+ */
+template <std::size_t N>
+std::byte* mm_malloc() {
+  static_assert(N > 0, "mm_malloc<0> has nothing to allocate");
+  if constexpr (N <= MM_SMALL_SIZE_MAX) {
+    return mm_malloc_small(N);
+  } else {
+    return mm_malloc(N);
+  }
+}
+
+/*
+ * Allocates zeroed memory for count objects of size bytes each, like calloc.
+ * Memory that is known to be zero already (fresh pages) is not cleared again,
+ * which makes large requests on a growing heap about as cheap as mm_malloc.
+ *
+ * @return pointer to the first byte of the allocated block. Returns null if
+ * the allocator runs out of memory or (with errno set to ENOMEM) if
+ * count * size overflows.
+ */
+extern MM_API std::byte* mm_calloc(std::size_t count, std::size_t size);
+
+/*
+ * Allocates size bytes aligned to alignment bytes. The block works with all
+ * other functions, in particular it is freed with mm_free. Note that
+ * mm_realloc does not keep the alignment when it moves a block.
+ *
+ * @param alignment a power of two.
+ * @param size number of bytes to allocate.
+ *
+ * @return pointer to the first byte of the allocated block, a multiple of
+ * alignment. Returns null if the allocator runs out of memory or (with errno
+ * set to EINVAL) if alignment is not a power of two.
+ */
+extern MM_API std::byte* mm_memalign(std::size_t alignment, std::size_t size);
+
+/*
+ * Same as mm_memalign but, like C11 aligned_alloc, size must be a multiple of
+ * alignment. Returns null with errno set to EINVAL if it is not.
+ */
+extern MM_API std::byte* mm_aligned_alloc(std::size_t alignment,
+                                        std::size_t size);
+
+/*
+ * Allocates size bytes that share no cache line (MM_CACHE_LINE_SIZE bytes, 64
+ * by default) with any other block, for objects that different threads write
+ * to, such as per-thread counters. The block starts on a line and its size is
+ * rounded up to whole lines. Like an aligned block it is freed with mm_free,
+ * and mm_realloc does not keep it isolated when it moves it.
+ *
+ * @return pointer to the first byte of the block or null if the allocator
+ * runs out of memory.
+ */
+extern MM_API std::byte* mm_malloc_isolated(std::size_t size);
+
+/*
+ * Makes mm_malloc (and mm_calloc) return isolated blocks, as
+ * mm_malloc_isolated does, for all requests in the size class of size. Size
+ * classes are the block sizes of the thread caches: requests of up to about
+ * 256 bytes that round up to the same block size share a class.
+ *
+ * @param isolated true to turn isolated blocks on, false to turn them off.
+ * @return 0 on success, -1 if size is 0 or too large for a size class.
+ */
+extern MM_API int mm_set_isolated(std::size_t size, bool isolated);
+
+/*
+ * Free allocated memory. Freeing a block that another thread's arena handed
+ * out never waits for that arena: the block is queued with a single atomic
+ * operation and returned to the arena's free lists the next time the arena
+ * allocates, once a free finds enough queued and the arena unlocked, when a
+ * thread that allocated from the arena exits, or when mm_trim, mm_stats or
+ * mm_checkheap look at it.
+ *
+ * @param block_ptr pointer to start of block. block_ptr must point to a
+ * block allocated by this allocator.
+ *
+ */
+extern MM_API void mm_free(std::byte* ptr);
 
 /*
- * Free allocated memory.
+ * Free allocated memory whose size is known, e.g. for C++ sized delete. This
+ * skips looking up the block's size.
  *
  * @param block_ptr pointer to start of block. block_ptr must point to a
  * block allocated by this allocator.
+ * @param size the size the block was allocated (or last reallocated) with,
+ * or any size between that and mm_usable_size(block_ptr).
+ */
+extern MM_API void mm_free_sized(std::byte* ptr, std::size_t size);
+
+/*
+ * Number of bytes the user can use in an allocated block, at least the size
+ * it was allocated with. Writing up to this many bytes is safe, so growable
+ * containers can use the slack of a block before they reallocate.
+ *
+ * @param block_ptr pointer to start of block allocated by this allocator or
+ * nullptr.
+ * @return usable size of the block, 0 for nullptr.
+ */
+extern MM_API std::size_t mm_usable_size(std::byte* ptr);
+
+/*
+ * Allocates count blocks of size bytes each, as if by calling mm_malloc count
+ * times but with a single lock and, for heap blocks, a single search: the
+ * blocks are carved out of one large free block.
+ *
+ * @param size number of bytes to allocate per block.
+ * @param ptrs receives the pointers to the blocks, at least count entries.
+ * @param count number of blocks to allocate.
+ *
+ * @return number of blocks allocated. This is less than count only if the
+ * allocator runs out of memory; the first return value entries of ptrs are
+ * valid.
+ */
+extern MM_API std::size_t mm_malloc_batch(std::size_t size, std::byte** ptrs,
+                                          std::size_t count);
+
+/*
+ * Frees count blocks, as if by calling mm_free on each of them. Blocks that
+ * are next to each other in the heap are coalesced once, and each heap is
+ * locked once for the whole batch.
  *
+ * @param ptrs blocks allocated by this allocator, nullptr entries are
+ * ignored. The array is sorted by address in place.
+ * @param count number of entries in ptrs.
  */
-extern void mm_free(std::byte* ptr);
+extern MM_API void mm_free_batch(std::byte** ptrs, std::size_t count);
 
 /*
- * Reallocates a block using a naive strategy (always reallocates).
+ * Reallocates a block. The block is resized in place if it can be shrunk,
+ * grown into a free successor or grown at the top of the heap; otherwise a
+ * new block is allocated and the contents are copied over.
+ * Huge blocks (see mm_malloc) are resized with mremap instead, which does not
+ * copy the contents either.
  *
- * Note that this uses std::memcpy internally and therefore, the original block
- * should only contain trivially copyable types. For this reason, you probably
- * do not want to use this. Here be dragons.
+ * Note that the fallback uses std::memcpy internally and therefore, the
+ * original block should only contain trivially copyable types. For this
+ * reason, you probably do not want to use this. Here be dragons.
  *
  * @param block_ptr Pointer to block to rellocate. If block_ptr is nullptr then
  * this is equivalent to calling mm_malloc.
@@ -46,19 +201,116 @@ extern void mm_free(std::byte* ptr);
  * @return pointer to the reallocated block. This function may return a nullptr
  * if the allocator cannot find a large enough block and is out of memory.
  */
-extern std::byte* mm_realloc(std::byte* ptr, std::size_t size);
+extern MM_API std::byte* mm_realloc(std::byte* ptr, std::size_t size);
 
 /*
  * Checks heap for correctness.
  *
  * @param verbose Prints debug info if verbose is not equal to 0.
+ * @return 0 if the heap is fine, -1 (after printing an error) if it is
+ * corrupted.
+ */
+extern MM_API int mm_checkheap(int verbose);
+
+/*
+ * Checks the next max_blocks blocks of every heap, continuing where the last
+ * call stopped, so that repeated calls (e.g. from a background thread) keep
+ * checking the whole heap without ever pausing for a full walk. Slabs and huge
+ * blocks are only checked by mm_checkheap.
+ *
+ * @return 0 if the blocks are fine, -1 (after printing an error) if a corrupted
+ * block was found.
+ */
+extern MM_API int mm_checkheap_step(std::size_t max_blocks);
+
+/*
+ * Heap profiling: start sampling allocations, on average one every interval
+ * allocated bytes (tcmalloc samples every 512 KB by default). The call stack
+ * of a sampled allocation is kept until its block is freed. An interval of 0
+ * stops sampling; samples already taken stay until their blocks are freed.
+ *
+ * @return 0 on success, -1 if the profiler is not compiled in (see
+ * -DMM_PROFILE) or could not map its table.
+ */
+extern MM_API int mm_profile_start(std::size_t interval);
+
+/*
+ * Write the samples of all blocks that are still allocated to path, as a
+ * heap profile that pprof reads (e.g. pprof --text ./binary path).
+ *
+ * @return 0 on success, -1 (with errno set) if the file could not be written.
+ */
+extern MM_API int mm_profile_dump(const char* path);
+
+/*
+ * Write a heap profile to path whenever the process receives signo. The
+ * signal handler only makes a request: the profile is written by the next
+ * thread that allocates or frees a block, whether sampling is on or not.
+ *
+ * @return 0 on success, -1 (with errno set) on failure.
+ */
+extern MM_API int mm_profile_dump_on_signal(int signo, const char* path);
+
+/*
+ * Give free memory back to the OS: the free block at the top of every heap is
+ * trimmed and the pages inside all other large free blocks are released.
+ * Blocks cached by the calling thread are returned to the heap first. The
+ * allocator already does this on its own for large frees (see README).
+ *
+ * @return 1 if any memory was given back, 0 otherwise.
+ */
+extern MM_API int mm_trim();
+
+/*
+ * Allocation statistics, see mm_stats. Size classes are powers of two: class
+ * k holds sizes in (2^(k-1), 2^k], class 0 holds size 1.
+ */
+constexpr std::size_t MM_STATS_NUM_CLASSES = 64;
+
+struct MmStats {
+  /* calls, counted by the threads making them */
+  std::size_t allocs;   /* successful allocations, batches count per block */
+  std::size_t frees;    /* frees of non-null blocks */
+  std::size_t reallocs; /* mm_realloc calls that resized a block */
+  std::size_t bytes_in_use; /* bytes of all allocated blocks, see mm_stats */
+  std::size_t allocs_by_class[MM_STATS_NUM_CLASSES]; /* by requested size */
+
+  /* memory held by the allocator */
+  std::size_t heap_size;   /* heap_brk - heap_start, over all arenas */
+  std::size_t slab_size;   /* bytes of slab runs carved out so far */
+  std::size_t mapped_size; /* bytes of huge block mappings */
+
+  /* fragmentation: free blocks in the heaps' free lists */
+  std::size_t free_blocks;
+  std::size_t free_bytes;
+  std::size_t free_blocks_by_class[MM_STATS_NUM_CLASSES]; /* by block size */
+
+  /* work done by the heaps */
+  std::size_t find_fit_calls;
+  std::size_t find_fit_probes; /* free blocks looked at by find_fit */
+  std::size_t extend_heap_calls;
+  std::size_t coalesces; /* merges of a freed block with a neighbour */
+};
+
+/*
+ * Collect the allocator's statistics. The counters are kept per thread and
+ * per heap and only added up here, so keeping them is cheap; the result is a
+ * consistent snapshot only while no other thread is allocating. Counters
+ * start over at mm_teardown. Building with -DMM_STATS=0 stops counting calls
+ * (the first group above stays 0).
+ *
+ * bytes_in_use counts the size of every block as the call that handles it
+ * knows it, without looking the block up: heap blocks with their header,
+ * blocks of the thread caches with the size of their cache bin. Aligned and
+ * isolated blocks can be larger than the bin of their size: one freed with
+ * mm_free_sized stays counted with the difference.
  */
-extern void mm_checkheap(int verbose);
+extern MM_API MmStats mm_stats();
 
 /*
  * Free memory allocated by the allocator. This invalidates
  * all pointers handed out by the allcoator.
  */
-extern void mm_teardown();
+extern MM_API void mm_teardown();
 
 #endif
@@ -0,0 +1,1715 @@
+#include "arena.h"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "block.h"
+#include "memlib.h"
+#include "mm.h"
+#include "slab.h"
+#include "stats.h"
+
+/*
+ * This file implements a single heap (an arena) on top of a memory region.
+ * See block.h for the block layout and arena.h for the size classes.
+ */
+
+// forward declarations
+static std::byte* extend_heap(Arena* arena, std::size_t words);
+static void place(Arena* arena, std::byte* bp, std::size_t asize);
+static std::byte* place_aligned(Arena* arena, std::byte* bp,
+                                std::size_t alignment, std::size_t asize);
+static std::size_t aligned_gap(std::byte* bp, std::size_t alignment);
+static std::byte* split_gap(Arena* arena, std::byte* bp,
+                            std::size_t alignment);
+static std::size_t carve(Arena* arena, std::byte* bp, std::size_t asize,
+                         std::size_t count, std::size_t pad,
+                         std::byte** block_ptrs);
+static void shrink_allocated(Arena* arena, std::byte* bp, std::size_t asize);
+static bool grow_in_place(Arena* arena, std::byte* bp, std::size_t asize);
+static std::byte* realloc_slot(Arena* arena, std::byte* slot_ptr,
+                               std::size_t size);
+template <FitPolicy policy>
+static std::byte* find_fit_in_list(Arena* arena, std::size_t bin,
+                                   std::size_t asize, bool all_fit);
+static std::byte* find_fit(Arena* arena, std::size_t asize);
+static void free_block(Arena* arena, std::byte* bp);
+static void defer_free(Arena* arena, std::byte* bp);
+static void sweep_fastblks(Arena* arena);
+static std::byte* coalesce(Arena* arena, std::byte* bp);
+static void insert_freeblk(Arena* arena, std::byte* bp);
+static void remove_freeblk(Arena* arena, std::byte* bp);
+static void count_freeblk(Arena* arena, std::byte* bp, int delta);
+static void release_freed(Arena* arena, std::byte* bp, std::byte* freed_ptr,
+                          std::size_t freed_size);
+static std::size_t trim_top(Arena* arena, std::size_t pad);
+static void free_held(Arena* arena, std::byte* held);
+static std::size_t release_interior(Arena* arena, std::byte* bp,
+                                    std::byte* lo, std::byte* hi);
+static void printblock(std::byte* bp);
+static bool checkblock(std::byte* bp);
+static bool checkfreelist(Arena* arena, std::size_t heap_freeblks);
+static bool checklists(std::byte* const* free_lists, uint64_t free_bitmap,
+                       std::size_t* list_freeblks);
+static bool checkfastlists(Arena* arena);
+static bool checkblock_local(Arena* arena, std::byte* bp);
+static bool in_heap(const Arena* arena, const std::byte* bp);
+static void check_touched(Arena* arena, std::byte* bp, bool allocated);
+static void forget_headers(Arena* arena, std::byte* bp, std::size_t size);
+static void mark_dirty(Arena* arena, std::byte* bp);
+static void clear_boundary(Arena* arena, std::byte* bp);
+static void clear_range(Arena* arena, std::byte* lo, std::byte* hi);
+
+/*
+ * Initialize an arena.
+ */
+int arena_init(Arena* arena) {
+  if (mem_init(&arena->region) != 0 || slab_init(&arena->slabs) != 0) {
+    return -1;
+  }
+  // before anything is touched, since pages go to the node that touches them
+  if (arena->node >= 0) {
+    mem_bind(&arena->region, arena->node);
+    mem_bind(&arena->slabs.region, arena->node);
+  }
+  // padding that aligns the blocks, the prologue and the epilogue header
+  if ((arena->heap_listp = mem_sbrk(
+           &arena->region, DOUBLE_SIZE + PROLOGUE_SIZE)) == nullptr) {
+    return -1;
+  }
+  arena->heap_listp +=
+      DOUBLE_SIZE;  // this points to the (empty) user block of the prologue
+  // create special first header block (prologue)
+  std::byte* prologue_ptr = arena->heap_listp;
+  put_uvalue_at(get_header_ptr(prologue_ptr), pack(PROLOGUE_SIZE, true));
+  put_uvalue_at(get_footer_ptr(prologue_ptr), pack(PROLOGUE_SIZE, true));
+  // create special last header (epilogue)
+  put_uvalue_at(get_header_ptr(get_nextblk_ptr(prologue_ptr)),
+                pack(0, true, true));
+  std::fill(std::begin(arena->free_lists), std::end(arena->free_lists),
+            nullptr);
+  arena->free_bitmap = 0;
+  arena->rover = nullptr;
+  std::fill(std::begin(arena->fast_lists), std::end(arena->fast_lists),
+            nullptr);
+  arena->num_fastblks = 0;
+  arena->scan_ptr = nullptr;
+  // nothing but the prologue has been written yet
+  arena->zero_ptr = get_header_ptr(get_nextblk_ptr(prologue_ptr));
+
+  if (extend_heap(arena, CHUNK_SIZE / WORD_SIZE) == nullptr) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Allocate a block of asize bytes from the arena.
+ *
+ * @param asize adjusted block size.
+ * @return pointer to the block or nullptr if the arena is out of memory.
+ */
+std::byte* arena_malloc(Arena* arena, std::size_t asize) {
+  std::size_t extendsize; /* if no blocks fit, extend heap by this size */
+  std::byte* block_ptr = nullptr;
+
+  // needs init
+  if (!arena_initialized(arena) && arena_init(arena) != 0) {
+    return nullptr;
+  }
+
+  if (asize <= SLAB_MAX_SIZE) {
+    return slab_malloc(&arena->slabs, asize);
+  }
+
+  // a deferred block of the same size needs neither a split nor a link update
+  if (DEFERRED_COALESCING && asize <= FAST_MAX_BLKSIZE) {
+    std::size_t bin = get_bin_index(asize);
+    if ((block_ptr = arena->fast_lists[bin]) != nullptr) {
+      arena->fast_lists[bin] = get_nextfree_ptr(block_ptr);
+      --arena->num_fastblks;
+      check_touched(arena, block_ptr, true);
+      return block_ptr;
+    }
+  }
+
+  // find fit
+  if ((block_ptr = find_fit(arena, asize)) != nullptr) {
+    place(arena, block_ptr, asize);
+    check_touched(arena, block_ptr, true);
+    return block_ptr;
+  }
+
+  // if no fit found, extend heap
+  extendsize = max(asize, CHUNK_SIZE);
+  // if extending heap fails (extend_heaps takes the number of words to extend
+  // by)
+  if ((block_ptr = extend_heap(arena, extendsize / WORD_SIZE)) == nullptr) {
+    return nullptr;
+  }
+  // otherwise
+  place(arena, block_ptr, asize);
+  check_touched(arena, block_ptr, true);
+  return block_ptr;
+}
+
+/*
+ * Allocate a zeroed block. A block that reaches above zero_ptr was carved
+ * out of the free block at the top of the heap, so apart from the memory
+ * below zero_ptr only that block's links and footer can be in it.
+ */
+std::byte* arena_calloc(Arena* arena, std::size_t asize, std::size_t size) {
+  if (!arena_initialized(arena) && arena_init(arena) != 0) {
+    return nullptr;
+  }
+  std::byte* zero_ptr = arena->zero_ptr;
+  std::byte* block_ptr = arena_malloc(arena, asize);
+  if (block_ptr == nullptr) {
+    return nullptr;
+  }
+
+  std::byte* end = block_ptr + size;
+  if (slab_contains(&arena->slabs, block_ptr) || end <= zero_ptr) {
+    std::memset(block_ptr, 0, size);
+    return block_ptr;
+  }
+  std::byte* dirty_end =
+      std::max(zero_ptr, block_ptr + 2 * sizeof(std::byte*));
+  std::memset(block_ptr, 0,
+              static_cast<std::size_t>(std::min(dirty_end, end) - block_ptr));
+  std::byte* footer_ptr = get_footer_ptr(block_ptr);
+  if (footer_ptr < end) {
+    std::memset(footer_ptr, 0, static_cast<std::size_t>(end - footer_ptr));
+  }
+  return block_ptr;
+}
+
+/*
+ * Allocate an aligned block from a free block with room for the block and
+ * the largest possible gap in front of it.
+ */
+std::byte* arena_memalign(Arena* arena, std::size_t alignment,
+                          std::size_t asize) {
+  if (!arena_initialized(arena) && arena_init(arena) != 0) {
+    return nullptr;
+  }
+
+  // the gap is either empty or a free block of its own
+  std::size_t search_size = asize + alignment + MIN_BLOCK_SIZE;
+  std::byte* block_ptr = find_fit(arena, search_size);
+
+  if (block_ptr == nullptr) {
+    block_ptr =
+        extend_heap(arena, max(search_size, CHUNK_SIZE) / WORD_SIZE);
+    if (block_ptr == nullptr) {
+      return nullptr;
+    }
+  }
+  block_ptr = place_aligned(arena, block_ptr, alignment, asize);
+  check_touched(arena, block_ptr, true);
+  return block_ptr;
+}
+
+/*
+ * Allocate a batch of blocks. Each round looks for one free block that can
+ * hold all remaining blocks, extending the heap if there is none; when even
+ * that fails the rest is allocated one block at a time.
+ */
+std::size_t arena_malloc_batch(Arena* arena, std::size_t asize,
+                               std::byte** block_ptrs, std::size_t count) {
+  std::size_t num_blocks = 0;
+
+  if (!arena_initialized(arena) && arena_init(arena) != 0) {
+    return 0;
+  }
+
+  if (asize <= SLAB_MAX_SIZE) {
+    while (num_blocks < count &&
+           (block_ptrs[num_blocks] = slab_malloc(&arena->slabs, asize)) !=
+               nullptr) {
+      ++num_blocks;
+    }
+    return num_blocks;
+  }
+
+  while (num_blocks < count) {
+    // keep a single fit well within the 32 bit block sizes
+    std::size_t want = std::min(count - num_blocks,
+                                max(BATCH_FIT_MAX / asize, std::size_t{1}));
+    // the run is padded to a cache line and may need a gap in front
+    std::size_t run_size =
+        (want * asize + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+    std::size_t search_size = run_size + CACHE_LINE_SIZE + MIN_BLOCK_SIZE;
+    std::byte* block_ptr = find_fit(arena, search_size);
+
+    if (block_ptr == nullptr) {
+      block_ptr = extend_heap(arena, max(search_size, CHUNK_SIZE) / WORD_SIZE);
+    }
+    if (block_ptr == nullptr) {
+      break;
+    }
+    block_ptr = split_gap(arena, block_ptr, CACHE_LINE_SIZE);
+    carve(arena, block_ptr, asize, want, run_size - want * asize,
+          block_ptrs + num_blocks);
+    for (std::size_t i = 0; i < want; ++i) {
+      check_touched(arena, block_ptrs[num_blocks++], true);
+    }
+  }
+
+  while (num_blocks < count &&
+         (block_ptrs[num_blocks] = arena_malloc(arena, asize)) != nullptr) {
+    ++num_blocks;
+  }
+  return num_blocks;
+}
+
+/*
+ * Allocate a batch for a thread cache, leaving the slots that share the last
+ * cache line with the next batch to that batch.
+ */
+std::size_t arena_refill(Arena* arena, std::size_t asize,
+                         std::byte** block_ptrs, std::size_t count) {
+  std::size_t num_blocks = arena_malloc_batch(arena, asize, block_ptrs, count);
+  if (asize > SLAB_MAX_SIZE) {
+    return num_blocks;
+  }
+  while (num_blocks > 1) {
+    std::uintptr_t end =
+        reinterpret_cast<std::uintptr_t>(block_ptrs[num_blocks - 1]) + asize;
+    if (end % CACHE_LINE_SIZE == 0) {
+      break;
+    }
+    slab_free(&arena->slabs, block_ptrs[--num_blocks]);
+  }
+  return num_blocks;
+}
+
+/*
+ * Return an allocated block to the arena's free lists.
+ *
+ * @param block_ptr pointer to an allocated block.
+ */
+void arena_free(Arena* arena, std::byte* block_ptr) {
+  if (slab_contains(&arena->slabs, block_ptr)) {
+    slab_free(&arena->slabs, block_ptr);
+    return;
+  }
+
+  check_touched(arena, block_ptr, true);
+  if (DEFERRED_COALESCING &&
+      get_blksize(get_header_ptr(block_ptr)) <= FAST_MAX_BLKSIZE) {
+    defer_free(arena, block_ptr);
+    return;
+  }
+  free_block(arena, block_ptr);
+}
+
+/*
+ * Push a block onto the arena's queue of remote frees.
+ */
+bool arena_push_remote(Arena* arena, std::byte* block_ptr) {
+  // counted before the push, so that a drain never subtracts a block's bytes
+  // before they were added
+  std::size_t size = arena_get_blksize(arena, block_ptr);
+  std::size_t queued =
+      arena->remote_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+
+  std::byte* head = arena->remote_frees.load(std::memory_order_relaxed);
+  do {
+    put_nextfree_ptr(block_ptr, head);
+  } while (!arena->remote_frees.compare_exchange_weak(
+      head, block_ptr, std::memory_order_release, std::memory_order_relaxed));
+  return queued >= REMOTE_DRAIN_BYTES;
+}
+
+/*
+ * Take the whole queue at once and free its blocks. Blocks are only ever
+ * pushed one by one and taken all together, so the queue needs no protection
+ * against a block being popped and pushed again (ABA) under a push.
+ */
+void arena_drain_remote(Arena* arena) {
+  if (arena->remote_frees.load(std::memory_order_relaxed) == nullptr) {
+    return;
+  }
+  std::byte* block_ptr =
+      arena->remote_frees.exchange(nullptr, std::memory_order_acquire);
+  std::size_t drained = 0;
+  while (block_ptr != nullptr) {
+    std::byte* next = get_nextfree_ptr(block_ptr);
+    drained += arena_get_blksize(arena, block_ptr);
+    arena_free(arena, block_ptr);
+    block_ptr = next;
+  }
+  arena->remote_bytes.fetch_sub(drained, std::memory_order_relaxed);
+}
+
+/*
+ * Mark an allocated block free, coalesce it and give memory back to the OS if
+ * it ended up in a large free block.
+ *
+ * @param block_ptr pointer to an allocated block that is not a slab slot.
+ */
+static void free_block(Arena* arena, std::byte* block_ptr) {
+  std::size_t size = get_blksize(get_header_ptr(block_ptr));
+
+  bool prev_allocated = get_prev_allocated(get_header_ptr(block_ptr));
+
+  // free block by setting allocated bit to 0.
+  put_uvalue_at(get_header_ptr(block_ptr), pack(size, false, prev_allocated));
+  put_uvalue_at(get_footer_ptr(block_ptr), pack(size, false));
+  put_prev_allocated(get_header_ptr(get_nextblk_ptr(block_ptr)), false);
+  release_freed(arena, coalesce(arena, block_ptr), block_ptr, size);
+}
+
+/*
+ * Push a freed block onto the fast list of its size without touching its
+ * header, sweeping all fast lists once FAST_SWEEP_COUNT blocks are waiting.
+ *
+ * @param block_ptr pointer to an allocated block of at most FAST_MAX_BLKSIZE
+ * bytes.
+ */
+static void defer_free(Arena* arena, std::byte* block_ptr) {
+  std::size_t bin = get_bin_index(get_blksize(get_header_ptr(block_ptr)));
+  put_nextfree_ptr(block_ptr, arena->fast_lists[bin]);
+  arena->fast_lists[bin] = block_ptr;
+  if (++arena->num_fastblks >= FAST_SWEEP_COUNT) {
+    sweep_fastblks(arena);
+  }
+}
+
+/*
+ * Free and coalesce all deferred blocks.
+ */
+static void sweep_fastblks(Arena* arena) {
+  for (std::byte*& fast_list : arena->fast_lists) {
+    while (fast_list != nullptr) {
+      std::byte* block_ptr = fast_list;
+      fast_list = get_nextfree_ptr(block_ptr);
+      free_block(arena, block_ptr);
+    }
+  }
+  arena->num_fastblks = 0;
+}
+
+/*
+ * Free a batch of blocks sorted by address. Slab slots (and blocks whose
+ * coalescing is deferred) are freed one by one, other heap blocks are grouped
+ * into runs of adjacent blocks that become a single free block before
+ * coalescing.
+ */
+void arena_free_batch(Arena* arena, std::byte** block_ptrs,
+                      std::size_t count) {
+  std::size_t i = 0;
+
+  while (i < count) {
+    std::byte* block_ptr = block_ptrs[i++];
+    if (slab_contains(&arena->slabs, block_ptr)) {
+      slab_free(&arena->slabs, block_ptr);
+      continue;
+    }
+
+    check_touched(arena, block_ptr, true);
+    std::size_t size = get_blksize(get_header_ptr(block_ptr));
+    if (DEFERRED_COALESCING && size <= FAST_MAX_BLKSIZE) {
+      defer_free(arena, block_ptr);
+      continue;
+    }
+    while (i < count && block_ptrs[i] == block_ptr + size) {
+      check_touched(arena, block_ptrs[i], true);
+      size += get_blksize(get_header_ptr(block_ptrs[i++]));
+    }
+
+    bool prev_allocated = get_prev_allocated(get_header_ptr(block_ptr));
+    put_uvalue_at(get_header_ptr(block_ptr),
+                  pack(size, false, prev_allocated));
+    put_uvalue_at(get_footer_ptr(block_ptr), pack(size, false));
+    put_prev_allocated(get_header_ptr(get_nextblk_ptr(block_ptr)), false);
+    release_freed(arena, coalesce(arena, block_ptr), block_ptr, size);
+  }
+}
+
+/*
+ * Coalesce free blocks around a given block and insert the resulting block
+ * into the free list. Free neighbours are unlinked from the free list before
+ * they are merged.
+ *
+ * @param block_ptr Pointer to block to coalesce. The block must be marked free
+ * (including the prev allocated bit of the next block) and must not be in the
+ * free list.
+ *
+ * @return ptr to coalesced block which may be the same as block_ptr
+ * in case both the previous and next blocks are allocated.
+ *
+ */
+static std::byte* coalesce(Arena* arena, std::byte* block_ptr) {
+  // is previous block allocated (only free blocks have a footer to look at)
+  bool prev_allocated = get_prev_allocated(get_header_ptr(block_ptr));
+  bool next_allocated =
+      get_allocated(get_header_ptr(get_nextblk_ptr(block_ptr)));
+
+  std::size_t coalesced_blksize = get_blksize(get_header_ptr(block_ptr));
+
+  // case 1: current and previous are allocated
+  if (prev_allocated && next_allocated) {
+    // a batch of adjacent blocks may have been merged into this one
+    forget_headers(arena, block_ptr, coalesced_blksize);
+    insert_freeblk(arena, block_ptr);
+    check_touched(arena, block_ptr, false);
+    return block_ptr;
+  }
+
+  ++arena->stats.coalesces;
+  std::byte* freed_ptr = block_ptr;
+  std::byte* next_blkptr = get_nextblk_ptr(block_ptr);
+  if (prev_allocated && !next_allocated) {
+    remove_freeblk(arena, get_nextblk_ptr(block_ptr));
+    coalesced_blksize +=
+        get_blksize(get_header_ptr(get_nextblk_ptr(block_ptr)));
+
+    put_uvalue_at(get_header_ptr(block_ptr),
+                  pack(coalesced_blksize, false, true));
+    // the header now holds the coalesced size so the footer lookup lands at
+    // the end of the (old) next block.
+    put_uvalue_at(get_footer_ptr(block_ptr), pack(coalesced_blksize, false));
+  } else if (!prev_allocated && next_allocated) {
+    remove_freeblk(arena, get_prevblk_ptr(block_ptr));
+    coalesced_blksize +=
+        get_blksize(get_header_ptr(get_prevblk_ptr(block_ptr)));
+
+    std::byte* prev_blkptr = get_prevblk_ptr(block_ptr);
+
+    put_uvalue_at(get_footer_ptr(block_ptr), pack(coalesced_blksize, false));
+    put_uvalue_at(get_header_ptr(get_prevblk_ptr(block_ptr)),
+                  pack(coalesced_blksize, false, true));
+
+    block_ptr = prev_blkptr;
+  } else {
+    remove_freeblk(arena, get_prevblk_ptr(block_ptr));
+    remove_freeblk(arena, get_nextblk_ptr(block_ptr));
+    coalesced_blksize +=
+        get_blksize(get_header_ptr(get_prevblk_ptr(block_ptr))) +
+        get_blksize(get_header_ptr(get_nextblk_ptr(block_ptr)));
+
+    std::byte* prev_blkptr = get_prevblk_ptr(block_ptr);
+
+    put_uvalue_at(get_header_ptr(get_prevblk_ptr(block_ptr)),
+                  pack(coalesced_blksize, false, true));
+    put_uvalue_at(get_footer_ptr(get_nextblk_ptr(block_ptr)),
+                  pack(coalesced_blksize, false));
+
+    block_ptr = prev_blkptr;
+  }
+
+  // the tags between the merged blocks are left in the middle of the block
+  if (!next_allocated) {
+    clear_boundary(arena, next_blkptr);
+  }
+  if (!prev_allocated) {
+    clear_boundary(arena, freed_ptr);
+  }
+  forget_headers(arena, block_ptr, coalesced_blksize);
+  insert_freeblk(arena, block_ptr);
+  check_touched(arena, block_ptr, false);
+  return block_ptr;
+}
+
+/*
+ * Give memory back to the OS after a block was freed: trim the heap if the
+ * block ended up in a large free block at the top of the heap, otherwise
+ * release the pages of the freed range if it is part of a large free block.
+ * Only the freed range is released since the rest of the free block was
+ * released when it was freed itself.
+ *
+ * @param block_ptr Pointer to the coalesced free block.
+ * @param freed_ptr Pointer to the block that was freed.
+ * @param freed_size Size of the block that was freed.
+ */
+static void release_freed(Arena* arena, std::byte* block_ptr,
+                          std::byte* freed_ptr, std::size_t freed_size) {
+  std::size_t size = get_blksize(get_header_ptr(block_ptr));
+  bool at_heap_top =
+      get_blksize(get_header_ptr(get_nextblk_ptr(block_ptr))) == 0;
+
+  if (at_heap_top && size > TRIM_THRESHOLD) {
+    trim_top(arena, TRIM_PAD);
+  } else if (size >= RELEASE_THRESHOLD) {
+    release_interior(arena, block_ptr, get_header_ptr(freed_ptr),
+                     get_header_ptr(freed_ptr) + freed_size);
+  }
+}
+
+/*
+ * Shrink the free block at the top of the heap (if there is one) to pad
+ * bytes and move the break down.
+ *
+ * @param pad Bytes to keep at the top of the heap. 0 removes the block.
+ * @return Number of bytes the heap shrunk by.
+ */
+static std::size_t trim_top(Arena* arena, std::size_t pad) {
+  // the epilogue header is right before the break
+  if (get_prev_allocated(get_header_ptr(arena->region.heap_brk))) {
+    return 0;
+  }
+  // the last block is free so its footer is right before the epilogue header
+  std::byte* last_ptr = get_prevblk_ptr(arena->region.heap_brk);
+
+  std::size_t size = get_blksize(get_header_ptr(last_ptr));
+  std::size_t keep = 0;
+  if (pad > 0) {
+    keep = max(pad + (DOUBLE_SIZE - pad % DOUBLE_SIZE) % DOUBLE_SIZE,
+               MIN_BLOCK_SIZE);
+  }
+  if (size <= keep) {
+    return 0;
+  }
+
+  remove_freeblk(arena, last_ptr);
+  if (arena->scan_ptr > last_ptr) {
+    arena->scan_ptr = last_ptr;  // the block or the new epilogue
+  }
+  if (keep > 0) {
+    put_uvalue_at(get_header_ptr(last_ptr), pack(keep, false, true));
+    put_uvalue_at(get_footer_ptr(last_ptr), pack(keep, false));
+    insert_freeblk(arena, last_ptr);
+  }
+  std::byte* old_brk = arena->region.heap_brk;
+  mem_trim(&arena->region, size - keep);
+  // new epilogue, the block before it is allocated if nothing was kept
+  put_uvalue_at(get_header_ptr(arena->region.heap_brk),
+                pack(0, true, keep == 0));
+  // the decommitted pages come back zero, the old tags must be cleared
+  arena->zero_ptr = std::min(arena->zero_ptr, arena->region.heap_commit);
+  clear_range(arena, old_brk - 2 * WORD_SIZE, old_brk);
+  if (keep == 0) {
+    clear_range(arena, last_ptr, last_ptr + 2 * sizeof(std::byte*));
+  }
+  return size - keep;
+}
+
+/*
+ * Release the pages of a free block that lie in [lo, hi). The free list
+ * links and the footer of the block are kept.
+ *
+ * @return Number of bytes released.
+ */
+static std::size_t release_interior(Arena* arena, std::byte* block_ptr,
+                                    std::byte* lo, std::byte* hi) {
+  std::byte* start = block_ptr + 2 * sizeof(std::byte*);
+  std::byte* end = get_footer_ptr(block_ptr);
+
+  start = std::max(start, lo);
+  end = std::min(end, hi);
+  if (end <= start) {
+    return 0;
+  }
+  return mem_release(&arena->region, start,
+                     static_cast<std::size_t>(end - start));
+}
+
+/*
+ * Give the arena's free memory back to the OS.
+ */
+std::size_t arena_trim(Arena* arena) {
+  if (!arena_initialized(arena)) {
+    return 0;
+  }
+
+  sweep_fastblks(arena);
+  std::size_t released = trim_top(arena, 0);
+  for (std::size_t bin = 0; bin < NUM_BINS; ++bin) {
+    for (std::byte* block_ptr = arena->free_lists[bin]; block_ptr != nullptr;
+         block_ptr = get_nextfree_ptr(block_ptr)) {
+      if (get_blksize(get_header_ptr(block_ptr)) > CHUNK_SIZE) {
+        released += release_interior(arena, block_ptr, block_ptr,
+                                     get_footer_ptr(block_ptr));
+      }
+    }
+  }
+  return released;
+}
+
+/*
+ * Set a checkpoint at the top of the heap.
+ */
+int arena_checkpoint(Arena* arena) {
+  if (!arena_initialized(arena) && arena_init(arena) != 0) {
+    return -1;
+  }
+  ArenaCheckpoint& checkpoint = arena->checkpoint;
+
+  // deferred blocks below the mark must not be handed out again
+  sweep_fastblks(arena);
+  std::byte* mark = arena->region.heap_brk;
+  std::byte* top_ptr = nullptr;
+  if (!get_prev_allocated(get_header_ptr(mark))) {
+    top_ptr = get_prevblk_ptr(mark);
+    remove_freeblk(arena, top_ptr);
+    mark = top_ptr;
+  }
+
+  std::copy(std::begin(arena->free_lists), std::end(arena->free_lists),
+            std::begin(checkpoint.free_lists));
+  checkpoint.free_bitmap = arena->free_bitmap;
+  checkpoint.stats = arena->stats;
+  checkpoint.mark = mark;
+  checkpoint.held = nullptr;
+  std::fill(std::begin(arena->free_lists), std::end(arena->free_lists),
+            nullptr);
+  arena->free_bitmap = 0;
+  arena->rover = nullptr;
+  if (top_ptr != nullptr) {
+    insert_freeblk(arena, top_ptr);
+  }
+  return 0;
+}
+
+/*
+ * Hold a block below the mark.
+ */
+void arena_hold(Arena* arena, std::byte* block_ptr) {
+  check_touched(arena, block_ptr, true);
+  put_nextfree_ptr(block_ptr, arena->checkpoint.held);
+  arena->checkpoint.held = block_ptr;
+}
+
+/*
+ * Roll back to the checkpoint. The block below the mark is allocated (free
+ * blocks below it are held instead) so the new free block at the mark needs
+ * no coalescing.
+ */
+void arena_rollback(Arena* arena) {
+  ArenaCheckpoint& checkpoint = arena->checkpoint;
+  std::byte* mark = checkpoint.mark;
+
+  std::copy(std::begin(checkpoint.free_lists), std::end(checkpoint.free_lists),
+            std::begin(arena->free_lists));
+  arena->free_bitmap = checkpoint.free_bitmap;
+  arena->rover = nullptr;
+  std::fill(std::begin(arena->fast_lists), std::end(arena->fast_lists),
+            nullptr);
+  arena->num_fastblks = 0;
+  ArenaStats& stats = arena->stats;
+  stats.free_blocks = checkpoint.stats.free_blocks;
+  stats.free_bytes = checkpoint.stats.free_bytes;
+  std::copy(std::begin(checkpoint.stats.free_blocks_by_class),
+            std::end(checkpoint.stats.free_blocks_by_class),
+            std::begin(stats.free_blocks_by_class));
+  if (arena->scan_ptr > mark) {
+    arena->scan_ptr = mark;
+  }
+  std::byte* held = checkpoint.held;
+  checkpoint.mark = nullptr;
+  checkpoint.held = nullptr;
+
+  std::size_t size = static_cast<std::size_t>(arena->region.heap_brk - mark);
+  // the tags of the old top block end up in the middle of the new one
+  std::byte* epilogue_ptr = get_header_ptr(arena->region.heap_brk);
+  if (size > 0 && !get_prev_allocated(epilogue_ptr)) {
+    clear_boundary(arena, get_prevblk_ptr(arena->region.heap_brk));
+  }
+  put_uvalue_at(get_header_ptr(arena->region.heap_brk),
+                pack(0, true, size == 0));
+  if (size > 0) {
+    put_uvalue_at(get_header_ptr(mark), pack(size, false, true));
+    put_uvalue_at(get_footer_ptr(mark), pack(size, false));
+    insert_freeblk(arena, mark);
+    check_touched(arena, mark, false);
+    if (size > TRIM_THRESHOLD) {
+      trim_top(arena, TRIM_PAD);
+    }
+  }
+  free_held(arena, held);
+}
+
+/*
+ * Merge the lists put aside back into the free lists, in front of the blocks
+ * above the mark.
+ */
+void arena_commit(Arena* arena) {
+  ArenaCheckpoint& checkpoint = arena->checkpoint;
+
+  for (std::size_t bin = 0; bin < NUM_BINS; ++bin) {
+    std::byte* saved = checkpoint.free_lists[bin];
+    if (saved == nullptr) {
+      continue;
+    }
+    std::byte* tail = saved;
+    while (get_nextfree_ptr(tail) != nullptr) {
+      tail = get_nextfree_ptr(tail);
+    }
+    std::byte* head = arena->free_lists[bin];
+    put_nextfree_ptr(tail, head);
+    if (head != nullptr) {
+      put_prevfree_ptr(head, tail);
+    }
+    arena->free_lists[bin] = saved;
+  }
+  arena->free_bitmap |= checkpoint.free_bitmap;
+  std::byte* held = checkpoint.held;
+  checkpoint.mark = nullptr;
+  checkpoint.held = nullptr;
+  free_held(arena, held);
+}
+
+/*
+ * Free the blocks held while a checkpoint was set.
+ *
+ * @param held first block of the list of held blocks.
+ */
+static void free_held(Arena* arena, std::byte* held) {
+  while (held != nullptr) {
+    std::byte* block_ptr = held;
+    held = get_nextfree_ptr(block_ptr);
+    arena_free(arena, block_ptr);
+  }
+}
+
+/*
+ * Insert a free block at the head of the free list of its size class.
+ *
+ * @param block_ptr Pointer to a free (user) block that is not in a list.
+ */
+static void insert_freeblk(Arena* arena, std::byte* block_ptr) {
+  std::size_t bin = get_bin_index(get_blksize(get_header_ptr(block_ptr)));
+  std::byte* head = arena->free_lists[bin];
+
+  put_nextfree_ptr(block_ptr, head);
+  put_prevfree_ptr(block_ptr, nullptr);
+  if (head != nullptr) {
+    put_prevfree_ptr(head, block_ptr);
+  }
+  arena->free_lists[bin] = block_ptr;
+  arena->free_bitmap |= (uint64_t{1} << bin);
+  count_freeblk(arena, block_ptr, 1);
+}
+
+/*
+ * Count a block going into (delta 1) or out of (delta -1) the free lists.
+ */
+static void count_freeblk(Arena* arena, std::byte* block_ptr, int delta) {
+  std::size_t size = get_blksize(get_header_ptr(block_ptr));
+  ArenaStats& stats = arena->stats;
+  stats.free_blocks += static_cast<uint64_t>(delta);
+  stats.free_bytes += static_cast<uint64_t>(delta) * size;
+  stats.free_blocks_by_class[stats_class(size)] += static_cast<uint64_t>(delta);
+}
+
+/*
+ * Unlink a block from the free list of its size class.
+ *
+ * @param block_ptr Pointer to a free (user) block that is in a list. Its
+ * header must still hold the size it was inserted with.
+ */
+static void remove_freeblk(Arena* arena, std::byte* block_ptr) {
+  std::byte* next = get_nextfree_ptr(block_ptr);
+  std::byte* prev = get_prevfree_ptr(block_ptr);
+
+  count_freeblk(arena, block_ptr, -1);
+  if (block_ptr == arena->rover) {
+    arena->rover = next;
+  }
+  if (prev != nullptr) {
+    put_nextfree_ptr(prev, next);
+  } else {
+    std::size_t bin = get_bin_index(get_blksize(get_header_ptr(block_ptr)));
+    arena->free_lists[bin] = next;
+    if (next == nullptr) {
+      arena->free_bitmap &= ~(uint64_t{1} << bin);
+    }
+  }
+  if (next != nullptr) {
+    put_prevfree_ptr(next, prev);
+  }
+}
+
+/*
+ * Resize an allocated block of this arena. Shrinking splits the tail off into
+ * a free block, growing absorbs a free successor and a block at the top of the
+ * heap grows by extending the heap. Only when none of these work is a new
+ * block allocated and the contents copied over.
+ */
+std::byte* arena_realloc(Arena* arena, std::byte* block_ptr,
+                         std::size_t size) {
+  if (slab_contains(&arena->slabs, block_ptr)) {
+    return realloc_slot(arena, block_ptr, size);
+  }
+
+  check_touched(arena, block_ptr, true);
+  // heap blocks stay heap blocks even when they shrink to a slab size
+  std::size_t asize = max(adjust_blksize(size), MIN_BLOCK_SIZE);
+  std::size_t oldsize = get_blksize(get_header_ptr(block_ptr));
+
+  if (asize <= oldsize) {
+    shrink_allocated(arena, block_ptr, asize);
+    check_touched(arena, block_ptr, true);
+    return block_ptr;
+  }
+
+  if (grow_in_place(arena, block_ptr, asize)) {
+    check_touched(arena, block_ptr, true);
+    return block_ptr;
+  }
+
+  std::byte* new_blkptr = arena_malloc(arena, asize);
+
+  if (!new_blkptr) {
+    return nullptr;
+  }
+
+  // only the user part of the block (without header) is copied.
+  // The requested size is always larger than that here.
+  std::memcpy(new_blkptr, block_ptr, oldsize - BLOCK_OVERHEAD);
+  arena_free(arena, block_ptr);
+
+  return new_blkptr;
+}
+
+/*
+ * Resize a slab slot. Slots cannot grow, so a slot that is too small is
+ * replaced by a new block or slot.
+ */
+static std::byte* realloc_slot(Arena* arena, std::byte* slot_ptr,
+                               std::size_t size) {
+  std::size_t slot_size = slab_get_slot_size(slot_ptr);
+
+  if (size <= slot_size) {
+    return slot_ptr;
+  }
+
+  std::byte* new_blkptr = arena_malloc(arena, adjust_blksize(size));
+  if (!new_blkptr) {
+    return nullptr;
+  }
+  std::memcpy(new_blkptr, slot_ptr, slot_size);
+  slab_free(&arena->slabs, slot_ptr);
+  return new_blkptr;
+}
+
+/*
+ * Shrink an allocated block to asize bytes. If the tail is large enough to
+ * form a block of its own it is split off, coalesced with a free successor
+ * and put back in the free lists.
+ *
+ * @param block_ptr Pointer to an allocated block.
+ * @param asize New block size, at most the current block size.
+ */
+static void shrink_allocated(Arena* arena, std::byte* block_ptr,
+                             std::size_t asize) {
+  std::size_t curr_size = get_blksize(get_header_ptr(block_ptr));
+
+  if ((curr_size - asize) < MIN_BLOCK_SIZE) {
+    return;
+  }
+
+  bool prev_allocated = get_prev_allocated(get_header_ptr(block_ptr));
+  put_uvalue_at(get_header_ptr(block_ptr), pack(asize, true, prev_allocated));
+
+  std::byte* tail_ptr = get_nextblk_ptr(block_ptr);
+  put_uvalue_at(get_header_ptr(tail_ptr),
+                pack(curr_size - asize, false, true));
+  put_uvalue_at(get_footer_ptr(tail_ptr), pack(curr_size - asize, false));
+  put_prev_allocated(get_header_ptr(get_nextblk_ptr(tail_ptr)), false);
+  release_freed(arena, coalesce(arena, tail_ptr), tail_ptr, curr_size - asize);
+}
+
+/*
+ * Try to grow an allocated block to asize bytes without moving it by
+ * absorbing its free successor. If the block (or its free successor) is the
+ * last block of the heap, the heap is extended first.
+ *
+ * @param block_ptr Pointer to an allocated block.
+ * @param asize New block size, larger than the current block size.
+ *
+ * @return true if the block now has at least asize bytes.
+ */
+static bool grow_in_place(Arena* arena, std::byte* block_ptr,
+                          std::size_t asize) {
+  std::size_t curr_size = get_blksize(get_header_ptr(block_ptr));
+  std::byte* next_ptr = get_nextblk_ptr(block_ptr);
+  std::size_t available = curr_size;
+  bool at_heap_top = get_blksize(get_header_ptr(next_ptr)) == 0;
+
+  if (!get_allocated(get_header_ptr(next_ptr))) {
+    available += get_blksize(get_header_ptr(next_ptr));
+    at_heap_top =
+        get_blksize(get_header_ptr(get_nextblk_ptr(next_ptr))) == 0;
+  }
+
+  if (available < asize) {
+    if (!at_heap_top) {
+      return false;
+    }
+    // the new space coalesces with the free successor, if there is one
+    std::size_t extendsize = max(asize - available, CHUNK_SIZE);
+    if (extend_heap(arena, extendsize / WORD_SIZE) == nullptr) {
+      return false;
+    }
+  }
+
+  next_ptr = get_nextblk_ptr(block_ptr);
+  std::size_t merged_size = curr_size + get_blksize(get_header_ptr(next_ptr));
+  remove_freeblk(arena, next_ptr);
+  forget_headers(arena, block_ptr, merged_size);
+
+  bool prev_allocated = get_prev_allocated(get_header_ptr(block_ptr));
+  put_uvalue_at(get_header_ptr(block_ptr),
+                pack(merged_size, true, prev_allocated));
+  put_prev_allocated(get_header_ptr(get_nextblk_ptr(block_ptr)), true);
+  shrink_allocated(arena, block_ptr, asize);
+  mark_dirty(arena, block_ptr);
+  return true;
+}
+
+/*
+ * Extend heap by creating a new block of size "words" * WORD_SIZE bytes.
+ *
+ * @param words Number of words to extend the heap by.
+ * @return pointer to the new block.
+ */
+static std::byte* extend_heap(Arena* arena, std::size_t words) {
+  // round up to next multiple of DOUBLE_SIZE
+  std::size_t size =
+      (words * WORD_SIZE + DOUBLE_SIZE - 1) & ~(DOUBLE_SIZE - 1);
+  ++arena->stats.extend_heap_calls;
+
+  std::byte* block_ptr = nullptr;
+
+  if ((block_ptr = mem_sbrk(&arena->region, size)) == nullptr) {
+    return nullptr;
+  }
+
+  // initialize the new block
+
+  // overwrite prev free list epilogue, which knows if the last block is
+  // allocated
+  bool prev_allocated = get_prev_allocated(get_header_ptr(block_ptr));
+  put_uvalue_at(get_header_ptr(block_ptr), pack(size, false, prev_allocated));
+  put_uvalue_at(get_footer_ptr(block_ptr), pack(size, false));
+  // create new epilogue
+  put_uvalue_at(get_header_ptr(get_nextblk_ptr(block_ptr)),
+                pack(0, true, false));
+
+  return coalesce(arena, block_ptr);
+}
+
+/*
+ * Place block of asize bytes at start of a free block "block_ptr"
+ * and split block if remainder would be at least minimum block size.
+ * The block is removed from the free list and the remainder, if any, is
+ * inserted back into it.
+ *
+ * @param block_ptr Pointer to free block
+ * @param asize block size
+ */
+static void place(Arena* arena, std::byte* block_ptr, std::size_t asize) {
+  std::size_t curr_size = get_blksize(get_header_ptr(block_ptr));
+
+  remove_freeblk(arena, block_ptr);
+
+  // a free block always follows an allocated one
+  if ((curr_size - asize) >= MIN_BLOCK_SIZE) {
+    put_uvalue_at(get_header_ptr(block_ptr), pack(asize, true, true));
+    mark_dirty(arena, block_ptr);
+
+    block_ptr = get_nextblk_ptr(block_ptr);
+
+    put_uvalue_at(get_header_ptr(block_ptr),
+                  pack(curr_size - asize, false, true));
+    put_uvalue_at(get_footer_ptr(block_ptr), pack(curr_size - asize, false));
+    insert_freeblk(arena, block_ptr);
+  } else {
+    put_uvalue_at(get_header_ptr(block_ptr), pack(curr_size, true, true));
+    put_prev_allocated(get_header_ptr(get_nextblk_ptr(block_ptr)), true);
+    mark_dirty(arena, block_ptr);
+  }
+}
+
+/*
+ * Place an aligned block of asize bytes in a free block. The gap in front of
+ * it becomes a free block, the rest is split off as in place.
+ *
+ * @param block_ptr Pointer to a free block with room for the gap and asize.
+ * @param alignment power of two larger than DOUBLE_SIZE.
+ * @return pointer to the aligned block.
+ */
+static std::byte* place_aligned(Arena* arena, std::byte* block_ptr,
+                                std::size_t alignment, std::size_t asize) {
+  std::size_t curr_size = get_blksize(get_header_ptr(block_ptr));
+  std::size_t gap = aligned_gap(block_ptr, alignment);
+
+  remove_freeblk(arena, block_ptr);
+
+  // a free block always follows an allocated one
+  if (gap > 0) {
+    put_uvalue_at(get_header_ptr(block_ptr), pack(gap, false, true));
+    put_uvalue_at(get_footer_ptr(block_ptr), pack(gap, false));
+    insert_freeblk(arena, block_ptr);
+    block_ptr += gap;
+    curr_size -= gap;
+  }
+
+  if ((curr_size - asize) >= MIN_BLOCK_SIZE) {
+    put_uvalue_at(get_header_ptr(block_ptr), pack(asize, true, gap == 0));
+
+    std::byte* rest_ptr = get_nextblk_ptr(block_ptr);
+    put_uvalue_at(get_header_ptr(rest_ptr),
+                  pack(curr_size - asize, false, true));
+    put_uvalue_at(get_footer_ptr(rest_ptr), pack(curr_size - asize, false));
+    insert_freeblk(arena, rest_ptr);
+  } else {
+    put_uvalue_at(get_header_ptr(block_ptr),
+                  pack(curr_size, true, gap == 0));
+    put_prev_allocated(get_header_ptr(get_nextblk_ptr(block_ptr)), true);
+  }
+  mark_dirty(arena, block_ptr);
+  return block_ptr;
+}
+
+/*
+ * Offset of the first address in a free block that is aligned to alignment
+ * and leaves either no gap or a gap that can hold a free block in front.
+ */
+static std::size_t aligned_gap(std::byte* block_ptr, std::size_t alignment) {
+  std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(block_ptr);
+  std::uintptr_t aligned = (addr + alignment - 1) & ~(alignment - 1);
+  // a gap must be able to hold a free block
+  while (aligned != addr && aligned - addr < MIN_BLOCK_SIZE) {
+    aligned += alignment;
+  }
+  return aligned - addr;
+}
+
+/*
+ * Split the gap in front of the first aligned address off a free block, see
+ * aligned_gap. Both parts stay in the free lists.
+ *
+ * @param block_ptr Pointer to a free block with room for the gap.
+ * @return pointer to the free block at the aligned address.
+ */
+static std::byte* split_gap(Arena* arena, std::byte* block_ptr,
+                            std::size_t alignment) {
+  std::size_t gap = aligned_gap(block_ptr, alignment);
+  if (gap == 0) {
+    return block_ptr;
+  }
+  std::size_t curr_size = get_blksize(get_header_ptr(block_ptr));
+
+  remove_freeblk(arena, block_ptr);
+  put_uvalue_at(get_header_ptr(block_ptr), pack(gap, false, true));
+  put_uvalue_at(get_footer_ptr(block_ptr), pack(gap, false));
+  insert_freeblk(arena, block_ptr);
+
+  block_ptr += gap;
+  put_uvalue_at(get_header_ptr(block_ptr), pack(curr_size - gap, false, false));
+  put_uvalue_at(get_footer_ptr(block_ptr), pack(curr_size - gap, false));
+  insert_freeblk(arena, block_ptr);
+  return block_ptr;
+}
+
+/*
+ * Split a free block into count allocated blocks of asize bytes, the last of
+ * which gets pad bytes more. The rest of the block becomes a free block if it
+ * is large enough, otherwise it is given to the last allocated block.
+ *
+ * @param block_ptr Pointer to a free block of at least count * asize + pad
+ * bytes.
+ * @param pad multiple of DOUBLE_SIZE.
+ * @param block_ptrs receives the count blocks.
+ * @return count.
+ */
+static std::size_t carve(Arena* arena, std::byte* block_ptr, std::size_t asize,
+                         std::size_t count, std::size_t pad,
+                         std::byte** block_ptrs) {
+  std::size_t curr_size = get_blksize(get_header_ptr(block_ptr));
+  std::size_t rest_size = curr_size - count * asize - pad;
+  bool prev_allocated = get_prev_allocated(get_header_ptr(block_ptr));
+
+  remove_freeblk(arena, block_ptr);
+
+  // a free block always follows an allocated one
+  for (std::size_t i = 0; i < count; ++i) {
+    std::size_t size = asize;
+    if (i == count - 1) {
+      size += rest_size < MIN_BLOCK_SIZE ? pad + rest_size : pad;
+    }
+    put_uvalue_at(get_header_ptr(block_ptr),
+                  pack(size, true, i > 0 || prev_allocated));
+    block_ptrs[i] = block_ptr;
+    block_ptr = get_nextblk_ptr(block_ptr);
+  }
+
+  mark_dirty(arena, block_ptrs[count - 1]);
+  if (rest_size >= MIN_BLOCK_SIZE) {
+    put_uvalue_at(get_header_ptr(block_ptr), pack(rest_size, false, true));
+    put_uvalue_at(get_footer_ptr(block_ptr), pack(rest_size, false));
+    insert_freeblk(arena, block_ptr);
+  } else {
+    put_prev_allocated(get_header_ptr(block_ptr), true);
+  }
+  return count;
+}
+
+/*
+ * Finds a fitting block for asize. The first non-empty size class that can
+ * hold asize is found through the bin bitmap and searched according to
+ * FIT_POLICY. If the class has no fitting block, the next non-empty class is
+ * searched.
+ *
+ * @param asize Minimum of the block to find fit for.
+ *
+ * @return pointer to block. Returns nullptr is no fitting block is found.
+ */
+static std::byte* find_fit(Arena* arena, std::size_t asize) {
+  ++arena->stats.find_fit_calls;
+  std::size_t bin = get_bin_index(asize);
+  uint64_t candidates = arena->free_bitmap & (~uint64_t{0} << bin);
+
+  while (candidates != 0) {
+    std::size_t fit_bin = std::countr_zero(candidates);
+    // every block in an exact class or in a class above asize's class fits
+    bool all_fit = fit_bin != bin || bin < NUM_EXACT_BINS;
+    std::byte* block_ptr =
+        find_fit_in_list<FIT_POLICY>(arena, fit_bin, asize, all_fit);
+    if (block_ptr != nullptr) {
+      if constexpr (FIT_POLICY == FitPolicy::next) {
+        // place() unlinks the block which moves the rover to its successor
+        arena->rover = block_ptr;
+      }
+      return block_ptr;
+    }
+    candidates &= candidates - 1;  // clear lowest set bit
+  }
+
+  // the deferred blocks may coalesce into a fit before the heap has to grow
+  if (arena->num_fastblks > 0) {
+    sweep_fastblks(arena);
+    return find_fit(arena, asize);
+  }
+  return nullptr;
+}
+
+/*
+ * Search a single (non-empty) free list for a block of at least asize bytes.
+ *
+ * @param bin index of the free list to search.
+ * @param asize Minimum size of the block.
+ * @param all_fit true if every block in the list is known to fit.
+ *
+ * @return pointer to block or nullptr if no block in the list fits.
+ */
+template <FitPolicy policy>
+static std::byte* find_fit_in_list(Arena* arena, std::size_t bin,
+                                   std::size_t asize, bool all_fit) {
+  std::byte* head = arena->free_lists[bin];
+  uint64_t& probes = arena->stats.find_fit_probes;
+
+  if constexpr (policy == FitPolicy::first) {
+    if (all_fit) {
+      ++probes;
+      return head;
+    }
+    for (std::byte* block_ptr = head; block_ptr != nullptr;
+         block_ptr = get_nextfree_ptr(block_ptr)) {
+      ++probes;
+      if (asize <= get_blksize(get_header_ptr(block_ptr))) {
+        return block_ptr;
+      }
+    }
+    return nullptr;
+  } else if constexpr (policy == FitPolicy::next) {
+    std::byte* start = head;
+    if (arena->rover != nullptr &&
+        get_bin_index(get_blksize(get_header_ptr(arena->rover))) == bin) {
+      start = arena->rover;
+    }
+    if (all_fit) {
+      ++probes;
+      return start;
+    }
+    // walk from the rover to the end of the list and wrap around to its head
+    std::byte* block_ptr = start;
+    do {
+      ++probes;
+      if (asize <= get_blksize(get_header_ptr(block_ptr))) {
+        return block_ptr;
+      }
+      block_ptr = get_nextfree_ptr(block_ptr);
+      if (block_ptr == nullptr) {
+        block_ptr = head;
+      }
+    } while (block_ptr != start);
+    return nullptr;
+  } else {
+    // exact classes only hold blocks of a single size
+    if (bin < NUM_EXACT_BINS) {
+      ++probes;
+      return head;
+    }
+    std::size_t max_candidates = (policy == FitPolicy::good)
+                                     ? GOOD_FIT_CANDIDATES
+                                     : static_cast<std::size_t>(-1);
+    std::size_t num_candidates = 0;
+    std::byte* best_ptr = nullptr;
+    std::size_t best_size = 0;
+
+    for (std::byte* block_ptr = head;
+         block_ptr != nullptr && num_candidates < max_candidates;
+         block_ptr = get_nextfree_ptr(block_ptr)) {
+      ++probes;
+      std::size_t size = get_blksize(get_header_ptr(block_ptr));
+      if (size < asize) {
+        continue;
+      }
+      if (best_ptr == nullptr || size < best_size) {
+        best_ptr = block_ptr;
+        best_size = size;
+        if (size == asize) {
+          break;
+        }
+      }
+      ++num_candidates;
+    }
+    return best_ptr;
+  }
+}
+
+/*
+ * print contents of block
+ */
+static void printblock(std::byte* block_ptr) {
+  std::size_t hsize, halloc, fsize, falloc;
+
+  hsize = get_blksize(get_header_ptr(block_ptr));
+  halloc = get_allocated(get_header_ptr(block_ptr));
+
+  if (hsize == 0) {
+    fmt::print("{}: EOL\n", fmt::ptr(block_ptr));
+    return;
+  }
+  if (halloc && hsize != PROLOGUE_SIZE) {
+    fmt::print("{}: header: [{}:a], no footer\n", fmt::ptr(block_ptr), hsize);
+    return;
+  }
+
+  fsize = get_blksize(get_footer_ptr(block_ptr));
+  falloc = get_allocated(get_footer_ptr(block_ptr));
+
+  fmt::print("{}: header: [{}:{}], footer: [{}:{}]", fmt::ptr(block_ptr), hsize,
+             (halloc ? 'a' : 'f'), fsize, (falloc ? 'a' : 'f'));
+}
+
+/*
+ * @return false (after printing an error) if the block is misaligned or its
+ * header does not match its footer.
+ */
+static bool checkblock(std::byte* block_ptr) {
+  bool ok = true;
+  bool is_aligned =
+      (reinterpret_cast<std::uintptr_t>(block_ptr) % DOUBLE_SIZE == 0);
+
+  if (!is_aligned) {
+    fmt::print("Error: {} is not doubleword algined\n", fmt::ptr(block_ptr));
+    ok = false;
+  }
+
+  // allocated blocks other than the prologue have no footer
+  std::byte* header_ptr = get_header_ptr(block_ptr);
+  if (get_allocated(header_ptr) &&
+      get_blksize(header_ptr) != PROLOGUE_SIZE) {
+    return ok;
+  }
+  std::byte* footer_ptr = get_footer_ptr(block_ptr);
+  if (get_blksize(header_ptr) != get_blksize(footer_ptr) ||
+      get_allocated(header_ptr) != get_allocated(footer_ptr)) {
+    fmt::print("Error: header does not match footer\n");
+    ok = false;
+  }
+  return ok;
+}
+
+/*
+ * Walk the free lists and check that every block in them is free and in the
+ * right size class, that the links are consistent in both directions, that
+ * the bitmap matches the lists and that the lists hold exactly the free blocks
+ * found while walking the heap.
+ *
+ * @param heap_freeblks Number of free blocks found by walking the heap.
+ * @return false (after printing an error) if something does not match.
+ */
+static bool checkfreelist(Arena* arena, std::size_t heap_freeblks) {
+  std::size_t list_freeblks = 0;
+  bool ok = checklists(arena->free_lists, arena->free_bitmap, &list_freeblks);
+  // the free blocks below the mark of a checkpoint are in the lists put aside
+  if (arena_checkpointed(arena)) {
+    ok = checklists(arena->checkpoint.free_lists,
+                    arena->checkpoint.free_bitmap, &list_freeblks) &&
+         ok;
+  }
+
+  if (list_freeblks != arena->stats.free_blocks) {
+    fmt::print("Error: free lists have {} blocks but {} are counted\n",
+               list_freeblks, arena->stats.free_blocks);
+    ok = false;
+  }
+  if (list_freeblks != heap_freeblks) {
+    fmt::print("Error: free list has {} blocks but heap has {} free blocks\n",
+               list_freeblks, heap_freeblks);
+    ok = false;
+  }
+  return ok;
+}
+
+/*
+ * Check one set of free lists and their bitmap, see checkfreelist.
+ *
+ * @param list_freeblks incremented by the number of blocks in the lists.
+ * @return false (after printing an error) if a list or the bitmap is bad.
+ */
+static bool checklists(std::byte* const* free_lists, uint64_t free_bitmap,
+                       std::size_t* list_freeblks) {
+  bool ok = true;
+
+  for (std::size_t bin = 0; bin < NUM_BINS; ++bin) {
+    bool bit_set = free_bitmap & (uint64_t{1} << bin);
+    if (bit_set != (free_lists[bin] != nullptr)) {
+      fmt::print("Error: bitmap does not match free list {}\n", bin);
+      ok = false;
+    }
+
+    std::byte* prev = nullptr;
+    for (std::byte* block_ptr = free_lists[bin]; block_ptr != nullptr;
+         block_ptr = get_nextfree_ptr(block_ptr)) {
+      if (get_allocated(get_header_ptr(block_ptr))) {
+        fmt::print("Error: allocated block {} in free list\n",
+                   fmt::ptr(block_ptr));
+        ok = false;
+      }
+      if (get_bin_index(get_blksize(get_header_ptr(block_ptr))) != bin) {
+        fmt::print("Error: free block {} in wrong size class\n",
+                   fmt::ptr(block_ptr));
+        ok = false;
+      }
+      if (get_prevfree_ptr(block_ptr) != prev) {
+        fmt::print("Error: bad prev link in free block {}\n",
+                   fmt::ptr(block_ptr));
+        ok = false;
+      }
+      prev = block_ptr;
+      ++*list_freeblks;
+    }
+  }
+  return ok;
+}
+
+/*
+ * Check that the fast lists only hold blocks of their size that are still
+ * marked allocated and that num_fastblks counts them.
+ *
+ * @return false (after printing an error) if they do not.
+ */
+static bool checkfastlists(Arena* arena) {
+  std::size_t num_fastblks = 0;
+  bool ok = true;
+
+  for (std::size_t bin = 0; bin < NUM_FAST_BINS; ++bin) {
+    for (std::byte* block_ptr = arena->fast_lists[bin]; block_ptr != nullptr;
+         block_ptr = get_nextfree_ptr(block_ptr)) {
+      std::byte* header_ptr = get_header_ptr(block_ptr);
+      if (!get_allocated(header_ptr) ||
+          get_bin_index(get_blksize(header_ptr)) != bin) {
+        fmt::print("Error: bad block {} in fast list {}\n",
+                   fmt::ptr(block_ptr), bin);
+        ok = false;
+      }
+      ++num_fastblks;
+    }
+  }
+
+  if (num_fastblks != arena->num_fastblks) {
+    fmt::print("Error: fast lists have {} blocks but {} are counted\n",
+               num_fastblks, arena->num_fastblks);
+    ok = false;
+  }
+  return ok;
+}
+
+/*
+ * Checks the arena's heap for correctness.
+ */
+bool arena_checkheap(Arena* arena, int verbose) {
+  std::byte* block_ptr = arena->heap_listp;
+  std::size_t heap_freeblks = 0;
+  bool ok = true;
+
+  if (verbose) {
+    fmt::print("Heap ({}):\n", fmt::ptr(arena->heap_listp));
+  }
+
+  if ((get_blksize(get_header_ptr(block_ptr))) != PROLOGUE_SIZE ||
+      !get_allocated(get_header_ptr(arena->heap_listp))) {
+    fmt::print("Bad prologue header\n");
+    ok = false;
+  }
+  ok = checkblock(arena->heap_listp) && ok;
+
+  bool prev_allocated = true;
+  for (block_ptr = arena->heap_listp;
+       get_blksize(get_header_ptr(block_ptr)) > 0;
+       block_ptr = get_nextblk_ptr(block_ptr)) {
+    if (verbose) {
+      printblock(block_ptr);
+    }
+
+    ok = checkblock(block_ptr) && ok;
+    bool allocated = get_allocated(get_header_ptr(block_ptr));
+    if (block_ptr != arena->heap_listp &&
+        get_prev_allocated(get_header_ptr(block_ptr)) != prev_allocated) {
+      fmt::print("Error: {} has a bad prev allocated bit\n",
+                 fmt::ptr(block_ptr));
+      ok = false;
+    }
+    if (!allocated && !prev_allocated) {
+      fmt::print("Error: {} was not coalesced with the previous block\n",
+                 fmt::ptr(block_ptr));
+      ok = false;
+    }
+    if (!allocated) {
+      ++heap_freeblks;
+    }
+    prev_allocated = allocated;
+  }
+  if (get_prev_allocated(get_header_ptr(block_ptr)) != prev_allocated) {
+    fmt::print("Error: epilogue has a bad prev allocated bit\n");
+    ok = false;
+  }
+
+  if (verbose) {
+    printblock(block_ptr);
+  }
+  if ((get_blksize(get_header_ptr(block_ptr))) != 0 ||
+      !(get_allocated(get_header_ptr(block_ptr)))) {
+    fmt::print("Bad epilogue header\n");
+    ok = false;
+  }
+
+  ok = checkfreelist(arena, heap_freeblks) && ok;
+  ok = checkfastlists(arena) && ok;
+  return slab_checkheap(&arena->slabs, verbose) && ok;
+}
+
+/*
+ * Check the next blocks of the heap. A block with a bad size cannot be
+ * stepped over, so the scan starts over after it.
+ */
+bool arena_check_step(Arena* arena, std::size_t max_blocks) {
+  if (!arena_initialized(arena)) {
+    return true;
+  }
+
+  std::byte* block_ptr =
+      arena->scan_ptr != nullptr ? arena->scan_ptr : arena->heap_listp;
+  bool ok = true;
+  for (std::size_t i = 0; i < max_blocks && ok; ++i) {
+    if (block_ptr == arena->region.heap_brk) {
+      std::byte* header_ptr = get_header_ptr(block_ptr);
+      if (get_blksize(header_ptr) != 0 || !get_allocated(header_ptr)) {
+        fmt::print("Error: bad epilogue header\n");
+        ok = false;
+      }
+      block_ptr = arena->heap_listp;
+    } else if ((ok = checkblock_local(arena, block_ptr))) {
+      block_ptr = get_nextblk_ptr(block_ptr);
+    } else {
+      block_ptr = arena->heap_listp;
+    }
+  }
+  arena->scan_ptr = block_ptr;
+  return ok;
+}
+
+/*
+ * Check a single block and what can be checked around it in constant time.
+ *
+ * @param block_ptr pointer to a block in [heap_listp, heap_brk).
+ * @return false (after printing an error) if the block is corrupted.
+ */
+static bool checkblock_local(Arena* arena, std::byte* block_ptr) {
+  std::byte* header_ptr = get_header_ptr(block_ptr);
+  std::size_t size = get_blksize(header_ptr);
+  bool allocated = get_allocated(header_ptr);
+  std::size_t min_size =
+      block_ptr == arena->heap_listp ? PROLOGUE_SIZE : MIN_BLOCK_SIZE;
+
+  if (reinterpret_cast<std::uintptr_t>(block_ptr) % DOUBLE_SIZE != 0 ||
+      size % DOUBLE_SIZE != 0 || size < min_size ||
+      size > static_cast<std::size_t>(arena->region.heap_brk - block_ptr)) {
+    fmt::print("Error: {} has a bad size {}\n", fmt::ptr(block_ptr), size);
+    return false;
+  }
+  std::byte* next_ptr = get_nextblk_ptr(block_ptr);
+  if (get_prev_allocated(get_header_ptr(next_ptr)) != allocated) {
+    fmt::print("Error: {} has a bad prev allocated bit\n", fmt::ptr(next_ptr));
+    return false;
+  }
+  if (allocated) {
+    return true;
+  }
+
+  std::byte* footer_ptr = get_footer_ptr(block_ptr);
+  if (get_blksize(footer_ptr) != size || get_allocated(footer_ptr)) {
+    fmt::print("Error: header of {} does not match its footer\n",
+               fmt::ptr(block_ptr));
+    return false;
+  }
+  if (!get_prev_allocated(header_ptr) ||
+      !get_allocated(get_header_ptr(next_ptr))) {
+    fmt::print("Error: {} was not coalesced\n", fmt::ptr(block_ptr));
+    return false;
+  }
+
+  std::byte* next = get_nextfree_ptr(block_ptr);
+  std::byte* prev = get_prevfree_ptr(block_ptr);
+  std::size_t bin = get_bin_index(size);
+  // free blocks below the mark of a checkpoint are in the lists put aside
+  bool below_mark = arena_below_mark(arena, block_ptr);
+  std::byte* const* free_lists =
+      below_mark ? arena->checkpoint.free_lists : arena->free_lists;
+  uint64_t free_bitmap =
+      below_mark ? arena->checkpoint.free_bitmap : arena->free_bitmap;
+  bool next_linked = next == nullptr || (in_heap(arena, next) &&
+                                         get_prevfree_ptr(next) == block_ptr);
+  bool prev_linked = prev == nullptr ? free_lists[bin] == block_ptr
+                                     : in_heap(arena, prev) &&
+                                           get_nextfree_ptr(prev) == block_ptr;
+  bool bit_set = free_bitmap & (uint64_t{1} << bin);
+  if (!next_linked || !prev_linked || !bit_set) {
+    fmt::print("Error: free block {} has bad free list links\n",
+               fmt::ptr(block_ptr));
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Is block_ptr a possible block pointer of the arena's heap?
+ */
+static bool in_heap(const Arena* arena, const std::byte* block_ptr) {
+  return block_ptr > arena->heap_listp && block_ptr < arena->region.heap_brk &&
+         reinterpret_cast<std::uintptr_t>(block_ptr) % DOUBLE_SIZE == 0;
+}
+
+/*
+ * With CHECK_BLOCKS, check a block an operation is about to hand out, free or
+ * resize (allocated) or has just freed (not allocated) and advance the
+ * incremental scan. Aborts if the heap is corrupted.
+ */
+static void check_touched(Arena* arena, std::byte* block_ptr, bool allocated) {
+  if constexpr (CHECK_BLOCKS) {
+    bool ok = true;
+    if (!in_heap(arena, block_ptr) ||
+        get_allocated(get_header_ptr(block_ptr)) != allocated) {
+      fmt::print("Error: {} is not {}\n", fmt::ptr(block_ptr),
+                 allocated ? "an allocated block" : "a free block");
+      ok = false;
+    }
+    ok = ok && checkblock_local(arena, block_ptr) &&
+         arena_check_step(arena, CHECK_SCAN_STEP);
+    if (!ok) {
+      std::fflush(stdout);
+      std::abort();
+    }
+  }
+}
+
+/*
+ * Blocks were merged into the block at block_ptr of size bytes: make sure
+ * the incremental scan does not resume at one of their stale headers.
+ */
+static void forget_headers(Arena* arena, std::byte* block_ptr,
+                           std::size_t size) {
+  if (arena->scan_ptr > block_ptr && arena->scan_ptr < block_ptr + size) {
+    arena->scan_ptr = block_ptr;
+  }
+}
+
+/*
+ * Note that an allocated block is in the hands of the user: the memory up to
+ * its end is no longer known to be zero.
+ */
+static void mark_dirty(Arena* arena, std::byte* block_ptr) {
+  std::byte* end = get_header_ptr(get_nextblk_ptr(block_ptr));
+  if (end > arena->zero_ptr) {
+    arena->zero_ptr = end;
+  }
+}
+
+/*
+ * Clear what is left of the boundary tags in front of a block that was merged
+ * into the block before it: the footer before its header, the header and its
+ * free list links.
+ */
+static void clear_boundary(Arena* arena, std::byte* block_ptr) {
+  clear_range(arena, get_header_ptr(block_ptr) - WORD_SIZE,
+              block_ptr + 2 * sizeof(std::byte*));
+}
+
+/*
+ * Zero the part of [lo, hi) that is above zero_ptr and still committed, so
+ * that the memory above zero_ptr stays zero.
+ */
+static void clear_range(Arena* arena, std::byte* lo, std::byte* hi) {
+  lo = std::max(lo, arena->zero_ptr);
+  hi = std::min(hi, arena->region.heap_commit);
+  if (lo < hi) {
+    std::memset(lo, 0, static_cast<std::size_t>(hi - lo));
+  }
+}
+
+/*
+ * Add the arena's memory and counters to stats.
+ */
+void arena_collect_stats(const Arena* arena, MmStats* stats) {
+  const ArenaStats& arena_stats = arena->stats;
+
+  stats->heap_size += static_cast<std::size_t>(arena->region.heap_brk -
+                                               arena->region.heap_start);
+  stats->slab_size += static_cast<std::size_t>(arena->slabs.region.heap_brk -
+                                               arena->slabs.region.heap_start);
+  stats->free_blocks += arena_stats.free_blocks;
+  stats->free_bytes += arena_stats.free_bytes;
+  for (std::size_t i = 0; i < MM_STATS_NUM_CLASSES; ++i) {
+    stats->free_blocks_by_class[i] += arena_stats.free_blocks_by_class[i];
+  }
+  stats->find_fit_calls += arena_stats.find_fit_calls;
+  stats->find_fit_probes += arena_stats.find_fit_probes;
+  stats->extend_heap_calls += arena_stats.extend_heap_calls;
+  stats->coalesces += arena_stats.coalesces;
+}
+
+/*
+ * Release the arena's memory region.
+ */
+void arena_teardown(Arena* arena) {
+  mem_teardown(&arena->region);
+  slab_teardown(&arena->slabs);
+  arena->heap_listp = nullptr;
+  std::fill(std::begin(arena->free_lists), std::end(arena->free_lists),
+            nullptr);
+  arena->free_bitmap = 0;
+  arena->rover = nullptr;
+  std::fill(std::begin(arena->fast_lists), std::end(arena->fast_lists),
+            nullptr);
+  arena->num_fastblks = 0;
+  arena->scan_ptr = nullptr;
+  arena->zero_ptr = nullptr;
+  arena->remote_frees.store(nullptr, std::memory_order_relaxed);
+  arena->remote_bytes.store(0, std::memory_order_relaxed);
+  arena->stats = ArenaStats{};
+  arena->checkpoint = ArenaCheckpoint{};
+}
@@ -0,0 +1,519 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "block.h"
+#include "memlib.h"
+#include "mm.h"
+#include "slab.h"
+
+/*
+ * Free blocks are kept in segregated free lists, one per size class. Each list
+ * is doubly-linked, null terminated and blocks are inserted at its head (LIFO)
+ * so that find_fit only has to visit free blocks.
+ *
+ * Size classes: one exact class per block size from MIN_BLOCK_SIZE up to
+ * EXACT_BIN_MAX (in DOUBLE_SIZE steps), followed by power-of-two classes
+ * (2^(k-1), 2^k]. A bitmap records which lists are non-empty so that the
+ * first non-empty class that fits can be found with a single
+ * count-trailing-zeros.
+ */
+constexpr std::size_t EXACT_BIN_MAX = 128; /* largest exact size class */
+constexpr std::size_t NUM_EXACT_BINS =
+    (EXACT_BIN_MAX - MIN_BLOCK_SIZE) / DOUBLE_SIZE + 1;
+/* power-of-two classes (2^(k-1), 2^k] for k in [8, 32] */
+constexpr std::size_t NUM_POW2_BINS = 32 - 8 + 1;
+constexpr std::size_t NUM_BINS = NUM_EXACT_BINS + NUM_POW2_BINS;
+static_assert(NUM_BINS <= 64, "bin bitmap is a single 64 bit word");
+static_assert(std::bit_width(EXACT_BIN_MAX) == 8,
+              "first power-of-two class must start right after EXACT_BIN_MAX");
+
+/*
+ * Placement policy used by find_fit inside a size class:
+ * first: first block that fits.
+ * next:  first block that fits, starting from where the last search stopped
+ *        (roving pointer).
+ * best:  smallest block that fits.
+ * good:  smallest block among the first GOOD_FIT_CANDIDATES blocks that fit.
+ *
+ * The policy is chosen at build time with -DMM_FIT_POLICY=<first|next|best|
+ * good>.
+ */
+enum class FitPolicy { first, next, best, good };
+
+#ifndef MM_FIT_POLICY
+#define MM_FIT_POLICY first
+#endif
+#ifndef MM_GOOD_FIT_CANDIDATES
+#define MM_GOOD_FIT_CANDIDATES 8
+#endif
+constexpr FitPolicy FIT_POLICY = FitPolicy::MM_FIT_POLICY;
+constexpr std::size_t GOOD_FIT_CANDIDATES = MM_GOOD_FIT_CANDIDATES;
+static_assert(GOOD_FIT_CANDIDATES > 0, "good fit needs at least 1 candidate");
+
+/*
+ * Returning memory to the OS:
+ * When a free block at the top of the heap grows beyond TRIM_THRESHOLD bytes,
+ * the heap is trimmed so that only TRIM_PAD bytes of it are kept. When a block
+ * is freed into a free block of at least RELEASE_THRESHOLD bytes, the whole
+ * pages of the freed range are released with madvise. arena_trim does both
+ * for the whole arena regardless of the thresholds.
+ *
+ * The thresholds are chosen at build time with -DMM_TRIM_THRESHOLD=<bytes>
+ * and -DMM_RELEASE_THRESHOLD=<bytes>.
+ */
+#ifndef MM_TRIM_THRESHOLD
+#define MM_TRIM_THRESHOLD (128 * 1024)
+#endif
+#ifndef MM_RELEASE_THRESHOLD
+#define MM_RELEASE_THRESHOLD (256 * 1024)
+#endif
+constexpr std::size_t TRIM_THRESHOLD = MM_TRIM_THRESHOLD;
+constexpr std::size_t TRIM_PAD = CHUNK_SIZE;
+constexpr std::size_t RELEASE_THRESHOLD = MM_RELEASE_THRESHOLD;
+/* queued bytes worth a trim, see arena_push_remote */
+constexpr std::size_t REMOTE_DRAIN_BYTES = TRIM_THRESHOLD;
+static_assert(TRIM_THRESHOLD > TRIM_PAD, "trimming must leave the pad");
+
+/*
+ * Deferred coalescing: with -DMM_DEFERRED_COALESCING=1, freed blocks of at
+ * most FAST_MAX_BLKSIZE bytes are not coalesced. They are pushed onto a fast
+ * list for their exact size instead, still marked allocated so that their
+ * neighbours do not merge with them, and arena_malloc hands them out again
+ * before looking at the free lists. All fast blocks are coalesced in a single
+ * sweep when find_fit is about to miss or once FAST_SWEEP_COUNT of them are
+ * waiting.
+ */
+#ifndef MM_DEFERRED_COALESCING
+#define MM_DEFERRED_COALESCING 0
+#endif
+constexpr bool DEFERRED_COALESCING = MM_DEFERRED_COALESCING;
+constexpr std::size_t FAST_MAX_BLKSIZE = EXACT_BIN_MAX;
+constexpr std::size_t NUM_FAST_BINS = NUM_EXACT_BINS; /* one per exact class */
+constexpr std::size_t FAST_SWEEP_COUNT = 1024;
+
+/*
+ * Incremental checking: with -DMM_CHECK_BLOCKS=1 every arena operation checks
+ * the blocks it touches (sizes, header against footer, the prev allocated bit
+ * of the next block and the free list links) and advances a scan of the whole
+ * heap by CHECK_SCAN_STEP blocks, so corruption is found within a bounded
+ * number of calls without ever walking the full heap at once. A corrupted
+ * heap aborts the program.
+ */
+#ifndef MM_CHECK_BLOCKS
+#define MM_CHECK_BLOCKS 0
+#endif
+constexpr bool CHECK_BLOCKS = MM_CHECK_BLOCKS;
+constexpr std::size_t CHECK_SCAN_STEP = 4;
+
+/* largest single fit a batch allocation carves blocks out of */
+constexpr std::size_t BATCH_FIT_MAX = 1 << 20;
+
+/*
+ * Cache lines: the blocks of a batch (the refill of a thread cache) are
+ * carved as a run that starts and ends on a cache line, so that two batches,
+ * which usually go to different threads, never share a line. Blocks that
+ * must not share their lines at all are allocated with mm_malloc_isolated.
+ *
+ * The line size is chosen at build time with -DMM_CACHE_LINE_SIZE=<bytes>.
+ */
+#ifndef MM_CACHE_LINE_SIZE
+#define MM_CACHE_LINE_SIZE 64
+#endif
+constexpr std::size_t CACHE_LINE_SIZE = MM_CACHE_LINE_SIZE;
+static_assert((CACHE_LINE_SIZE & (CACHE_LINE_SIZE - 1)) == 0 &&
+                  CACHE_LINE_SIZE > DOUBLE_SIZE,
+              "cache line size must be a power of two above MM_ALIGNMENT");
+
+/*
+ * Counters of the work an arena does, see MmStats. Like the rest of the arena
+ * they are only touched under its lock.
+ */
+struct ArenaStats {
+  uint64_t find_fit_calls = 0;
+  uint64_t find_fit_probes = 0;
+  uint64_t extend_heap_calls = 0;
+  uint64_t coalesces = 0;
+  uint64_t free_blocks = 0; /* blocks in the free lists */
+  uint64_t free_bytes = 0;
+  uint64_t free_blocks_by_class[MM_STATS_NUM_CLASSES] = {};
+};
+
+/*
+ * A checkpoint of an arena, see arena_checkpoint. While it is set, blocks are
+ * only taken from the heap above mark. The free lists of the blocks below the
+ * mark are put aside here, and so are the blocks below the mark that are
+ * freed, until the checkpoint is rolled back or committed.
+ */
+struct ArenaCheckpoint {
+  std::byte* mark = nullptr; /* first block above the checkpoint, or null */
+  std::byte* free_lists[NUM_BINS] = {};
+  uint64_t free_bitmap = 0;
+  ArenaStats stats;          /* the free block counters at the checkpoint */
+  std::byte* held = nullptr; /* blocks below mark freed since, linked through
+                                their first word */
+};
+
+/*
+ * An arena is an independent heap: its own memory region, prologue to
+ * epilogue block list and free lists, plus the slab runs for the smallest
+ * requests (see slab.h). Arenas are not synchronized
+ * internally; callers hold the arena's mutex around every arena_* call except
+ * arena_push_remote.
+ *
+ * Arenas are cache line aligned so that the locks and free list heads of
+ * different arenas never share a line.
+ */
+struct alignas(CACHE_LINE_SIZE) Arena {
+  std::mutex mutex;
+  MemRegion region;
+  std::byte* heap_listp = nullptr;      /* pointer to first block */
+  std::byte* free_lists[NUM_BINS] = {}; /* heads of the free lists */
+  uint64_t free_bitmap = 0; /* bit i is set iff free_lists[i] != null */
+  std::byte* rover = nullptr; /* next fit: free block to start from */
+  std::byte* fast_lists[NUM_FAST_BINS] = {}; /* deferred blocks by size */
+  std::size_t num_fastblks = 0; /* total number of deferred blocks */
+  std::byte* scan_ptr = nullptr; /* next block of the incremental scan */
+  std::byte* zero_ptr = nullptr; /* the heap above is zero, see arena_calloc */
+  int node = -1; /* NUMA node the arena's memory is bound to, -1 for none */
+  /* blocks freed without the lock and their bytes, see arena_push_remote */
+  std::atomic<std::byte*> remote_frees{nullptr};
+  std::atomic<std::size_t> remote_bytes{0};
+  SlabHeap slabs;
+  ArenaStats stats;
+  ArenaCheckpoint checkpoint;
+};
+
+/*
+ * Map a block size to the index of its size class.
+ *
+ * @param asize block size (a multiple of DOUBLE_SIZE, at least MIN_BLOCK_SIZE).
+ * @return index into Arena::free_lists.
+ */
+inline std::size_t get_bin_index(std::size_t asize) {
+  if (asize <= EXACT_BIN_MAX) {
+    return (asize - MIN_BLOCK_SIZE) / DOUBLE_SIZE;
+  }
+  std::size_t pow2_bin = std::bit_width(asize - 1) - 8;
+  if (pow2_bin >= NUM_POW2_BINS) {
+    pow2_bin = NUM_POW2_BINS - 1;
+  }
+  return NUM_EXACT_BINS + pow2_bin;
+}
+
+/*
+ * Compute the block size needed to hand out size bytes i.e. including the
+ * header. Allocated blocks have no footer. Requests of at most SLAB_MAX_SIZE
+ * bytes get a slot size instead. adjust_blksize looks small sizes up in a
+ * table instead.
+ *
+ * @param size number of bytes requested by the user (non-zero).
+ * @return adjusted block size.
+ */
+constexpr std::size_t compute_blksize(std::size_t size) {
+  if (size <= SLAB_MAX_SIZE) {
+    return slab_slot_size(size);
+  }
+  // the block must be able to hold the free list links and the footer once
+  // it is freed
+  if (size <= MIN_BLOCK_SIZE - BLOCK_OVERHEAD) {
+    return MIN_BLOCK_SIZE;
+  }
+  // the header, rounded up to the next multiple of DOUBLE_SIZE
+  return (size + BLOCK_OVERHEAD + DOUBLE_SIZE - 1) & ~(DOUBLE_SIZE - 1);
+}
+
+/*
+ * Block sizes of the requests of up to MM_SMALL_SIZE_MAX bytes: entry i is the
+ * block size for (i - 1) * WORD_SIZE + 1 to i * WORD_SIZE bytes. Every size
+ * class boundary above is a multiple of WORD_SIZE, so the sizes an entry
+ * covers all have the same block size.
+ */
+constexpr std::size_t NUM_SMALL_BLKSIZES = MM_SMALL_SIZE_MAX / WORD_SIZE + 1;
+constexpr std::array<uint16_t, NUM_SMALL_BLKSIZES> SMALL_BLKSIZES = [] {
+  std::array<uint16_t, NUM_SMALL_BLKSIZES> blksizes{};
+  for (std::size_t i = 1; i < NUM_SMALL_BLKSIZES; ++i) {
+    blksizes[i] = static_cast<uint16_t>(compute_blksize(i * WORD_SIZE));
+  }
+  return blksizes;
+}();
+static_assert(MM_SMALL_SIZE_MAX % WORD_SIZE == 0 &&
+                  compute_blksize(MM_SMALL_SIZE_MAX) <= UINT16_MAX,
+              "small block sizes must fit the table");
+static_assert(
+    [] {
+      for (std::size_t size = 1; size <= MM_SMALL_SIZE_MAX; ++size) {
+        if (SMALL_BLKSIZES[(size + WORD_SIZE - 1) / WORD_SIZE] !=
+            compute_blksize(size)) {
+          return false;
+        }
+      }
+      return true;
+    }(),
+    "a table entry covers sizes of different block sizes");
+
+/*
+ * Block size needed to hand out size bytes, see compute_blksize. Small sizes
+ * take a single table lookup.
+ *
+ * @param size number of bytes requested by the user (non-zero).
+ * @return adjusted block size.
+ */
+constexpr std::size_t adjust_blksize(std::size_t size) {
+  if (size <= MM_SMALL_SIZE_MAX) {
+    return SMALL_BLKSIZES[(size + WORD_SIZE - 1) / WORD_SIZE];
+  }
+  return compute_blksize(size);
+}
+
+/*
+ * Initialize an arena: obtain its memory region and create the prologue,
+ * epilogue and an initial free block.
+ *
+ * @return 0 on success, -1 if the arena could not get any memory.
+ */
+int arena_init(Arena* arena);
+
+/*
+ * Is the arena initialized, i.e. does it have a heap?
+ */
+inline bool arena_initialized(const Arena* arena) {
+  return arena->heap_listp != nullptr;
+}
+
+/*
+ * Does block_ptr point into the arena's memory region or its slab region?
+ */
+inline bool arena_contains(const Arena* arena, const std::byte* block_ptr) {
+  return (block_ptr >= arena->region.heap_start &&
+          block_ptr < arena->region.heap_max_addr) ||
+         slab_contains(&arena->slabs, block_ptr);
+}
+
+/*
+ * Size of an allocated block of this arena as returned by adjust_blksize,
+ * i.e. the slot size for slab slots.
+ */
+inline std::size_t arena_get_blksize(const Arena* arena, std::byte* block_ptr) {
+  if (slab_contains(&arena->slabs, block_ptr)) {
+    return slab_get_slot_size(block_ptr);
+  }
+  return get_blksize(get_header_ptr(block_ptr));
+}
+
+/*
+ * Number of bytes the user can use in an allocated block of this arena.
+ */
+inline std::size_t arena_usable_size(const Arena* arena, std::byte* block_ptr) {
+  if (slab_contains(&arena->slabs, block_ptr)) {
+    return slab_get_slot_size(block_ptr);
+  }
+  return get_blksize(get_header_ptr(block_ptr)) - BLOCK_OVERHEAD;
+}
+
+/*
+ * Allocate a block of asize bytes from the arena, initializing the arena
+ * first if needed. Slot sizes are allocated from the slabs.
+ *
+ * @param asize adjusted block size.
+ * @return pointer to the block or nullptr if the arena is out of memory.
+ */
+std::byte* arena_malloc(Arena* arena, std::size_t asize);
+
+/*
+ * Allocate a block of asize bytes like arena_malloc and zero its first size
+ * bytes.
+ *
+ * Only the part of the block below zero_ptr is zeroed. zero_ptr is the end
+ * of the highest block the heap ever handed out: the memory above it has
+ * never been written by a user, so it is zero (as fresh or decommitted pages
+ * are) except for the header, free list links and footer of the free block
+ * at the top of the heap and the epilogue header. The heap zeroes whatever
+ * else of its own it leaves behind up there: the boundary tags of merged
+ * blocks and the tags abandoned by a trim. Trimming also moves zero_ptr down
+ * to the decommitted pages.
+ *
+ * @param asize adjusted block size.
+ * @param size number of bytes to zero, at most the usable size of the block.
+ * @return pointer to the block or nullptr if the arena is out of memory.
+ */
+std::byte* arena_calloc(Arena* arena, std::size_t asize, std::size_t size);
+
+/*
+ * Allocate a block of asize bytes whose (user) block is aligned to alignment
+ * bytes. The gap in front of the aligned block is split off as a free block.
+ *
+ * @param alignment power of two larger than DOUBLE_SIZE.
+ * @param asize adjusted block size, at least MIN_BLOCK_SIZE.
+ * @return pointer to the block or nullptr if the arena is out of memory.
+ */
+std::byte* arena_memalign(Arena* arena, std::size_t alignment,
+                          std::size_t asize);
+
+/*
+ * Allocate up to count blocks of asize bytes. Blocks are carved out of a
+ * single fit (or a single heap extension) where possible, as a run that
+ * starts and ends on a cache line.
+ *
+ * @param asize adjusted block size.
+ * @param block_ptrs receives the blocks.
+ * @return number of blocks allocated, less than count only if the arena is
+ * out of memory.
+ */
+std::size_t arena_malloc_batch(Arena* arena, std::size_t asize,
+                               std::byte** block_ptrs, std::size_t count);
+
+/*
+ * Allocate a batch of blocks for a thread cache, see arena_malloc_batch. Slab
+ * slots are handed out in address order, so the batch also ends on a cache
+ * line: the slots after the last one that ends a line are left to the next
+ * batch.
+ *
+ * @return number of blocks allocated, 0 only if the arena is out of memory.
+ */
+std::size_t arena_refill(Arena* arena, std::size_t asize,
+                         std::byte** block_ptrs, std::size_t count);
+
+/*
+ * Return an allocated block to the arena's free lists, or to a fast list if
+ * its coalescing is deferred (see DEFERRED_COALESCING).
+ *
+ * @param block_ptr pointer to an allocated block of this arena.
+ */
+void arena_free(Arena* arena, std::byte* block_ptr);
+
+/*
+ * Queue an allocated block to be freed by the next caller of
+ * arena_drain_remote. This is the one arena call that does not need the lock:
+ * the queue is a stack linked through the blocks' first words that threads
+ * push onto with a single compare-and-swap, so a thread that frees a block of
+ * another thread's arena never waits for that arena's lock.
+ *
+ * @param block_ptr pointer to an allocated block of this arena.
+ * @return true once the queue holds REMOTE_DRAIN_BYTES or more, so that the
+ * caller drains it if the lock happens to be free. Otherwise queued blocks
+ * wait for the arena's next allocation, which may never come if the thread
+ * that allocated them has exited.
+ */
+bool arena_push_remote(Arena* arena, std::byte* block_ptr);
+
+/*
+ * Free all blocks queued by arena_push_remote at once.
+ */
+void arena_drain_remote(Arena* arena);
+
+/*
+ * Return count allocated blocks to the arena's free lists. Blocks that are
+ * next to each other are merged before they are coalesced with their
+ * neighbours, so every group of adjacent blocks is coalesced once.
+ *
+ * @param block_ptrs blocks of this arena sorted by address.
+ */
+void arena_free_batch(Arena* arena, std::byte** block_ptrs,
+                      std::size_t count);
+
+/*
+ * Resize an allocated block of this arena to hold size bytes, in place if
+ * possible. See mm_realloc.
+ *
+ * @return pointer to the resized block or nullptr if the arena is out of
+ * memory (in which case block_ptr is left untouched).
+ */
+std::byte* arena_realloc(Arena* arena, std::byte* block_ptr, std::size_t size);
+
+/*
+ * Is a checkpoint of the arena set?
+ */
+inline bool arena_checkpointed(const Arena* arena) {
+  return arena->checkpoint.mark != nullptr;
+}
+
+/*
+ * Is block_ptr a heap block below the mark of the arena's checkpoint? Such
+ * blocks were allocated before the checkpoint and must be freed with
+ * arena_hold while it is set.
+ */
+inline bool arena_below_mark(const Arena* arena, const std::byte* block_ptr) {
+  return arena_checkpointed(arena) && block_ptr < arena->checkpoint.mark &&
+         !slab_contains(&arena->slabs, block_ptr);
+}
+
+/*
+ * Set a checkpoint: everything allocated from the heap from now on lies above
+ * its current top (the mark), so that arena_rollback can free it all at once.
+ * The free lists are put aside, except for the free block at the top of the
+ * heap which becomes the first free block above the mark. Requests must not
+ * go to the slabs while the checkpoint is set (they are not rolled back) and
+ * blocks below the mark must be freed with arena_hold.
+ *
+ * @return 0 on success, -1 if the arena could not be initialized.
+ */
+int arena_checkpoint(Arena* arena);
+
+/*
+ * Free a block below the mark of the checkpoint. The block stays allocated
+ * until the checkpoint is rolled back or committed.
+ */
+void arena_hold(Arena* arena, std::byte* block_ptr);
+
+/*
+ * Roll the heap back to the checkpoint and clear it: every block above the
+ * mark is dropped and the heap above the mark becomes a single free block
+ * (trimmed like any other free block at the top of the heap). This takes the
+ * same time however many blocks there are above the mark; only the blocks
+ * held since the checkpoint are freed one by one.
+ */
+void arena_rollback(Arena* arena);
+
+/*
+ * Clear the checkpoint and keep all blocks: the lists put aside are merged
+ * back into the free lists and the held blocks are freed.
+ */
+void arena_commit(Arena* arena);
+
+/*
+ * Give as much of the arena's free memory back to the OS as possible:
+ * trim the free block at the top of the heap and release the pages inside
+ * all other free blocks.
+ *
+ * @return Number of bytes given back.
+ */
+std::size_t arena_trim(Arena* arena);
+
+/*
+ * Checks the arena's heap and free lists for correctness.
+ *
+ * @param verbose Prints every block if verbose is not equal to 0.
+ * @return false (after printing an error) if the heap is corrupted.
+ */
+bool arena_checkheap(Arena* arena, int verbose);
+
+/*
+ * Check the next max_blocks blocks of the arena's heap, continuing where the
+ * last call stopped and starting over after the epilogue. Every block is
+ * checked on its own: its size, header against footer, the prev allocated
+ * bit of the next block and, for free blocks, that they are coalesced and
+ * linked into the right free list.
+ *
+ * @return false (after printing an error) if a corrupted block was found.
+ */
+bool arena_check_step(Arena* arena, std::size_t max_blocks);
+
+/*
+ * Add the arena's memory and counters to stats.
+ */
+void arena_collect_stats(const Arena* arena, MmStats* stats);
+
+/*
+ * Release the arena's memory region. This invalidates all blocks handed out
+ * by the arena.
+ */
+void arena_teardown(Arena* arena);
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/*
+ * Terminology:
+ * Block Size is always a multiple of DOUBLE_SIZE, which is also the alignment
+ * of every (user) block. Headers and footers are WORD_SIZE bytes each.
+ *
+ * Free block: <Header><Actual/User Block><Footer>
+ * Allocated block: <Header><Actual/User Block>
+ *
+ * Only free blocks have a footer. Instead, every header records whether the
+ * block before it is allocated, so coalesce only reads the previous block's
+ * footer when there is one. The user block of an allocated block extends over
+ * the space of the footer.
+ *
+ * The first and last blocks have special headers/footers:
+ * First: <P/1><Empty i.e. size 0><P/1> (format of header/footer: <size of
+ * block/allocated?>) where P is PROLOGUE_SIZE
+ *
+ * Last: only header, no footer
+ * <0/1>
+ *
+ * The low three bits of a header are flags since sizes are multiples of 8:
+ * bit 0 is set for allocated blocks, bit 1 (PREV_ALLOC_BIT) if the previous
+ * block is allocated and bit 2 (MMAPPED_BIT) for allocated blocks that live in
+ * their own mapping (see huge.h). Footers only hold the size and bit 0.
+ *
+ * Free blocks additionally keep the links of the explicit free list in the
+ * first two pointer-sized words of their (user) block:
+ * <Header><next free><prev free><...><Footer>
+ */
+
+/*
+ * Block format, chosen at build time:
+ * -DMM_ALIGNMENT=<8|16> sets DOUBLE_SIZE, i.e. the alignment of the blocks
+ * handed out and the granularity of block sizes. The default of 16 is what
+ * alignas(16) types and aligned SSE loads need; 8 packs small blocks tighter.
+ * -DMM_WIDE_HEADERS=1 makes headers and footers 64 bits wide. 32 bit headers
+ * limit blocks, and therefore every heap, to less than 4 GB.
+ */
+#ifndef MM_ALIGNMENT
+#define MM_ALIGNMENT 16
+#endif
+#ifndef MM_WIDE_HEADERS
+#define MM_WIDE_HEADERS 0
+#endif
+
+/* a header or footer */
+using header_t = std::conditional_t<MM_WIDE_HEADERS, uint64_t, uint32_t>;
+
+constexpr std::size_t WORD_SIZE = sizeof(header_t);
+constexpr std::size_t DOUBLE_SIZE = MM_ALIGNMENT; /* block alignment */
+constexpr std::size_t CHUNK_SIZE = (1 << 12);     // 4 KB
+static_assert(DOUBLE_SIZE == 8 || DOUBLE_SIZE == 16,
+              "blocks are aligned to 8 or 16 bytes");
+/* header bit set if the previous block is allocated */
+constexpr header_t PREV_ALLOC_BIT = 0x2;
+/* header bit of allocated blocks that live in their own mapping */
+constexpr header_t MMAPPED_BIT = 0x4;
+/* bytes of an allocated block that the user cannot use: the header */
+constexpr std::size_t BLOCK_OVERHEAD = WORD_SIZE;
+/* header + footer + next/prev links of a free block */
+constexpr std::size_t MIN_BLOCK_SIZE =
+    (2 * WORD_SIZE + 2 * sizeof(std::byte*) + DOUBLE_SIZE - 1) &
+    ~(DOUBLE_SIZE - 1);
+/* the prologue only has a header and a footer */
+constexpr std::size_t PROLOGUE_SIZE =
+    (2 * WORD_SIZE + DOUBLE_SIZE - 1) & ~(DOUBLE_SIZE - 1);
+static_assert(PROLOGUE_SIZE < MIN_BLOCK_SIZE,
+              "the prologue is told apart from other blocks by its size");
+/* largest block size a header can hold */
+constexpr std::size_t MAX_BLOCK_SIZE =
+    static_cast<std::size_t>(~header_t{0x7});
+
+template <typename T>
+constexpr T max(T x, T y) {
+  return x > y ? x : y;
+}
+
+/*
+ * pack size and alloc into a single value using bitwise 'or' so as to create a
+ * block header.
+ *
+ * @param size size of the header. This must be a multiple of 8.
+ * @param alloc is either 0 (false) or 1(true) indicating whether the block is
+ * allocated.
+ */
+constexpr header_t pack(header_t size, uint32_t alloc) {
+  return (size | alloc);
+}
+
+/*
+ * pack size and alloc into a single value using bitwise 'or' so as to create a
+ * block header.
+ *
+ * @param size size of the header. This must be a multiple of 8.
+ * @param alloc indicates whether the block is allocated.
+ */
+constexpr header_t pack(header_t size, bool alloc) {
+  return (size | static_cast<header_t>(alloc));
+}
+
+/*
+ * pack size, alloc and whether the previous block is allocated into a block
+ * header.
+ *
+ * @param size size of the header. This must be a multiple of 8.
+ * @param alloc indicates whether the block is allocated.
+ * @param prev_alloc indicates whether the previous block is allocated.
+ */
+constexpr header_t pack(header_t size, bool alloc, bool prev_alloc) {
+  return pack(size, alloc) | (prev_alloc ? PREV_ALLOC_BIT : 0);
+}
+
+/*
+ * Read a header (or footer) at pointer.
+ *
+ * @param pointer Pointer to read header_t at.
+ *
+ * @return header_t value at pointer (pointer is expected to point to a free
+ * list header).
+ *
+ * Headers are read and written with relaxed atomics: the owner of an
+ * allocated block reads its size without the arena lock while the lock
+ * holder may update the prev allocated bit of the same header.
+ */
+inline header_t get_uat(std::byte* pointer) {
+  return std::atomic_ref<header_t>(*reinterpret_cast<header_t*>(pointer))
+      .load(std::memory_order_relaxed);
+}
+
+/*
+ * Put a header (or footer) at pointer.
+ *
+ * @param pointer pointer to put value at.
+ * @param value Value to put at pointer.
+ *
+ * Expected: pointer will usually point to a free list header.
+ */
+inline void put_uvalue_at(std::byte* pointer, header_t value) {
+  std::atomic_ref<header_t>(*reinterpret_cast<header_t*>(pointer))
+      .store(value, std::memory_order_relaxed);
+}
+
+/*
+ * get size from header
+ *
+ * @param header_ptr pointer to a free list header.
+ * @return size of the memory block.
+ */
+inline std::size_t get_blksize(std::byte* header_ptr) {
+  // ~0x7: bit mask that returns all but the last three bits (the flags).
+  return get_uat(header_ptr) & ~header_t{0x7};
+}
+
+/*
+ * Is the current block allocated?
+ *
+ * @param header_ptr pointer to a free list header.
+ * @return boolean indicating if the current block is allocated.
+ */
+inline bool get_allocated(std::byte* header_ptr) {
+  // last bit of header indicates where allocated or not.
+  return static_cast<bool>(get_uat(header_ptr) & 0x1);
+}
+
+/*
+ * Is the block before the current one allocated?
+ *
+ * @param header_ptr pointer to a block header.
+ */
+inline bool get_prev_allocated(std::byte* header_ptr) {
+  return static_cast<bool>(get_uat(header_ptr) & PREV_ALLOC_BIT);
+}
+
+/*
+ * Record in a block header whether the block before it is allocated.
+ *
+ * @param header_ptr pointer to a block header.
+ * @param prev_alloc indicates whether the previous block is allocated.
+ */
+inline void put_prev_allocated(std::byte* header_ptr, bool prev_alloc) {
+  header_t value = get_uat(header_ptr) & ~PREV_ALLOC_BIT;
+  put_uvalue_at(header_ptr, value | (prev_alloc ? PREV_ALLOC_BIT : 0));
+}
+
+/*
+ * Was the (allocated) block mapped on its own instead of being carved out of
+ * a heap? See huge.h.
+ *
+ * @param header_ptr pointer to a block header.
+ */
+inline bool get_mmapped(std::byte* header_ptr) {
+  return static_cast<bool>(get_uat(header_ptr) & MMAPPED_BIT);
+}
+
+/*
+ * Given a block ptr (one handed out to a user), determine the address
+ * of the blocks header and footer.
+ *
+ * @param block_ptr pointer to start of (user) block i.e. after header.
+ * @return pointer of type std::byte to start of block header.
+ */
+
+constexpr std::byte* get_header_ptr(std::byte* block_ptr) {
+  return block_ptr - WORD_SIZE;
+}
+
+/*
+ * Given a block_ptr (one handed out to user), returns a pointer to
+ * the footer of the block. Only free blocks (and the prologue) have a
+ * footer.
+ *
+ * @param block_ptr pointer to start of (user) block i.e. after header.
+ * @return pointer of type std::byte to start of the block's footer.
+ *
+ */
+inline std::byte* get_footer_ptr(std::byte* block_ptr) {
+  std::byte* header_ptr = get_header_ptr(block_ptr);
+  // -2 * WORD_SIZE since the block starts at its header and the footer takes
+  // up its last word
+  return block_ptr + get_blksize(header_ptr) - 2 * WORD_SIZE;
+}
+
+/*
+ * Get pointer to the start of the next (user) block given a pointer to a (user)
+ * block.
+ *
+ * @param block_ptr pointer to a (user) block i.e. after header.
+ * @return pointer to the start of next (user) block.
+ *
+ */
+inline std::byte* get_nextblk_ptr(std::byte* block_ptr) {
+  return block_ptr + (get_blksize(block_ptr - WORD_SIZE));
+}
+
+/*
+ * Get pointer to previous (user) block given a (user) block pointer. The
+ * previous block must be free (or the prologue) since it is found through its
+ * footer.
+ *
+ * @param block_ptr pointer to a user block.
+ * @return pointer to the start of previous (user) block.
+ */
+inline std::byte* get_prevblk_ptr(std::byte* block_ptr) {
+  // block_ptr - 2 * WORD_SIZE is previous block's footer
+  return block_ptr - get_blksize(block_ptr - 2 * WORD_SIZE);
+}
+
+/*
+ * Get the next block in the free list given a free (user) block pointer.
+ *
+ * @param block_ptr pointer to a free (user) block.
+ * @return pointer to the next free block or nullptr if block_ptr is the last
+ * block in the free list.
+ */
+inline std::byte* get_nextfree_ptr(std::byte* block_ptr) {
+  return *reinterpret_cast<std::byte**>(block_ptr);
+}
+
+/*
+ * Get the previous block in the free list given a free (user) block pointer.
+ *
+ * @param block_ptr pointer to a free (user) block.
+ * @return pointer to the previous free block or nullptr if block_ptr is the
+ * first block in the free list.
+ */
+inline std::byte* get_prevfree_ptr(std::byte* block_ptr) {
+  return *reinterpret_cast<std::byte**>(block_ptr + sizeof(std::byte*));
+}
+
+/*
+ * Set the next free list link of a free (user) block.
+ */
+inline void put_nextfree_ptr(std::byte* block_ptr, std::byte* next) {
+  *reinterpret_cast<std::byte**>(block_ptr) = next;
+}
+
+/*
+ * Set the previous free list link of a free (user) block.
+ */
+inline void put_prevfree_ptr(std::byte* block_ptr, std::byte* prev) {
+  *reinterpret_cast<std::byte**>(block_ptr + sizeof(std::byte*)) = prev;
+}
+
+#endif
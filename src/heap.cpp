@@ -0,0 +1,179 @@
+#include "heap.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include "arena.h"
+#include "block.h"
+
+/*
+ * This file implements ExplicitFreeListHeap on top of an arena of its own,
+ * see heap.h. The arena is set up lazily by arena_malloc, just like the
+ * arenas of mm_malloc, and its lock is never taken.
+ *
+ * Checkpoints are the arena's (see arena_checkpoint); this file keeps the
+ * requests that the arena cannot roll back away from it: slab slots and
+ * blocks below the mark that are freed or grown.
+ */
+
+/* larger requests would overflow adjust_blksize; no region is that large */
+constexpr std::size_t MAX_REQUEST_SIZE = SIZE_MAX / 2;
+
+ExplicitFreeListHeap::ExplicitFreeListHeap() : arena_(new Arena) {}
+
+ExplicitFreeListHeap::~ExplicitFreeListHeap() {
+  release();
+  delete arena_;
+}
+
+std::byte* ExplicitFreeListHeap::malloc(std::size_t size) {
+  if (size == 0 || size > MAX_REQUEST_SIZE) {
+    return nullptr;
+  }
+  std::size_t asize = adjust_blksize(size);
+  if (arena_checkpointed(arena_)) {
+    asize = max(asize, MIN_BLOCK_SIZE);
+  }
+  return arena_malloc(arena_, asize);
+}
+
+/*
+ * Aligned blocks always come from the heap, never from the slabs. Their
+ * padding is split off as a free block.
+ */
+std::byte* ExplicitFreeListHeap::memalign(std::size_t alignment,
+                                          std::size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  if (alignment <= DOUBLE_SIZE) {
+    return malloc(size);
+  }
+  if (size == 0 || size > MAX_REQUEST_SIZE || alignment > MAX_REQUEST_SIZE) {
+    return nullptr;
+  }
+  return arena_memalign(arena_, alignment,
+                        max(adjust_blksize(size), MIN_BLOCK_SIZE));
+}
+
+std::byte* ExplicitFreeListHeap::realloc(std::byte* ptr, std::size_t size) {
+  if (size == 0) {
+    free(ptr);
+    return nullptr;
+  }
+  if (ptr == nullptr) {
+    return malloc(size);
+  }
+  if (size > MAX_REQUEST_SIZE) {
+    return nullptr;
+  }
+  // under a checkpoint, older blocks must neither grow into the blocks below
+  // the mark nor be replaced by slab slots
+  if (arena_checkpointed(arena_) &&
+      (arena_below_mark(arena_, ptr) || slab_contains(&arena_->slabs, ptr))) {
+    std::size_t usable = usable_size(ptr);
+    if (size <= usable) {
+      return ptr;
+    }
+    std::byte* new_ptr = malloc(size);
+    if (new_ptr == nullptr) {
+      return nullptr;
+    }
+    std::memcpy(new_ptr, ptr, usable);
+    free(ptr);
+    return new_ptr;
+  }
+  return arena_realloc(arena_, ptr, size);
+}
+
+void ExplicitFreeListHeap::free(std::byte* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  if (arena_below_mark(arena_, ptr)) {
+    arena_hold(arena_, ptr);
+    return;
+  }
+  arena_free(arena_, ptr);
+}
+
+std::size_t ExplicitFreeListHeap::usable_size(std::byte* ptr) const {
+  if (ptr == nullptr) {
+    return 0;
+  }
+  return arena_usable_size(arena_, ptr);
+}
+
+bool ExplicitFreeListHeap::contains(const std::byte* ptr) const {
+  return arena_initialized(arena_) && arena_contains(arena_, ptr);
+}
+
+int ExplicitFreeListHeap::checkheap(int verbose) const {
+  if (arena_initialized(arena_) && !arena_checkheap(arena_, verbose)) {
+    return -1;
+  }
+  return 0;
+}
+
+MmStats ExplicitFreeListHeap::stats() const {
+  MmStats stats{};
+  if (arena_initialized(arena_)) {
+    arena_collect_stats(arena_, &stats);
+  }
+  return stats;
+}
+
+int ExplicitFreeListHeap::checkpoint() {
+  if (arena_checkpointed(arena_)) {
+    return -1;
+  }
+  return arena_checkpoint(arena_);
+}
+
+int ExplicitFreeListHeap::rollback() {
+  if (!arena_checkpointed(arena_)) {
+    return -1;
+  }
+  arena_rollback(arena_);
+  return 0;
+}
+
+int ExplicitFreeListHeap::commit() {
+  if (!arena_checkpointed(arena_)) {
+    return -1;
+  }
+  arena_commit(arena_);
+  return 0;
+}
+
+/*
+ * Unmapping the region and the slab runs drops all blocks at once. The arena
+ * is back in its initial state, so the next allocation sets it up again.
+ */
+void ExplicitFreeListHeap::release() {
+  if (arena_initialized(arena_)) {
+    arena_teardown(arena_);
+  }
+}
+
+void* HeapResource::do_allocate(std::size_t bytes, std::size_t alignment) {
+  std::byte* ptr = heap_->memalign(alignment, bytes > 0 ? bytes : 1);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void HeapResource::do_deallocate(void* ptr, std::size_t, std::size_t) {
+  heap_->free(static_cast<std::byte*>(ptr));
+}
+
+bool HeapResource::do_is_equal(
+    const std::pmr::memory_resource& other) const noexcept {
+  const HeapResource* resource = dynamic_cast<const HeapResource*>(&other);
+  return resource != nullptr && resource->heap_ == heap_;
+}
@@ -0,0 +1,257 @@
+#include "huge.h"
+
+#include <fmt/format.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include "block.h"
+#include "memlib.h"
+
+/*
+ * This file implements huge blocks, see huge.h. All huge blocks are kept in a
+ * single list so that mm_teardown can unmap them; the list is only touched on
+ * map, unmap and remap, which are system calls anyway.
+ */
+
+static std::mutex huge_mutex;
+static HugeChunk* huge_chunks = nullptr; /* head of the list of huge blocks */
+static std::size_t huge_mapped = 0;      /* total length of their mappings */
+
+// forward declarations
+static std::size_t mapping_length(std::size_t size, std::size_t offset);
+static HugeChunk* get_chunk(std::byte* block_ptr);
+static std::byte* get_mapping(HugeChunk* chunk);
+static std::byte* get_user_ptr(HugeChunk* chunk);
+static void link_chunk(HugeChunk* chunk);
+static void unlink_chunk(HugeChunk* chunk);
+
+/*
+ * Map a huge block.
+ */
+std::byte* huge_malloc(std::size_t size) {
+  std::size_t length = mapping_length(size, 0);
+  if (length == 0) {
+    return nullptr;
+  }
+
+  std::byte* mapping = mem_map(length);
+  if (mapping == nullptr) {
+    return nullptr;
+  }
+
+  HugeChunk* chunk = reinterpret_cast<HugeChunk*>(mapping);
+  chunk->length = length;
+  chunk->offset = 0;
+  std::byte* block_ptr = get_user_ptr(chunk);
+  put_uvalue_at(get_header_ptr(block_ptr), pack(0, true) | MMAPPED_BIT);
+
+  std::lock_guard<std::mutex> lock(huge_mutex);
+  link_chunk(chunk);
+  return block_ptr;
+}
+
+/*
+ * Map an aligned huge block: map enough for any alignment of the block and
+ * unmap the whole pages in front of and behind it.
+ */
+std::byte* huge_memalign(std::size_t alignment, std::size_t size) {
+  std::size_t page = mem_pagesize();
+  if (size > SIZE_MAX - alignment) {
+    return nullptr;
+  }
+  std::size_t length = mapping_length(size + alignment, 0);
+  if (length == 0) {
+    return nullptr;
+  }
+
+  std::byte* mapping = mem_map(length);
+  if (mapping == nullptr) {
+    return nullptr;
+  }
+
+  std::uintptr_t user_addr =
+      (reinterpret_cast<std::uintptr_t>(mapping) + HUGE_CHUNK_SIZE +
+       alignment - 1) &
+      ~(alignment - 1);
+  std::byte* chunk_ptr =
+      reinterpret_cast<std::byte*>(user_addr - HUGE_CHUNK_SIZE);
+
+  std::size_t lead =
+      static_cast<std::size_t>(chunk_ptr - mapping) & ~(page - 1);
+  if (lead > 0) {
+    mem_unmap(mapping, lead);
+    mapping += lead;
+    length -= lead;
+  }
+  std::size_t offset = static_cast<std::size_t>(chunk_ptr - mapping);
+  std::size_t needed = mapping_length(size, offset);
+  if (needed < length) {
+    mem_unmap(mapping + needed, length - needed);
+    length = needed;
+  }
+
+  HugeChunk* chunk = reinterpret_cast<HugeChunk*>(chunk_ptr);
+  chunk->length = length;
+  chunk->offset = offset;
+  std::byte* block_ptr = get_user_ptr(chunk);
+  put_uvalue_at(get_header_ptr(block_ptr), pack(0, true) | MMAPPED_BIT);
+
+  std::lock_guard<std::mutex> lock(huge_mutex);
+  link_chunk(chunk);
+  return block_ptr;
+}
+
+/*
+ * Unmap a huge block.
+ */
+void huge_free(std::byte* block_ptr) {
+  HugeChunk* chunk = get_chunk(block_ptr);
+  {
+    std::lock_guard<std::mutex> lock(huge_mutex);
+    unlink_chunk(chunk);
+  }
+  mem_unmap(get_mapping(chunk), chunk->length);
+}
+
+/*
+ * Resize a huge block with mremap. The chunk is taken off the list while it
+ * is remapped since its address may change.
+ */
+std::byte* huge_realloc(std::byte* block_ptr, std::size_t size) {
+  HugeChunk* chunk = get_chunk(block_ptr);
+  std::size_t offset = chunk->offset;
+  std::size_t length = mapping_length(size, offset);
+  if (length == 0) {
+    return nullptr;
+  }
+  if (length == chunk->length) {
+    return block_ptr;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(huge_mutex);
+    unlink_chunk(chunk);
+  }
+  std::byte* mapping = mem_remap(get_mapping(chunk), chunk->length, length);
+
+  std::lock_guard<std::mutex> lock(huge_mutex);
+  if (mapping == nullptr) {
+    link_chunk(chunk);
+    return nullptr;
+  }
+  chunk = reinterpret_cast<HugeChunk*>(mapping + offset);
+  chunk->length = length;
+  link_chunk(chunk);
+  return get_user_ptr(chunk);
+}
+
+std::size_t huge_usable_size(std::byte* block_ptr) {
+  HugeChunk* chunk = get_chunk(block_ptr);
+  return chunk->length - chunk->offset - HUGE_CHUNK_SIZE;
+}
+
+std::size_t huge_mapped_bytes() {
+  std::lock_guard<std::mutex> lock(huge_mutex);
+  return huge_mapped;
+}
+
+/*
+ * Checks the list of huge blocks.
+ */
+bool huge_checkheap(int verbose) {
+  std::lock_guard<std::mutex> lock(huge_mutex);
+  bool ok = true;
+
+  if (verbose && huge_chunks != nullptr) {
+    fmt::print("Huge blocks:\n");
+  }
+  for (HugeChunk* chunk = huge_chunks; chunk != nullptr; chunk = chunk->next) {
+    std::byte* block_ptr = get_user_ptr(chunk);
+    if (verbose) {
+      fmt::print("{}: mapping length {}\n", fmt::ptr(block_ptr),
+                 chunk->length);
+    }
+    if (!get_allocated(get_header_ptr(block_ptr)) || !huge_block(block_ptr)) {
+      fmt::print("Error: huge block {} has a bad header\n",
+                 fmt::ptr(block_ptr));
+      ok = false;
+    }
+    if (chunk->length % mem_pagesize() != 0) {
+      fmt::print("Error: huge block {} is not made of whole pages\n",
+                 fmt::ptr(block_ptr));
+      ok = false;
+    }
+    if (chunk->next != nullptr && chunk->next->prev != chunk) {
+      fmt::print("Error: huge block list is broken after {}\n",
+                 fmt::ptr(block_ptr));
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+void huge_teardown() {
+  std::lock_guard<std::mutex> lock(huge_mutex);
+  while (huge_chunks != nullptr) {
+    HugeChunk* chunk = huge_chunks;
+    huge_chunks = chunk->next;
+    mem_unmap(get_mapping(chunk), chunk->length);
+  }
+  huge_mapped = 0;
+}
+
+/*
+ * Length of the mapping needed for a huge block of size bytes whose chunk is
+ * offset bytes into the mapping.
+ *
+ * @return the length (a multiple of the page size) or 0 if it overflows.
+ */
+static std::size_t mapping_length(std::size_t size, std::size_t offset) {
+  std::size_t page = mem_pagesize();
+  if (size > SIZE_MAX - offset - HUGE_CHUNK_SIZE - page) {
+    return 0;
+  }
+  return (size + offset + HUGE_CHUNK_SIZE + page - 1) & ~(page - 1);
+}
+
+static HugeChunk* get_chunk(std::byte* block_ptr) {
+  return reinterpret_cast<HugeChunk*>(block_ptr - HUGE_CHUNK_SIZE);
+}
+
+static std::byte* get_mapping(HugeChunk* chunk) {
+  return reinterpret_cast<std::byte*>(chunk) - chunk->offset;
+}
+
+static std::byte* get_user_ptr(HugeChunk* chunk) {
+  return reinterpret_cast<std::byte*>(chunk) + HUGE_CHUNK_SIZE;
+}
+
+/*
+ * Insert a chunk at the head of the list. Callers hold huge_mutex.
+ */
+static void link_chunk(HugeChunk* chunk) {
+  huge_mapped += chunk->length;
+  chunk->prev = nullptr;
+  chunk->next = huge_chunks;
+  if (huge_chunks != nullptr) {
+    huge_chunks->prev = chunk;
+  }
+  huge_chunks = chunk;
+}
+
+/*
+ * Remove a chunk from the list. Callers hold huge_mutex.
+ */
+static void unlink_chunk(HugeChunk* chunk) {
+  huge_mapped -= chunk->length;
+  if (chunk->prev != nullptr) {
+    chunk->prev->next = chunk->next;
+  } else {
+    huge_chunks = chunk->next;
+  }
+  if (chunk->next != nullptr) {
+    chunk->next->prev = chunk->prev;
+  }
+}
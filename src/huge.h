@@ -0,0 +1,106 @@
+#ifndef HUGE_H_
+#define HUGE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "block.h"
+
+/*
+ * Huge blocks: requests of at least MMAP_THRESHOLD bytes do not go through the
+ * arenas at all. Each of them gets a mapping of its own that is unmapped as
+ * soon as the block is freed, so they neither fragment a heap nor pin its
+ * break high. Resizing them uses mremap, which moves the pages instead of
+ * copying them.
+ *
+ * A huge block starts with a HugeChunk, padded to HUGE_CHUNK_SIZE bytes so
+ * that its last word is the header of the user block, tagged with
+ * MMAPPED_BIT:
+ * <length><prev><next><offset><padding><header (0 | MMAPPED_BIT | 1)><User
+ * Block>
+ * The chunk is at the start of its mapping, except for aligned blocks where
+ * it is offset bytes (less than a page) into it.
+ * Huge blocks are never next to a heap block.
+ *
+ * The threshold is chosen at build time with -DMM_MMAP_THRESHOLD=<bytes>.
+ */
+#ifndef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD (128 * 1024)
+#endif
+constexpr std::size_t MMAP_THRESHOLD = MM_MMAP_THRESHOLD;
+static_assert(MMAP_THRESHOLD > CHUNK_SIZE,
+              "huge blocks must be larger than a heap extension");
+
+struct HugeChunk {
+  std::size_t length; /* length of the mapping, from its start */
+  HugeChunk* prev;    /* list of all huge blocks, for teardown and checks */
+  HugeChunk* next;
+  std::size_t offset; /* offset of the chunk from the start of the mapping */
+};
+/* bytes from the start of a chunk to its user block, header included */
+constexpr std::size_t HUGE_CHUNK_SIZE =
+    (sizeof(HugeChunk) + WORD_SIZE + 2 * DOUBLE_SIZE - 1) &
+    ~(2 * DOUBLE_SIZE - 1);
+
+/*
+ * Is block_ptr a huge block?
+ *
+ * @param block_ptr pointer to an allocated (user) block.
+ */
+inline bool huge_block(std::byte* block_ptr) {
+  return get_mmapped(get_header_ptr(block_ptr));
+}
+
+/*
+ * Map a huge block of at least size bytes.
+ *
+ * @return pointer to the (user) block or nullptr if the OS is out of memory.
+ */
+std::byte* huge_malloc(std::size_t size);
+
+/*
+ * Map a huge block of at least size bytes whose (user) block is aligned to
+ * alignment bytes.
+ *
+ * @param alignment power of two.
+ * @return pointer to the (user) block or nullptr if the OS is out of memory.
+ */
+std::byte* huge_memalign(std::size_t alignment, std::size_t size);
+
+/*
+ * Unmap a huge block.
+ */
+void huge_free(std::byte* block_ptr);
+
+/*
+ * Resize a huge block to at least size bytes, moving its pages if needed.
+ *
+ * @return pointer to the resized block or nullptr if the OS is out of memory
+ * (in which case block_ptr is left untouched).
+ */
+std::byte* huge_realloc(std::byte* block_ptr, std::size_t size);
+
+/*
+ * Number of bytes the user can use in a huge block.
+ */
+std::size_t huge_usable_size(std::byte* block_ptr);
+
+/*
+ * Total length of the mappings of all huge blocks.
+ */
+std::size_t huge_mapped_bytes();
+
+/*
+ * Checks the list of huge blocks for correctness.
+ *
+ * @param verbose Prints every block if verbose is not equal to 0.
+ * @return false (after printing an error) if a block or the list is corrupted.
+ */
+bool huge_checkheap(int verbose);
+
+/*
+ * Unmap all huge blocks.
+ */
+void huge_teardown();
+
+#endif
@@ -1,10 +1,15 @@
 #include "memlib.h"
 
 #include <fmt/core.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <cerrno>
 #include <cstddef>
-#include <cstdlib>
+#include <cstdint>
 
 /*
  * This file defines the memory model to be used by our explicit
@@ -12,51 +17,301 @@
  * Perspective semeed to have chosen this in order to allow interleaving calls
  * to malloc with our own allocator.
  *
- * The memory model is essentially this: we request a large chunk of memory
- * from the system at init time and then for increasing the size of the heap,
- * keep reusing this memory. If the heap is full ( heap_max_addr == heap_start +
- * MAX_HEAP_SIZE ) then we return a nullptr from the allocator and set errno
+ * The memory model is essentially this: every region reserves a large range
+ * of virtual memory (MAX_HEAP_SIZE bytes) with mmap(PROT_NONE) at init time.
+ * Reserving address space is cheap and does not use any physical memory. As
+ * mem_sbrk moves the break up, the pages below it are committed (made
+ * readable and writable) in COMMIT_SIZE steps, and the kernel only backs them
+ * with memory once they are touched. If the heap is full ( heap_brk ==
+ * heap_max_addr ) then we return a nullptr from the allocator and set errno
  * to ENOMEM;
  *
+ * Memory goes back to the OS in two ways: mem_trim moves the break down and
+ * decommits the pages above it, mem_release madvises pages in the middle of
+ * the heap away (MADV_DONTNEED, or MADV_FREE with -DMM_MADV_FREE=1) while
+ * keeping them committed.
+ *
+ * Besides the regions, mem_map hands out standalone mappings for blocks that
+ * are too large to be worth keeping in a heap.
+ *
  * This allocator follows a strategy similar to that followed by Apple's old
  * (~1989) sbrk function that also operated off a maximum heap size.
  */
 
-constexpr std::size_t MAX_HEAP_SIZE = 20 * (1 << 20); /* 20 MB */
+/*
+ * 32 bit block headers cannot describe a (free) block of 4 GB or more, so
+ * regions only grow that large with -DMM_WIDE_HEADERS=1.
+ */
+#if MM_WIDE_HEADERS
+#ifndef MM_MAX_HEAP_SIZE
+#define MM_MAX_HEAP_SIZE (std::size_t{1} << 36) /* 64 GB */
+#endif
+#else
+#ifndef MM_MAX_HEAP_SIZE
+#define MM_MAX_HEAP_SIZE (std::size_t{1} << 32) /* 4 GB */
+#endif
+static_assert(MM_MAX_HEAP_SIZE <= (std::size_t{1} << 32),
+              "heaps larger than 4 GB need -DMM_WIDE_HEADERS=1");
+#endif
+constexpr std::size_t MAX_HEAP_SIZE = MM_MAX_HEAP_SIZE;
+constexpr std::size_t COMMIT_SIZE = 1 << 16; /* 64 KB */
+
+#ifndef MM_MADV_FREE
+#define MM_MADV_FREE 0
+#endif
+constexpr int RELEASE_ADVICE = MM_MADV_FREE ? MADV_FREE : MADV_DONTNEED;
 
-static std::byte* heap_start;    /* beginning of the heap (mem_heap)*/
-static std::byte* heap_brk;      /* one past the end of the heap (mem_brk) */
-static std::byte* heap_max_addr; /* The heap has a maximum size and this points
-                                    one byte beyond it*/
+/*
+ * Huge pages: with -DMM_HUGEPAGES=1 every region is aligned to HUGE_PAGE_SIZE
+ * and advised with MADV_HUGEPAGE, so that the kernel backs it with
+ * transparent huge pages and walking the headers and footers of a large heap
+ * takes a TLB entry per huge page instead of one per page. The break is then
+ * committed and decommitted in whole huge pages, and only whole huge pages are
+ * released from the middle of the heap: anything smaller would split them.
+ */
+#ifndef MM_HUGEPAGES
+#define MM_HUGEPAGES 0
+#endif
+#ifndef MM_HUGE_PAGE_SIZE
+#define MM_HUGE_PAGE_SIZE (1 << 21) /* 2 MB */
+#endif
+constexpr bool HUGEPAGES = MM_HUGEPAGES;
+constexpr std::size_t HUGE_PAGE_SIZE = MM_HUGE_PAGE_SIZE;
+static_assert((HUGE_PAGE_SIZE & (HUGE_PAGE_SIZE - 1)) == 0 &&
+                  MAX_HEAP_SIZE % HUGE_PAGE_SIZE == 0,
+              "regions must be made of whole huge pages");
+
+static MemRegion default_region; /* used by the region-less functions */
+
+/*
+ * Round size up to a multiple of align (a power of two).
+ */
+static std::size_t round_up(std::size_t size, std::size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * Size of a page.
+ */
+static std::size_t page_size() {
+  static const std::size_t size = [] {
+    long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? static_cast<std::size_t>(size) : std::size_t{4096};
+  }();
+  return size;
+}
+
+/*
+ * Granularity at which the break is committed: COMMIT_SIZE or the page size
+ * if pages are larger than that, a huge page with huge pages.
+ */
+static std::size_t commit_granule() {
+  if (HUGEPAGES) {
+    return page_size() > HUGE_PAGE_SIZE ? page_size() : HUGE_PAGE_SIZE;
+  }
+  return page_size() > COMMIT_SIZE ? page_size() : COMMIT_SIZE;
+}
+
+/*
+ * Granularity at which mem_release gives pages back: a page, a huge page
+ * with huge pages.
+ */
+static std::size_t release_granule() {
+  return HUGEPAGES && HUGE_PAGE_SIZE > page_size() ? HUGE_PAGE_SIZE
+                                                   : page_size();
+}
 
 /*
  * Initialize the memory model
  */
-void mem_init() {
-  heap_start = static_cast<std::byte*>(std::malloc(MAX_HEAP_SIZE));
-  heap_brk = static_cast<std::byte*>(
-      heap_start); /* No allocations yet so start = end. */
-  heap_max_addr = static_cast<std::byte*>(heap_start + MAX_HEAP_SIZE);
+int mem_init(MemRegion* region) {
+  // an extra huge page of address space leaves room to align the region
+  std::size_t slack = HUGEPAGES ? HUGE_PAGE_SIZE : 0;
+  void* reserved =
+      mmap(nullptr, MAX_HEAP_SIZE + slack, PROT_NONE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED) {
+    return -1;
+  }
+  region->heap_start = static_cast<std::byte*>(reserved);
+  if (HUGEPAGES) {
+    std::byte* start = region->heap_start;
+    region->heap_start = reinterpret_cast<std::byte*>(
+        round_up(reinterpret_cast<std::uintptr_t>(start), HUGE_PAGE_SIZE));
+    std::size_t head = static_cast<std::size_t>(region->heap_start - start);
+    if (head > 0) {
+      munmap(start, head);
+    }
+    munmap(region->heap_start + MAX_HEAP_SIZE, slack - head);
+    // fails if the kernel has no transparent huge pages: the heap then
+    // simply uses small pages
+    madvise(region->heap_start, MAX_HEAP_SIZE, MADV_HUGEPAGE);
+  }
+  region->heap_brk = static_cast<std::byte*>(
+      region->heap_start); /* No allocations yet so start = end. */
+  region->heap_commit = region->heap_start;
+  region->heap_max_addr =
+      static_cast<std::byte*>(region->heap_start + MAX_HEAP_SIZE);
+  return 0;
 }
 
 /*
  * Increase the size of the heap and returns a pointer to the old head of the
- * heap.
+ * heap. Pages between the old and the new break are committed if they have
+ * not been already.
  *
  * @param increment Make the heap bigger by increment bytes.
  * @return Old heap of the heap (the new heap of the heap is at old_head +
  * increment).
  */
-std::byte* mem_sbrk(std::size_t increment) {
-  std::byte* old_brk = heap_brk;
+std::byte* mem_sbrk(MemRegion* region, std::size_t increment) {
+  std::byte* old_brk = region->heap_brk;
 
-  if (increment < 0 || (heap_brk + increment) > heap_max_addr) {
+  if (increment < 0 ||
+      increment > static_cast<std::size_t>(region->heap_max_addr -
+                                           region->heap_brk)) {
     errno = ENOMEM;
     fmt::print(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
     return nullptr;
   }
-  heap_brk += increment;
+
+  std::byte* new_brk = region->heap_brk + increment;
+  if (new_brk > region->heap_commit) {
+    std::size_t commit_end = round_up(
+        static_cast<std::size_t>(new_brk - region->heap_start),
+        commit_granule());
+    if (commit_end > MAX_HEAP_SIZE) {
+      commit_end = MAX_HEAP_SIZE;
+    }
+    std::byte* commit_addr = region->heap_start + commit_end;
+    if (mprotect(region->heap_commit,
+                 static_cast<std::size_t>(commit_addr - region->heap_commit),
+                 PROT_READ | PROT_WRITE) != 0) {
+      errno = ENOMEM;
+      fmt::print(stderr, "ERROR: mem_sbrk failed. Could not commit memory\n");
+      return nullptr;
+    }
+    region->heap_commit = commit_addr;
+  }
+
+  region->heap_brk = new_brk;
   return old_brk;
 }
 
-void mem_teardown() { std::free(heap_start); }
+/*
+ * Move the break down by decrement bytes. Committed pages that are entirely
+ * above the new break (rounded up to the commit granule) are dropped and
+ * decommitted.
+ */
+int mem_trim(MemRegion* region, std::size_t decrement) {
+  if (decrement >
+      static_cast<std::size_t>(region->heap_brk - region->heap_start)) {
+    return -1;
+  }
+  region->heap_brk -= decrement;
+
+  std::byte* commit_addr =
+      region->heap_start +
+      round_up(static_cast<std::size_t>(region->heap_brk - region->heap_start),
+               commit_granule());
+  if (commit_addr < region->heap_commit) {
+    std::size_t length =
+        static_cast<std::size_t>(region->heap_commit - commit_addr);
+    madvise(commit_addr, length, MADV_DONTNEED);
+    mprotect(commit_addr, length, PROT_NONE);
+    region->heap_commit = commit_addr;
+  }
+  return 0;
+}
+
+/*
+ * Release the whole pages (or huge pages) in [addr, addr + size).
+ */
+std::size_t mem_release(MemRegion*, std::byte* addr, std::size_t size) {
+  std::size_t granule = release_granule();
+  std::uintptr_t start =
+      round_up(reinterpret_cast<std::uintptr_t>(addr), granule);
+  std::uintptr_t end =
+      (reinterpret_cast<std::uintptr_t>(addr) + size) & ~(granule - 1);
+
+  if (end <= start) {
+    return 0;
+  }
+  if (madvise(reinterpret_cast<void*>(start), end - start, RELEASE_ADVICE) !=
+      0) {
+    return 0;
+  }
+  return end - start;
+}
+
+std::byte* mem_map(std::size_t size) {
+  void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return static_cast<std::byte*>(mapping);
+}
+
+std::byte* mem_remap(std::byte* addr, std::size_t old_size,
+                     std::size_t new_size) {
+  void* mapping = mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+  if (mapping == MAP_FAILED) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return static_cast<std::byte*>(mapping);
+}
+
+void mem_unmap(std::byte* addr, std::size_t size) { munmap(addr, size); }
+
+std::size_t mem_pagesize() { return page_size(); }
+
+/*
+ * The memory policy calls go through syscall, which saves linking libnuma.
+ */
+int mem_bind(MemRegion* region, int node) {
+  unsigned long mask = 1UL << node;
+  long result = syscall(
+      SYS_mbind, region->heap_start,
+      static_cast<std::size_t>(region->heap_max_addr - region->heap_start),
+      MPOL_PREFERRED, &mask, 8 * sizeof(mask), 0);
+  return result == 0 ? 0 : -1;
+}
+
+uint64_t mem_numa_nodes() {
+  // large enough for any kernel's node count, which get_mempolicy insists on
+  unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {};
+  if (syscall(SYS_get_mempolicy, nullptr, mask, 8 * sizeof(mask), nullptr,
+              MPOL_F_MEMS_ALLOWED) != 0) {
+    return 0;
+  }
+  return mask[0] & ~(uint64_t{1} << 63);
+}
+
+int mem_current_node() {
+  unsigned int cpu;
+  unsigned int node;
+  if (getcpu(&cpu, &node) != 0) {
+    return -1;
+  }
+  return static_cast<int>(node);
+}
+
+void mem_teardown(MemRegion* region) {
+  if (region->heap_start != nullptr) {
+    munmap(region->heap_start,
+           static_cast<std::size_t>(region->heap_max_addr -
+                                    region->heap_start));
+  }
+  *region = MemRegion{};
+}
+
+void mem_init() { mem_init(&default_region); }
+
+std::byte* mem_sbrk(std::size_t increment) {
+  return mem_sbrk(&default_region, increment);
+}
+
+void mem_teardown() { mem_teardown(&default_region); }
@@ -1,245 +1,442 @@
 #include "mm.h"
 
-#include <fmt/format.h>
+#include <sched.h>
 
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
 #include <cstddef>
 #include <cstdint>
-#include <cstdlib>
 #include <cstring>
+#include <mutex>
 
-#include "memlib.h"
-
-// TODO: Look into using -fvisibility here: https://gcc.gnu.org/wiki/Visibility
+#include "arena.h"
+#include "block.h"
+#include "huge.h"
+#include "profile.h"
+#include "stats.h"
 
 /*
- * Terminology:
- * Block Size is always a multiple of DOUBLE_SIZE.
+ * Arenas:
+ * The allocator runs NUM_ARENAS independent heaps (see arena.h), each with its
+ * own memory region, free lists and lock. A thread allocates from its arena:
+ * with the round_robin assignment every new thread is given the next arena in
+ * turn, with the cpu assignment a thread uses the arena of the cpu it is
+ * currently running on. With the numa assignment the arenas are dealt out to
+ * the NUMA nodes in turn (arena i to the (i % nodes)-th node) and their
+ * memory is bound to their node; a thread uses one of the arenas of the node
+ * it is currently running on, the next one in turn when it first allocates.
+ * A block is always returned to the arena it came from, which is found from
+ * the block's address.
  *
- * Block: <Header><Actual/User Block><Footer>
+ * Arenas other than the first are initialized on first use. arena_ready is
+ * set once an arena's region is set up so that arena_of can read the region
+ * bounds without taking the arena's lock.
  *
- * The first and last blocks have special headers/footers:
- * First: <8/1><Empty i.e. size 0><8/1> (format of header/footer: <size of
- * block/allocated?>)
+ * The number of arenas and the assignment are chosen at build time with
+ * -DMM_NUM_ARENAS=<n> and -DMM_ARENA_ASSIGNMENT=<round_robin|cpu|numa>.
+ */
+enum class ArenaAssignment { round_robin, cpu, numa };
+
+#ifndef MM_NUM_ARENAS
+#define MM_NUM_ARENAS 8
+#endif
+#ifndef MM_ARENA_ASSIGNMENT
+#define MM_ARENA_ASSIGNMENT round_robin
+#endif
+constexpr std::size_t NUM_ARENAS = MM_NUM_ARENAS;
+constexpr ArenaAssignment ARENA_ASSIGNMENT =
+    ArenaAssignment::MM_ARENA_ASSIGNMENT;
+static_assert(NUM_ARENAS > 0, "need at least one arena");
+
+static Arena arenas[NUM_ARENAS];
+static std::atomic<bool> arena_ready[NUM_ARENAS];
+static std::atomic<std::size_t> next_arena{0}; /* round robin assignment */
+
+/*
+ * Threading:
+ * In front of the arenas every thread keeps a cache of small blocks (block
+ * size up to TCACHE_MAX_BLKSIZE) in per-size singly-linked lists threaded
+ * through the first word of the blocks. Cached blocks stay marked allocated in
+ * their arena. A thread refills an empty list with TCACHE_BATCH blocks at once
+ * and returns TCACHE_BATCH blocks when a list grows beyond TCACHE_MAX_COUNT,
+ * so malloc/free of small blocks take an arena lock once per batch instead of
+ * once per call. Only blocks of the thread's own arena are cached, blocks of
+ * other arenas are freed straight back to their arena.
  *
- * Last: only header, no footer
- * <0/1>
+ * heap_epoch changes whenever the heap is torn down so that thread caches can
+ * tell that the blocks they hold are gone. A thread's cache is bypassed once
+ * it has been destroyed, since the destructors that run after it (of other
+ * thread locals, or of statics on the main thread) may still allocate.
  */
+constexpr std::size_t TCACHE_MAX_BLKSIZE = 256;
+/* one bin per block size (slab slot sizes included) */
+constexpr std::size_t NUM_TCACHE_BINS = TCACHE_MAX_BLKSIZE / DOUBLE_SIZE;
+constexpr std::size_t TCACHE_BATCH = 32;
+constexpr std::size_t TCACHE_MAX_COUNT = 2 * TCACHE_BATCH;
+static_assert(TCACHE_MAX_BLKSIZE <= adjust_blksize(MM_SMALL_SIZE_MAX) &&
+                  MM_SMALL_SIZE_MAX < MMAP_THRESHOLD,
+              "small sizes must cover the cached blocks and no huge ones");
 
-constexpr std::size_t WORD_SIZE = 4;
-constexpr std::size_t DOUBLE_SIZE = 8;         /* double word size*/
-constexpr std::size_t CHUNK_SIZE = (1 << 12);  // 4 KB
-static std::byte* heap_listp = nullptr;        /* pointer to first block */
+static std::atomic<uint64_t> heap_epoch{0};
 
-template <typename T>
-bool max(T x, T y) {
-  return x > y ? x : y;
-}
+/*
+ * Isolated size classes, see mm_set_isolated: bit i is set if the requests of
+ * thread cache bin i get isolated blocks.
+ */
+static std::atomic<uint64_t> isolated_bins{0};
+static_assert(NUM_TCACHE_BINS <= 64, "isolated bins are a single 64 bit word");
+
+struct ThreadCache {
+  std::byte* bins[NUM_TCACHE_BINS] = {};
+  std::size_t counts[NUM_TCACHE_BINS] = {};
+  uint64_t epoch = 0;
+  bool alive = true;
+  /* arena the thread last allocated from, null before its first allocation */
+  Arena* arena = nullptr;
+
+  ~ThreadCache();
+};
+
+static thread_local ThreadCache tcache;
+
+// forward declarations
+static Arena* get_arena(std::size_t index);
+static Arena* thread_arena();
+static std::size_t numa_arena(std::size_t slot);
+static int arena_node(std::size_t index);
+static Arena* arena_of(std::byte* block_ptr);
+static void drain_blocks(std::byte* block_ptr, std::size_t count);
+static std::byte* malloc_block(std::size_t size, std::size_t* blksize);
+static std::byte* small_block(std::size_t size, std::size_t* blksize);
+static std::byte* arena_block(std::size_t asize, std::size_t* blksize);
+static std::byte* arena_block_of(Arena* arena, std::byte* block_ptr,
+                                 std::size_t* blksize);
+static std::byte* huge_block_of(std::byte* block_ptr, std::size_t* blksize);
+static std::byte* memalign_block(std::size_t alignment, std::size_t size,
+                                 std::size_t* blksize);
+static std::byte* calloc_block(std::size_t size, std::size_t* blksize);
+static std::byte* isolated_block(std::size_t size, std::size_t* blksize);
+static bool is_isolated(std::size_t asize);
+static std::size_t free_block(std::byte* block_ptr);
+static std::size_t free_sized_block(std::byte* block_ptr, std::size_t size);
+static void free_remote(Arena* owner, std::byte* block_ptr);
+static std::byte* realloc_block(std::byte* block_ptr, std::size_t size,
+                                std::size_t* old_blksize,
+                                std::size_t* new_blksize);
+static void tcache_validate();
+static std::byte* realloc_huge(Arena* owner, std::byte* block_ptr,
+                               std::size_t size, std::size_t* old_blksize,
+                               std::size_t* new_blksize);
+static std::byte* tcache_malloc(std::size_t asize);
+static void tcache_free(std::byte* block_ptr, std::size_t size);
 
 /*
- * pack size and alloc into a single value using bitwise 'or' so as to create a
- * block header.
- *
- * @param size size of the header. This must be a multiple of 8.
- * @param alloc is either 0 (false) or 1(true) indicating whether the block is
- * allocated.
+ * Initilialize the allocator.
  */
-inline uint32_t pack(uint32_t size, uint32_t alloc) { return (size | alloc); }
+int mm_init() { return get_arena(0) != nullptr ? 0 : -1; }
 
 /*
- * pack size and alloc into a single value using bitwise 'or' so as to create a
- * block header.
+ * Allocates size bytes and returns a pointer to the beginning of the block.
+ *
+ * @param size number of bytes to allocate.
+ *
+ * @return pointer to the first byte of the allocated block. If the allocator
+ * runs out of memory, this function will return null.
  *
- * @param size size of the header. This must be a multiple of 8.
- * @param alloc indicates whether the block is allocated.
  */
-inline uint32_t pack(uint32_t size, bool alloc) {
-  return (size | static_cast<uint32_t>(alloc));
+std::byte* mm_malloc(std::size_t size) {
+  std::size_t blksize;
+  std::byte* block_ptr = malloc_block(size, &blksize);
+  if (STATS && block_ptr != nullptr) {
+    stats_alloc(size, blksize, 1);
+  }
+  if (PROFILE && block_ptr != nullptr) {
+    profile_alloc(block_ptr, size);
+  }
+  return block_ptr;
 }
 
 /*
- * Read 32 bits at pointer and return as uint32_t.
- *
- * @param pointer Pointer to read uint32_t at.
- *
- * @return uint32_t value at pointer (since headers are 32 bits and pointer
- * is expected to point to a free list header).
+ * Allocates size bytes, 1 to MM_SMALL_SIZE_MAX.
  */
-inline uint32_t get_uat(std::byte* pointer) {
-  return *reinterpret_cast<uint32_t*>(pointer);
+std::byte* mm_malloc_small(std::size_t size) {
+  std::size_t blksize;
+  std::byte* block_ptr = small_block(size, &blksize);
+  if (STATS && block_ptr != nullptr) {
+    stats_alloc(size, blksize, 1);
+  }
+  if (PROFILE && block_ptr != nullptr) {
+    profile_alloc(block_ptr, size);
+  }
+  return block_ptr;
 }
 
 /*
- * Put 32 bits at pointer.
+ * Allocate a block without counting it, see mm_malloc.
  *
- * @param pointer pointer to put value at.
- * @param value Value to put at pointer.
+ * Like the other *_block functions, this tells the caller what to count
+ * instead of having it look the block up again (see mm_stats): blksize is
+ * set to the block's size as the path that allocated it knows it, the size
+ * of the thread cache bin for cached blocks.
  *
- * Expected: pointer will usually point to a free list header.
+ * @param[out] blksize size of the allocated block.
+ */
+static std::byte* malloc_block(std::size_t size, std::size_t* blksize) {
+  // a single comparison for the common case, size 0 wraps around
+  if (size - 1 < MM_SMALL_SIZE_MAX) {
+    return small_block(size, blksize);
+  }
+  if (size == 0) {
+    return nullptr;
+  }
+
+  if (size >= MMAP_THRESHOLD) {
+    return huge_block_of(huge_malloc(size), blksize);
+  }
+  return arena_block(compute_blksize(size), blksize);
+}
+
+/*
+ * Allocate a block of 1 to MM_SMALL_SIZE_MAX bytes without counting it: its
+ * block size is looked up in SMALL_BLKSIZES and small blocks come from the
+ * thread cache.
  */
-inline void put_uvalue_at(std::byte* pointer, uint32_t value) {
-  *reinterpret_cast<uint32_t*>(pointer) = value;
+static std::byte* small_block(std::size_t size, std::size_t* blksize) {
+  std::size_t asize = SMALL_BLKSIZES[(size + WORD_SIZE - 1) / WORD_SIZE];
+
+  if (asize <= TCACHE_MAX_BLKSIZE) {
+    if (is_isolated(asize)) {
+      return isolated_block(size, blksize);
+    }
+    if (tcache.alive) {
+      *blksize = asize;
+      return tcache_malloc(asize);
+    }
+  }
+  return arena_block(asize, blksize);
 }
 
 /*
- * get size from header
+ * Allocate a block of asize bytes from the calling thread's arena.
  *
- * @param header_ptr pointer to a free list header.
- * @return size of the memory block.
+ * @param asize adjusted block size.
  */
-inline uint32_t get_blksize(std::byte* header_ptr) {
-  // ~0x7: bit mask that returns the most significant 29 bits (i.e.
-  // disregarding the last three bits) since header is MSB 29.
-  return get_uat(header_ptr) & ~0x7;
+static std::byte* arena_block(std::size_t asize, std::size_t* blksize) {
+  Arena* arena = thread_arena();
+  if (arena == nullptr) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(arena->mutex);
+  arena_drain_remote(arena);
+  return arena_block_of(arena, arena_malloc(arena, asize), blksize);
 }
 
 /*
- * Is the current block allocated?
+ * Set *blksize to the size of a block the arena just allocated.
  *
- * @param header_ptr pointer to a free list header.
- * @return boolean indicating if the current block is allocated.
+ * @return block_ptr, which may be nullptr.
  */
-inline bool get_allocated(std::byte* header_ptr) {
-  // last bit of header indicates where allocated or not.
-  return static_cast<bool>(get_uat(header_ptr) & 0x1);
+static std::byte* arena_block_of(Arena* arena, std::byte* block_ptr,
+                                 std::size_t* blksize) {
+  if (STATS && block_ptr != nullptr) {
+    *blksize = arena_get_blksize(arena, block_ptr);
+  }
+  return block_ptr;
 }
 
 /*
- * Given a block ptr (one handed out to a user), determine the address
- * of the blocks header and footer.
+ * Set *blksize to the size of a huge block that was just mapped.
  *
- * @param block_ptr pointer to start of (user) block i.e. after header.
- * @return pointer of type std::byte to start of block header.
+ * @return block_ptr, which may be nullptr.
  */
-
-inline std::byte* get_header_ptr(std::byte* block_ptr) {
-  return block_ptr - WORD_SIZE;
+static std::byte* huge_block_of(std::byte* block_ptr, std::size_t* blksize) {
+  if (STATS && block_ptr != nullptr) {
+    *blksize = huge_usable_size(block_ptr);
+  }
+  return block_ptr;
 }
 
 /*
- * Given a block_ptr (one handed out to user), returns a pointer to
- * the footer of the block.
- *
- * @param block_ptr pointer to start of (user) block i.e. after header.
- * @return pointer of type std::byte to start of the block's footer.
- *
+ * Allocates an aligned block.
  */
-inline std::byte* get_footer_ptr(std::byte* block_ptr) {
-  std::byte* header_ptr = get_header_ptr(block_ptr);
-  // -DOUBLE_SIZE since block_size = header_size(4 bytes) + actual block size +
-  // footer_size(4 bytes)
-  return block_ptr + get_blksize(header_ptr) - DOUBLE_SIZE;
+std::byte* mm_memalign(std::size_t alignment, std::size_t size) {
+  std::size_t blksize;
+  std::byte* block_ptr = memalign_block(alignment, size, &blksize);
+  if (STATS && block_ptr != nullptr) {
+    stats_alloc(size, blksize, 1);
+  }
+  if (PROFILE && block_ptr != nullptr) {
+    profile_alloc(block_ptr, size);
+  }
+  return block_ptr;
 }
 
 /*
- * Get pointer to the start of the next (user) block given a pointer to a (user)
+ * Allocate an aligned block without counting it. Heap blocks are placed at an
+ * aligned address inside a fit with room for the padding, which is split off
+ * as a free block. Alignments too large for that to be worth it get a huge
  * block.
- *
- * @param block_ptr pointer to a (user) block i.e. after header.
- * @return pointer to the start of next (user) block.
- *
  */
-inline std::byte* get_nextblk_ptr(std::byte* block_ptr) {
-  return block_ptr + (get_blksize(block_ptr - WORD_SIZE));
+static std::byte* memalign_block(std::size_t alignment, std::size_t size,
+                                 std::size_t* blksize) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  if (alignment <= DOUBLE_SIZE) {
+    return malloc_block(size, blksize);
+  }
+  if (size == 0) {
+    return nullptr;
+  }
+
+  if (size >= MMAP_THRESHOLD || alignment >= MMAP_THRESHOLD - size) {
+    return huge_block_of(huge_memalign(alignment, size), blksize);
+  }
+
+  // aligned blocks always come from the heap, never from the slabs
+  std::size_t asize = max(adjust_blksize(size), MIN_BLOCK_SIZE);
+  Arena* arena = thread_arena();
+  if (arena == nullptr) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(arena->mutex);
+  arena_drain_remote(arena);
+  return arena_block_of(arena, arena_memalign(arena, alignment, asize),
+                        blksize);
 }
 
 /*
- * Get pointer to previous (user) block given a (user) block pointer.
- *
- * @param block_ptr pointer to a user block.
- * @return pointer to the start of previous (user) block.
+ * Allocates a block that shares no cache line with any other block.
  */
-inline std::byte* get_prevblk_ptr(std::byte* block_ptr) {
-  // block_ptr - DOUBLE_SIZE is previous block's footer
-  return block_ptr - get_blksize(block_ptr - DOUBLE_SIZE);
+std::byte* mm_malloc_isolated(std::size_t size) {
+  std::size_t blksize;
+  std::byte* block_ptr = isolated_block(size, &blksize);
+  if (STATS && block_ptr != nullptr) {
+    stats_alloc(size, blksize, 1);
+  }
+  if (PROFILE && block_ptr != nullptr) {
+    profile_alloc(block_ptr, size);
+  }
+  return block_ptr;
 }
-// forward declarations
-static std::byte* extend_heap(std::size_t words);
-static void place(std::byte* bp, std::size_t asize);
-static std::byte* find_fit(std::size_t asize);
-static std::byte* coalesce(std::byte* bp);
-static void printblock(std::byte* bp);
-static void checkheap(int verbose);
-static void checkblock(std::byte* bp);
 
 /*
- * Initilialize the allocator.
+ * Allocate an isolated block without counting it: a block aligned to a cache
+ * line and rounded up to whole lines. The next block's header follows in the
+ * next line, and this block's own header sits at the end of the line before,
+ * where the blocks next to it only touch it when they are allocated or freed.
+ */
+static std::byte* isolated_block(std::size_t size, std::size_t* blksize) {
+  if (size == 0 || size > SIZE_MAX - CACHE_LINE_SIZE) {
+    return nullptr;
+  }
+  return memalign_block(CACHE_LINE_SIZE,
+                        (size + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1),
+                        blksize);
+}
+
+/*
+ * Turn isolated blocks on or off for the size class of size.
  */
-int mm_init() {
-  mem_init();
-  if ((heap_listp = mem_sbrk(4 * WORD_SIZE)) == nullptr) {
+int mm_set_isolated(std::size_t size, bool isolated) {
+  if (size == 0 || size >= MMAP_THRESHOLD) {
     return -1;
   }
-  /* TODO: not sure what this is? */
-  put_uvalue_at(heap_listp, 0);
-  // create special first header block (prologue)
-  put_uvalue_at(heap_listp + WORD_SIZE, pack(DOUBLE_SIZE, true));
-  put_uvalue_at(heap_listp + 2 * WORD_SIZE, pack(DOUBLE_SIZE, true));
-  // create special last header (epilogue)
-  put_uvalue_at(heap_listp + 3 * WORD_SIZE, pack(0, true));
-  heap_listp +=
-      2 * WORD_SIZE;  // this points to the epilogue of the first header
-
-  if (extend_heap(CHUNK_SIZE / WORD_SIZE) == nullptr) {
+  std::size_t asize = adjust_blksize(size);
+  if (asize > TCACHE_MAX_BLKSIZE) {
     return -1;
   }
+  uint64_t bit = uint64_t{1} << (asize / DOUBLE_SIZE - 1);
+  if (isolated) {
+    isolated_bins.fetch_or(bit, std::memory_order_relaxed);
+  } else {
+    isolated_bins.fetch_and(~bit, std::memory_order_relaxed);
+  }
   return 0;
 }
 
 /*
- * Allocates size bytes and returns a pointer to the beginning of the block.
- *
- * @param size number of bytes to allocate.
- *
- * @return pointer to the first byte of the allocated block. If the allocator
- * runs out of memory, this function will return null.
+ * Do requests of block size asize get isolated blocks?
  *
+ * @param asize adjusted block size, at most TCACHE_MAX_BLKSIZE.
  */
-std::byte* mm_malloc(std::size_t size) {
-  std::size_t asize; /* Adjusted Block Size i.e. including header and footer*/
-  std::size_t extendsize; /* if no blocks fit, extend heap by this size */
-  std::byte* block_ptr = nullptr;
+static bool is_isolated(std::size_t asize) {
+  uint64_t bins = isolated_bins.load(std::memory_order_relaxed);
+  return (bins >> (asize / DOUBLE_SIZE - 1) & 1) != 0;
+}
 
-  // needs init
-  if (heap_listp == nullptr) {
-    mm_init();
+/*
+ * Allocates an aligned block, C11 style.
+ */
+std::byte* mm_aligned_alloc(std::size_t alignment, std::size_t size) {
+  if (alignment == 0 || size % alignment != 0) {
+    errno = EINVAL;
+    return nullptr;
   }
+  return mm_memalign(alignment, size);
+}
 
-  if (size == 0) {
+/*
+ * Allocates zeroed memory for count objects of size bytes each.
+ *
+ * @return pointer to the block or nullptr if the allocator runs out of memory
+ * or (with errno set to ENOMEM) count * size overflows.
+ */
+std::byte* mm_calloc(std::size_t count, std::size_t size) {
+  std::size_t total;
+  if (__builtin_mul_overflow(count, size, &total)) {
+    errno = ENOMEM;
     return nullptr;
   }
+  std::size_t blksize;
+  std::byte* block_ptr = calloc_block(total, &blksize);
+  if (STATS && block_ptr != nullptr) {
+    stats_alloc(total, blksize, 1);
+  }
+  if (PROFILE && block_ptr != nullptr) {
+    profile_alloc(block_ptr, total);
+  }
+  return block_ptr;
+}
 
-  if (size <= DOUBLE_SIZE) {
-    asize = 2 * DOUBLE_SIZE;  // header + footer == DOUBLE_SIZE
-  } else {
-    // TODO: recheck this - this could be wrong
-
-    // size of headers
-    std::size_t actual_reqsize = size + 2 * WORD_SIZE;
-    // round up to next multiple of DOUBLE_SIZE
-    asize = actual_reqsize + (DOUBLE_SIZE - actual_reqsize % DOUBLE_SIZE);
-
-    // this official version does not make sense:
-    // size = 9
-    // 8 * ((9+ 8 + 7) / 8) = 24
-    // but size = 10
-    // 8 * ( (10 + 8 + 7) / 8) = 25 which is not a multiple of 16
+/*
+ * Allocate a zeroed block without counting it. Huge blocks are fresh
+ * mappings and heap blocks are only cleared where the arena does not know
+ * them to be zero (see arena_calloc); cached blocks were in use before.
+ */
+static std::byte* calloc_block(std::size_t size, std::size_t* blksize) {
+  if (size == 0) {
+    return nullptr;
   }
 
-  // find fit
-  if ((block_ptr = find_fit(asize)) != nullptr) {
-    place(block_ptr, asize);
-    return block_ptr;
+  if (size >= MMAP_THRESHOLD) {
+    return huge_block_of(huge_malloc(size), blksize);
   }
 
-  // if no fit found, extend heap
-  extendsize = max(asize, CHUNK_SIZE);
-  // if extending heap fails (extend_heaps takes the number of words to extend
-  // by)
-  if ((block_ptr = extend_heap(extendsize / WORD_SIZE)) == nullptr) {
-    return nullptr;
+  std::size_t asize = adjust_blksize(size);
+
+  // isolated blocks are aligned ones, which need not come from fresh memory
+  std::byte* block_ptr = nullptr;
+  if (asize <= TCACHE_MAX_BLKSIZE && is_isolated(asize)) {
+    block_ptr = isolated_block(size, blksize);
+  } else if (asize <= TCACHE_MAX_BLKSIZE && tcache.alive) {
+    *blksize = asize;
+    block_ptr = tcache_malloc(asize);
+  } else {
+    Arena* arena = thread_arena();
+    if (arena == nullptr) {
+      return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(arena->mutex);
+    arena_drain_remote(arena);
+    return arena_block_of(arena, arena_calloc(arena, asize, size), blksize);
+  }
+  if (block_ptr != nullptr) {
+    std::memset(block_ptr, 0, size);
   }
-  // otherwise
-  place(block_ptr, asize);
   return block_ptr;
 }
 
@@ -254,83 +451,234 @@ void mm_free(std::byte* block_ptr) {
   if (block_ptr == 0) {
     return;
   }
+  if (PROFILE) {
+    profile_free(block_ptr);
+  }
+  std::size_t blksize = free_block(block_ptr);
+  if (STATS) {
+    stats_free(blksize, 1);
+  }
+}
+
+/*
+ * Free a block without counting it, see mm_free. Blocks of any arena but the
+ * one the thread last allocated from are queued for their arena instead of
+ * taking its lock, see free_remote.
+ *
+ * @return size of the block, for the counters (see malloc_block); 0 if
+ * block_ptr is not a block of this allocator.
+ */
+static std::size_t free_block(std::byte* block_ptr) {
+  Arena* owner = arena_of(block_ptr);
+  if (owner == nullptr) {
+    // huge blocks live outside of the arenas
+    if (!huge_block(block_ptr)) {
+      return 0;
+    }
+    std::size_t size = STATS ? huge_usable_size(block_ptr) : 0;
+    huge_free(block_ptr);
+    return size;
+  }
 
-  std::size_t size = get_blksize(get_header_ptr(block_ptr));
+  std::size_t size = arena_get_blksize(owner, block_ptr);
+  if (owner != tcache.arena) {
+    free_remote(owner, block_ptr);
+    return size;
+  }
 
-  // needs init
-  if (heap_listp == nullptr) {
-    mm_init();
+  if (size <= TCACHE_MAX_BLKSIZE && tcache.alive) {
+    tcache_free(block_ptr, size);
+    return size;
   }
-  // free block by setting allocated bit to 0.
-  put_uvalue_at(get_header_ptr(block_ptr), pack(size, false));
-  put_uvalue_at(get_footer_ptr(block_ptr), pack(size, false));
-  coalesce(block_ptr);
+
+  std::lock_guard<std::mutex> lock(owner->mutex);
+  arena_free(owner, block_ptr);
+  return size;
 }
 
 /*
- * Coalesce free blocks around a given block.
- *
- * @param block_ptr Pointer to block to coalesce.
+ * Queue a block of another thread's arena for that arena, see
+ * arena_push_remote. Once enough is queued the queue is drained here if the
+ * arena is not locked, so that the blocks are coalesced (and the heap trimmed)
+ * even if the arena never allocates again.
+ */
+static void free_remote(Arena* owner, std::byte* block_ptr) {
+  if (arena_push_remote(owner, block_ptr) && owner->mutex.try_lock()) {
+    std::lock_guard<std::mutex> lock(owner->mutex, std::adopt_lock);
+    arena_drain_remote(owner);
+  }
+}
+
+/*
+ * Free a block whose requested size is known. The size picks the thread cache
+ * bin of small blocks without looking at the block's metadata.
  *
- * @return ptr to coalesced block which may be the same as block_ptr
- * in case both the previous and next blocks are allocated.
+ * A cached block may be larger than the bin it is cached in (its real size is
+ * at least the size it was requested with), which is fine since cached blocks
+ * are handed out for requests of the bin's size.
+ */
+void mm_free_sized(std::byte* block_ptr, std::size_t size) {
+  if (block_ptr == nullptr) {
+    return;
+  }
+  if (PROFILE) {
+    profile_free(block_ptr);
+  }
+  std::size_t blksize = free_sized_block(block_ptr, size);
+  if (STATS) {
+    stats_free(blksize, 1);
+  }
+}
+
+/*
+ * Free a block whose requested size is known without counting it, see
+ * mm_free_sized. Cached blocks count with the size of their bin, just as
+ * tcache_malloc hands them out; only blocks that go back to an arena have
+ * their size read.
  *
+ * @return size of the block, for the counters (see free_block).
  */
-static std::byte* coalesce(std::byte* block_ptr) {
-  // is previous block allocated
-  bool prev_allocated =
-      get_allocated(get_footer_ptr(get_prevblk_ptr(block_ptr)));
-  bool next_allocated =
-      get_allocated(get_header_ptr(get_nextblk_ptr(block_ptr)));
-
-  std::size_t coalesced_blksize = get_blksize(get_header_ptr(block_ptr));
-
-  // case 1: current and previous are allocated
-  if (prev_allocated && next_allocated) {
-    return block_ptr;
-  } else if (prev_allocated && !next_allocated) {
-    coalesced_blksize +=
-        get_blksize(get_header_ptr(get_nextblk_ptr(block_ptr)));
-
-    put_uvalue_at(get_header_ptr(block_ptr), pack(coalesced_blksize, false));
-    // TODO: This also seems to be wrong in the book
-    put_uvalue_at(get_footer_ptr(get_nextblk_ptr(block_ptr)),
-                  pack(coalesced_blksize, false));
-  } else if (!prev_allocated && next_allocated) {
-    coalesced_blksize +=
-        get_blksize(get_header_ptr(get_prevblk_ptr(block_ptr)));
-
-    std::byte* prev_blkptr = get_prevblk_ptr(block_ptr);
-
-    put_uvalue_at(get_footer_ptr(block_ptr), pack(coalesced_blksize, false));
-    put_uvalue_at(get_header_ptr(get_prevblk_ptr(block_ptr)),
-                  pack(coalesced_blksize, false));
-
-    block_ptr = prev_blkptr;
-  } else {
-    coalesced_blksize +=
-        get_blksize(get_header_ptr(get_prevblk_ptr(block_ptr))) +
-        get_blksize(get_header_ptr(get_nextblk_ptr(block_ptr)));
+static std::size_t free_sized_block(std::byte* block_ptr, std::size_t size) {
+  // heap blocks can have a usable size above the threshold too
+  if (size >= MMAP_THRESHOLD && huge_block(block_ptr)) {
+    std::size_t blksize = STATS ? huge_usable_size(block_ptr) : 0;
+    huge_free(block_ptr);
+    return blksize;
+  }
 
-    std::byte* prev_blkptr = get_prevblk_ptr(block_ptr);
+  Arena* owner = arena_of(block_ptr);
+  if (owner == nullptr) {
+    // aligned huge blocks can be smaller than the threshold
+    if (!huge_block(block_ptr)) {
+      return 0;
+    }
+    std::size_t blksize = STATS ? huge_usable_size(block_ptr) : 0;
+    huge_free(block_ptr);
+    return blksize;
+  }
 
-    put_uvalue_at(get_header_ptr(get_prevblk_ptr(block_ptr)),
-                  pack(coalesced_blksize, false));
-    put_uvalue_at(get_footer_ptr(get_nextblk_ptr(block_ptr)),
-                  pack(coalesced_blksize, false));
+  std::size_t asize = adjust_blksize(size == 0 ? 1 : size);
+  if (owner == tcache.arena && asize <= TCACHE_MAX_BLKSIZE && tcache.alive) {
+    tcache_free(block_ptr, asize);
+    return asize;
+  }
 
-    block_ptr = prev_blkptr;
+  std::size_t blksize = STATS ? arena_get_blksize(owner, block_ptr) : 0;
+  if (owner != tcache.arena) {
+    free_remote(owner, block_ptr);
+    return blksize;
   }
 
-  return block_ptr;
+  std::lock_guard<std::mutex> lock(owner->mutex);
+  arena_free(owner, block_ptr);
+  return blksize;
+}
+
+/*
+ * Number of bytes that can be used in an allocated block.
+ */
+std::size_t mm_usable_size(std::byte* block_ptr) {
+  if (block_ptr == nullptr) {
+    return 0;
+  }
+
+  Arena* owner = arena_of(block_ptr);
+  if (owner == nullptr) {
+    return huge_block(block_ptr) ? huge_usable_size(block_ptr) : 0;
+  }
+  return arena_usable_size(owner, block_ptr);
+}
+
+/*
+ * Allocate count blocks of size bytes at once.
+ */
+std::size_t mm_malloc_batch(std::size_t size, std::byte** ptrs,
+                            std::size_t count) {
+  if (size == 0 || count == 0) {
+    return 0;
+  }
+
+  std::size_t num_blocks = 0;
+  std::size_t bytes = 0;
+  if (size >= MMAP_THRESHOLD) {
+    while (num_blocks < count &&
+           (ptrs[num_blocks] = huge_malloc(size)) != nullptr) {
+      bytes += STATS ? huge_usable_size(ptrs[num_blocks]) : 0;
+      ++num_blocks;
+    }
+  } else if (Arena* arena = thread_arena(); arena != nullptr) {
+    std::lock_guard<std::mutex> lock(arena->mutex);
+    arena_drain_remote(arena);
+    num_blocks = arena_malloc_batch(arena, adjust_blksize(size), ptrs, count);
+    for (std::size_t i = 0; STATS && i < num_blocks; ++i) {
+      bytes += arena_get_blksize(arena, ptrs[i]);
+    }
+  }
+
+  if (STATS && num_blocks > 0) {
+    stats_alloc(size, bytes, num_blocks);
+  }
+  for (std::size_t i = 0; PROFILE && i < num_blocks; ++i) {
+    profile_alloc(ptrs[i], size);
+  }
+  return num_blocks;
+}
+
+/*
+ * Free count blocks at once. The pointers are sorted by address, which
+ * groups the blocks of every arena and puts neighbours next to each other,
+ * and then every arena is locked once for all of its blocks.
+ */
+void mm_free_batch(std::byte** ptrs, std::size_t count) {
+  std::sort(ptrs, ptrs + count);
+
+  std::size_t i = 0;
+  while (i < count && ptrs[i] == nullptr) {
+    ++i;
+  }
+  for (std::size_t j = i; PROFILE && j < count; ++j) {
+    profile_free(ptrs[j]);
+  }
+  std::size_t num_freed = count - i;
+  std::size_t bytes = 0;
+  while (i < count) {
+    Arena* owner = arena_of(ptrs[i]);
+    if (owner == nullptr) {
+      if (huge_block(ptrs[i])) {
+        bytes += STATS ? huge_usable_size(ptrs[i]) : 0;
+        huge_free(ptrs[i]);
+      }
+      ++i;
+      continue;
+    }
+
+    std::size_t end = i + 1;
+    while (end < count && arena_contains(owner, ptrs[end])) {
+      ++end;
+    }
+    for (std::size_t j = i; STATS && j < end; ++j) {
+      bytes += arena_get_blksize(owner, ptrs[j]);
+    }
+    std::lock_guard<std::mutex> lock(owner->mutex);
+    arena_free_batch(owner, ptrs + i, end - i);
+    i = end;
+  }
+  if (STATS && num_freed > 0) {
+    stats_free(bytes, num_freed);
+  }
 }
 
 /*
- * Reallocates a block using a naive strategy (always reallocates).
+ * Reallocates a block. The block is resized in place when possible:
+ * shrinking splits the tail off into a free block, growing absorbs a free
+ * successor and a block at the top of the heap grows by extending the heap.
+ * Huge blocks that stay huge are remapped.
+ * Only when none of these work is a new block allocated and the contents
+ * copied over.
  *
- * Note that this uses std::memcpy internally and therefore, the original block
- * should only contain trivially copyable types. For this reason, you probably
- * do not want to use this. Here be dragons.
+ * Note that the fallback uses std::memcpy internally and therefore, the
+ * original block should only contain trivially copyable types. For this
+ * reason, you probably do not want to use this. Here be dragons.
  *
  * @param block_ptr Pointer to block to rellocate. If block_ptr is nullptr then
  * this is equivalent to calling mm_malloc.
@@ -353,169 +701,395 @@ std::byte* mm_realloc(std::byte* block_ptr, std::size_t size) {
     return mm_malloc(size);
   }
 
-  // naive reallocation - just get a new block without checking if coalescing is
-  // possbile.
-  // TODO: Implement coalescing.
-  //
-  std::byte* new_blkptr = mm_malloc(size);
-
-  if (!new_blkptr) {
-    return nullptr;
+  // the old address may be handed out again before realloc_block returns, so
+  // its sample goes first (and comes back if the block cannot be resized)
+  ProfileSample sample;
+  bool sampled = profile_take(block_ptr, &sample);
+  std::size_t old_blksize = 0;
+  std::size_t new_blksize = 0;
+  std::byte* new_blkptr =
+      realloc_block(block_ptr, size, &old_blksize, &new_blksize);
+  if (STATS && new_blkptr != nullptr) {
+    stats_realloc(old_blksize, new_blksize);
   }
+  if (PROFILE && new_blkptr != nullptr) {
+    profile_alloc(new_blkptr, size);
+  } else if (sampled) {
+    profile_restore(block_ptr, sample);
+  }
+  return new_blkptr;
+}
 
-  std::size_t oldsize = get_blksize(get_header_ptr(block_ptr));
-  // if requested size is smaller, the current block may be potentially
-  // truncated. Otherwise, memcpy current contents of block and free it.
-  if (size < oldsize) {
-    oldsize = size;
+/*
+ * Resize a non-null block to a non-zero size without counting it, see
+ * mm_realloc.
+ *
+ * @param[out] old_blksize size of the block before, see malloc_block.
+ * @param[out] new_blksize size of the resized block.
+ */
+static std::byte* realloc_block(std::byte* block_ptr, std::size_t size,
+                                std::size_t* old_blksize,
+                                std::size_t* new_blksize) {
+  Arena* owner = arena_of(block_ptr);
+  if (owner == nullptr || size >= MMAP_THRESHOLD) {
+    return realloc_huge(owner, block_ptr, size, old_blksize, new_blksize);
   }
-  std::memcpy(new_blkptr, block_ptr, oldsize);
-  mm_free(block_ptr);
 
-  return new_blkptr;
+  // the block stays in (or moves within) the arena it came from
+  std::lock_guard<std::mutex> lock(owner->mutex);
+  if (STATS) {
+    *old_blksize = arena_get_blksize(owner, block_ptr);
+  }
+  return arena_block_of(owner, arena_realloc(owner, block_ptr, size),
+                        new_blksize);
 }
 
 /*
  * Checks heap for correctness.
  */
-void mm_checkheap(int verbose) { checkheap(verbose); }
+int mm_checkheap(int verbose) {
+  bool ok = true;
+  for (std::size_t i = 0; i < NUM_ARENAS; ++i) {
+    if (arena_ready[i].load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(arenas[i].mutex);
+      arena_drain_remote(&arenas[i]);
+      ok = arena_checkheap(&arenas[i], verbose) && ok;
+    }
+  }
+  ok = huge_checkheap(verbose) && ok;
+  return ok ? 0 : -1;
+}
 
 /*
- * Extend heap by creating a new block of size "words" * WORD_SIZE bytes.
- *
- * @param words Number of words to extend the heap by.
- * @return pointer to the new block.
+ * Check the next blocks of every heap.
  */
-static std::byte* extend_heap(std::size_t words) {
-  std::size_t size =
-      (words % 2 == 0) ? words * WORD_SIZE : (words + 1) * WORD_SIZE;
-
-  std::byte* block_ptr = nullptr;
+int mm_checkheap_step(std::size_t max_blocks) {
+  bool ok = true;
+  for (std::size_t i = 0; i < NUM_ARENAS; ++i) {
+    if (arena_ready[i].load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(arenas[i].mutex);
+      ok = arena_check_step(&arenas[i], max_blocks) && ok;
+    }
+  }
+  return ok ? 0 : -1;
+}
 
-  if ((block_ptr = mem_sbrk(size)) == nullptr) {
-    return nullptr;
+/*
+ * Collect the statistics of all threads and arenas.
+ */
+MmStats mm_stats() {
+  MmStats stats{};
+
+  stats_collect(&stats);
+  for (std::size_t i = 0; i < NUM_ARENAS; ++i) {
+    if (arena_ready[i].load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(arenas[i].mutex);
+      arena_drain_remote(&arenas[i]);
+      arena_collect_stats(&arenas[i], &stats);
+    }
   }
+  stats.mapped_size = huge_mapped_bytes();
+  return stats;
+}
 
-  // initialize the new block
+/*
+ * Give free memory back to the OS.
+ */
+int mm_trim() {
+  std::size_t released = 0;
+
+  // cached blocks count as allocated for the arenas
+  tcache_validate();
+  for (std::size_t bin = 0; bin < NUM_TCACHE_BINS; ++bin) {
+    drain_blocks(tcache.bins[bin], tcache.counts[bin]);
+    tcache.bins[bin] = nullptr;
+    tcache.counts[bin] = 0;
+  }
 
-  // overwrite prev free list epilogue
-  put_uvalue_at(get_header_ptr(block_ptr), pack(size, false));
-  put_uvalue_at(get_footer_ptr(block_ptr), pack(size, false));
-  // create new epilogue
-  put_uvalue_at(get_header_ptr(get_nextblk_ptr(block_ptr)), pack(0, true));
+  for (std::size_t i = 0; i < NUM_ARENAS; ++i) {
+    if (arena_ready[i].load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(arenas[i].mutex);
+      arena_drain_remote(&arenas[i]);
+      released += arena_trim(&arenas[i]);
+    }
+  }
+  return released > 0 ? 1 : 0;
+}
 
-  return coalesce(block_ptr);
+void mm_teardown() {
+  heap_epoch.fetch_add(1, std::memory_order_relaxed);
+  for (std::size_t i = 0; i < NUM_ARENAS; ++i) {
+    std::lock_guard<std::mutex> lock(arenas[i].mutex);
+    if (arena_initialized(&arenas[i])) {
+      arena_ready[i].store(false, std::memory_order_release);
+      arena_teardown(&arenas[i]);
+    }
+  }
+  huge_teardown();
+  stats_reset();
+  profile_reset();
 }
 
 /*
- * Place block of asize bytes at start of a free block "block_ptr"
- * and split block if remainder would be at least minimum block size.
+ * Get an arena by index, initializing it on first use.
  *
- * @param block_ptr Pointer to free block
- * @param asize block size
+ * @return pointer to the arena or nullptr if it could not be initialized.
  */
-static void place(std::byte* block_ptr, std::size_t asize) {
-  std::size_t curr_size = get_blksize(get_header_ptr(block_ptr));
-
-  if ((curr_size - asize) >= (2 * DOUBLE_SIZE)) {
-    put_uvalue_at(get_header_ptr(block_ptr), pack(asize, true));
-    put_uvalue_at(get_footer_ptr(block_ptr), pack(asize, true));
+static Arena* get_arena(std::size_t index) {
+  Arena* arena = &arenas[index];
 
-    block_ptr = get_nextblk_ptr(block_ptr);
+  if (!arena_ready[index].load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(arena->mutex);
+    if (ARENA_ASSIGNMENT == ArenaAssignment::numa) {
+      arena->node = arena_node(index);
+    }
+    if (!arena_initialized(arena) && arena_init(arena) != 0) {
+      return nullptr;
+    }
+    arena_ready[index].store(true, std::memory_order_release);
+  }
+  return arena;
+}
 
-    put_uvalue_at(get_header_ptr(block_ptr), pack(curr_size - asize, false));
-    put_uvalue_at(get_footer_ptr(block_ptr), pack(curr_size - asize, false));
+/*
+ * Get the arena the calling thread allocates from and remember it as the
+ * thread's arena, see free_block. Only the allocation paths call this, since
+ * it sets up the arena on a thread's first call.
+ */
+static Arena* thread_arena() {
+  if constexpr (ARENA_ASSIGNMENT == ArenaAssignment::cpu) {
+    int cpu = sched_getcpu();
+    tcache.arena =
+        get_arena(cpu < 0 ? 0 : static_cast<std::size_t>(cpu) % NUM_ARENAS);
+  } else if constexpr (ARENA_ASSIGNMENT == ArenaAssignment::numa) {
+    static thread_local std::size_t slot =
+        next_arena.fetch_add(1, std::memory_order_relaxed);
+    tcache.arena = get_arena(numa_arena(slot));
   } else {
-    put_uvalue_at(get_header_ptr(block_ptr), pack(curr_size, true));
-    put_uvalue_at(get_footer_ptr(block_ptr), pack(curr_size, true));
+    static thread_local std::size_t index =
+        next_arena.fetch_add(1, std::memory_order_relaxed) % NUM_ARENAS;
+    tcache.arena = get_arena(index);
   }
+  return tcache.arena;
 }
 
 /*
- * Finds a fitting block for asize by walking the list from the beginning.
- * Returns the first block that can contain asize bytes.
+ * NUMA nodes the arenas are dealt out to, see mem_numa_nodes. 0 without NUMA
+ * support in the kernel: all arenas are then on one node and are not bound.
+ */
+static uint64_t numa_nodes() {
+  static const uint64_t nodes = mem_numa_nodes();
+  return nodes;
+}
+
+/*
+ * Arena of the node the calling thread runs on.
  *
- * @param asize Minimum of the block to find fit for.
+ * @param slot the thread's turn: picks one of the node's arenas.
+ */
+static std::size_t numa_arena(std::size_t slot) {
+  uint64_t nodes = numa_nodes();
+  std::size_t num_nodes =
+      nodes != 0 ? static_cast<std::size_t>(std::popcount(nodes)) : 1;
+  int node = mem_current_node();
+  std::size_t rank = 0; /* position of node among the allowed nodes */
+  if (node >= 0 && node < 63 && (nodes >> node & 1) != 0) {
+    rank = static_cast<std::size_t>(
+        std::popcount(nodes & ((uint64_t{1} << node) - 1)));
+  }
+  if (rank >= NUM_ARENAS) {
+    return rank % NUM_ARENAS;  // fewer arenas than nodes
+  }
+  // the node's arenas are rank, rank + num_nodes, ...
+  std::size_t node_arenas = (NUM_ARENAS - rank + num_nodes - 1) / num_nodes;
+  return rank + num_nodes * (slot % node_arenas);
+}
+
+/*
+ * Node the memory of arena index is bound to, -1 for none.
+ */
+static int arena_node(std::size_t index) {
+  uint64_t nodes = numa_nodes();
+  if (nodes == 0) {
+    return -1;
+  }
+  std::size_t num_nodes = static_cast<std::size_t>(std::popcount(nodes));
+  for (std::size_t rank = index % num_nodes; rank > 0; --rank) {
+    nodes &= nodes - 1;  // drop the lowest node
+  }
+  return std::countr_zero(nodes);
+}
+
+/*
+ * Find the arena a block was allocated from.
  *
- * @return pointer to block. Returns nullptr is no fitting block is found.
- */
-static std::byte* find_fit(std::size_t asize) {
-  std::byte* block_ptr;
-  for (block_ptr = heap_listp; get_blksize(get_header_ptr(block_ptr)) > 0;
-       block_ptr = get_nextblk_ptr(block_ptr)) {
-    if (!get_allocated(get_header_ptr(block_ptr)) &&
-        (asize <= get_blksize(get_header_ptr(block_ptr)))) {
-      return block_ptr;
+ * @return the owning arena or nullptr if block_ptr is not in any arena.
+ */
+static Arena* arena_of(std::byte* block_ptr) {
+  for (std::size_t i = 0; i < NUM_ARENAS; ++i) {
+    if (arena_ready[i].load(std::memory_order_acquire) &&
+        arena_contains(&arenas[i], block_ptr)) {
+      return &arenas[i];
     }
   }
   return nullptr;
 }
 
 /*
- * print contents of block
+ * Free up to count blocks of a list linked through their first word back to
+ * the arenas they belong to. An arena's lock is held across consecutive blocks
+ * of the same arena.
  */
-static void printblock(std::byte* block_ptr) {
-  std::size_t hsize, halloc, fsize, falloc;
-
-  checkheap(0);
-
-  hsize = get_blksize(get_header_ptr(block_ptr));
-  halloc = get_allocated(get_header_ptr(block_ptr));
-  fsize = get_blksize(get_footer_ptr(block_ptr));
-  falloc = get_allocated(get_footer_ptr(block_ptr));
-
-  if (hsize == 0) {
-    fmt::print("{}: EOL\n", fmt::ptr(block_ptr));
-    return;
+static void drain_blocks(std::byte* block_ptr, std::size_t count) {
+  std::unique_lock<std::mutex> lock;
+  Arena* locked_arena = nullptr;
+
+  for (; block_ptr != nullptr && count > 0; --count) {
+    std::byte* next = get_nextfree_ptr(block_ptr);
+    Arena* owner = arena_of(block_ptr);
+    if (owner != locked_arena) {
+      // never hold two arena locks at once
+      if (lock.owns_lock()) {
+        lock.unlock();
+      }
+      lock = std::unique_lock<std::mutex>(owner->mutex);
+      locked_arena = owner;
+    }
+    arena_free(owner, block_ptr);
+    block_ptr = next;
   }
-
-  fmt::print("{}: header: [{}:{}], footer: [{}:{}]", fmt::ptr(block_ptr), hsize,
-             (halloc ? 'a' : 'f'), fsize, (falloc ? 'a' : 'f'));
 }
 
-static void checkblock(std::byte* block_ptr) {
-  bool is_aligned =
-      (reinterpret_cast<std::uintptr_t>(block_ptr) % DOUBLE_SIZE == 0);
+/*
+ * Reallocate a block when the block or the new size is huge. Huge blocks are
+ * remapped while they stay huge; everything else moves the contents over to
+ * a new block.
+ *
+ * @param owner arena of the block or nullptr if the block is not in an arena.
+ * @param[out] old_blksize, new_blksize see realloc_block.
+ */
+static std::byte* realloc_huge(Arena* owner, std::byte* block_ptr,
+                               std::size_t size, std::size_t* old_blksize,
+                               std::size_t* new_blksize) {
+  bool was_huge = owner == nullptr;
+  if (was_huge && !huge_block(block_ptr)) {
+    return nullptr;
+  }
+  if (was_huge && size >= MMAP_THRESHOLD) {
+    if (STATS) {
+      *old_blksize = huge_usable_size(block_ptr);
+    }
+    return huge_block_of(huge_realloc(block_ptr, size), new_blksize);
+  }
 
-  if (!is_aligned) {
-    fmt::print("Error: {} is not doubleword algined\n", fmt::ptr(block_ptr));
+  std::byte* new_blkptr = malloc_block(size, new_blksize);
+  if (new_blkptr == nullptr) {
+    return nullptr;
   }
+  std::size_t usable = was_huge ? huge_usable_size(block_ptr)
+                                : arena_usable_size(owner, block_ptr);
+  std::memcpy(new_blkptr, block_ptr, std::min(usable, size));
+  *old_blksize = free_block(block_ptr);
+  return new_blkptr;
+}
 
-  if (get_uat(get_header_ptr(block_ptr)) !=
-      get_uat(get_footer_ptr(block_ptr))) {
-    fmt::print("Error: header does not match footer\n");
+/*
+ * Drop the contents of the calling thread's cache if the heap they came from
+ * has been torn down since they were cached.
+ */
+static void tcache_validate() {
+  uint64_t epoch = heap_epoch.load(std::memory_order_relaxed);
+  if (tcache.epoch != epoch) {
+    std::fill(std::begin(tcache.bins), std::end(tcache.bins), nullptr);
+    std::fill(std::begin(tcache.counts), std::end(tcache.counts), 0);
+    tcache.epoch = epoch;
   }
 }
 
-void checkheap(int verbose) {
-  std::byte* block_ptr = heap_listp;
+/*
+ * Allocate a small block from the calling thread's cache, refilling the cache
+ * from the thread's arena if it has no block of this size.
+ *
+ * @param asize adjusted block size, at most TCACHE_MAX_BLKSIZE.
+ * @return pointer to the block or nullptr if the heap is out of memory.
+ */
+static std::byte* tcache_malloc(std::size_t asize) {
+  std::size_t bin = asize / DOUBLE_SIZE - 1;
+
+  tcache_validate();
+  if (tcache.bins[bin] == nullptr) {
+    Arena* arena = thread_arena();
+    if (arena == nullptr) {
+      return nullptr;
+    }
 
-  if (verbose) {
-    fmt::print("Heap ({}):\n", fmt::ptr(heap_listp));
+    std::byte* batch[TCACHE_BATCH];
+    std::size_t num_blocks = 0;
+    {
+      std::lock_guard<std::mutex> lock(arena->mutex);
+      arena_drain_remote(arena);
+      num_blocks = arena_refill(arena, asize, batch, TCACHE_BATCH);
+    }
+    // push in reverse so that blocks are handed out in address order
+    while (num_blocks > 0) {
+      std::byte* block_ptr = batch[--num_blocks];
+      put_nextfree_ptr(block_ptr, tcache.bins[bin]);
+      tcache.bins[bin] = block_ptr;
+      ++tcache.counts[bin];
+    }
+    if (tcache.bins[bin] == nullptr) {
+      return nullptr;
+    }
   }
 
-  if ((get_blksize(get_header_ptr(block_ptr))) != DOUBLE_SIZE ||
-      !get_allocated(get_header_ptr(heap_listp))) {
-    fmt::print("Bad prologue header\n");
-  }
-  checkblock(heap_listp);
+  std::byte* block_ptr = tcache.bins[bin];
+  tcache.bins[bin] = get_nextfree_ptr(block_ptr);
+  --tcache.counts[bin];
+  return block_ptr;
+}
 
-  for (block_ptr = heap_listp; get_blksize(get_header_ptr(block_ptr)) > 0;
-       block_ptr = get_nextblk_ptr(block_ptr)) {
-    if (verbose) {
-      printblock(block_ptr);
-    }
+/*
+ * Put a small block in the calling thread's cache. If the cache holds too many
+ * blocks of this size, a batch of them is returned to the arenas.
+ *
+ * @param block_ptr pointer to an allocated block.
+ * @param size block size, at most TCACHE_MAX_BLKSIZE.
+ */
+static void tcache_free(std::byte* block_ptr, std::size_t size) {
+  std::size_t bin = size / DOUBLE_SIZE - 1;
 
-    checkblock(block_ptr);
+  tcache_validate();
+  put_nextfree_ptr(block_ptr, tcache.bins[bin]);
+  tcache.bins[bin] = block_ptr;
+
+  if (++tcache.counts[bin] > TCACHE_MAX_COUNT) {
+    std::byte* rest = tcache.bins[bin];
+    for (std::size_t i = 0; i < TCACHE_BATCH; ++i) {
+      rest = get_nextfree_ptr(rest);
+    }
+    drain_blocks(tcache.bins[bin], TCACHE_BATCH);
+    tcache.bins[bin] = rest;
+    tcache.counts[bin] -= TCACHE_BATCH;
   }
+}
 
-  if (verbose) {
-    printblock(block_ptr);
+/*
+ * Return everything a thread still caches to the arenas when the thread
+ * exits, and free the blocks queued for its arena.
+ */
+ThreadCache::~ThreadCache() {
+  alive = false;
+  if (epoch != heap_epoch.load(std::memory_order_relaxed)) {
+    return;
   }
-  if ((get_blksize(get_header_ptr(block_ptr))) != 0 ||
-      !(get_allocated(get_header_ptr(block_ptr)))) {
-    fmt::print("Bad epilogue header\n");
+  for (std::size_t bin = 0; bin < NUM_TCACHE_BINS; ++bin) {
+    drain_blocks(bins[bin], counts[bin]);
+    bins[bin] = nullptr;
+    counts[bin] = 0;
+  }
+  // the arena may not allocate again to free what other threads queued
+  if (arena != nullptr) {
+    std::lock_guard<std::mutex> lock(arena->mutex);
+    arena_drain_remote(arena);
   }
 }
-
-void mm_teardown() { mem_teardown(); }
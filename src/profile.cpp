@@ -0,0 +1,444 @@
+#include "profile.h"
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <utility>
+
+#include "memlib.h"
+#include "mm.h"
+
+/*
+ * This file implements the sampling heap profiler, see profile.h. Profiles
+ * are written in the legacy text format of gperftools' heap profiler, which
+ * pprof reads: a header with the totals and the sampling interval (pprof
+ * scales the samples back up with it), one line per sample with its call
+ * stack and the process's mappings for symbolization.
+ */
+
+/* buffered writes to a file descriptor without going through malloc */
+struct ProfileWriter {
+  int fd;
+  bool ok = true;
+  std::size_t used = 0;
+  char buffer[4096];
+};
+
+constexpr std::size_t SLOT_MASK = PROFILE_TABLE_SIZE - 1;
+constexpr std::size_t NO_SLOT = PROFILE_TABLE_SIZE;
+
+std::atomic<unsigned> profile_state{0};
+
+static std::mutex profile_mutex; /* held while the table changes */
+static std::atomic<std::size_t> sample_interval{0}; /* 0: sampling is off */
+static std::size_t num_samples = 0; /* under profile_mutex */
+static std::atomic<uint64_t> table_seq{0}; /* odd while the table changes */
+/* block address of every slot (0 if empty) and its sample */
+static std::atomic<std::uintptr_t>* table_keys = nullptr;
+static ProfileSample* table_samples = nullptr;
+
+/* where a profile requested by a signal (see PROFILE_DUMP) is written */
+static char signal_path[4096];
+
+static thread_local int64_t bytes_until_sample = 0;
+static thread_local uint64_t rng_state = 0;
+static thread_local bool in_profiler = false; /* no sampling while set */
+
+// forward declarations
+static void record_sample(std::byte* block_ptr, const ProfileSample& sample);
+static int64_t next_sample_distance(std::size_t interval);
+static std::size_t home_slot(std::uintptr_t key);
+static std::size_t find_slot(std::uintptr_t key);
+static void begin_write();
+static void end_write();
+static void remove_slot(std::size_t slot);
+static int write_profile(const char* path);
+static void write_requested_profile();
+template <typename... Args>
+static void print(ProfileWriter* writer, fmt::format_string<Args...> format,
+                  Args&&... args);
+static void append(ProfileWriter* writer, const char* data, std::size_t size);
+static void flush(ProfileWriter* writer);
+static void handle_signal(int signo);
+
+void profile_count(std::byte* block_ptr, std::size_t size) {
+  if constexpr (PROFILE) {
+    std::size_t interval = sample_interval.load(std::memory_order_relaxed);
+    if (interval != 0) {
+      bytes_until_sample -= static_cast<int64_t>(size);
+    }
+    if (interval != 0 && bytes_until_sample < 0 && !in_profiler) {
+      // backtrace may allocate the first time it is called
+      in_profiler = true;
+      // the stack starts at the mm_* function that was called, not in here
+      void* frames[PROFILE_MAX_DEPTH + 1];
+      int depth = backtrace(frames, PROFILE_MAX_DEPTH + 1) - 1;
+      ProfileSample sample;
+      sample.size = size;
+      sample.depth = depth > 0 ? depth : 0;
+      if (sample.depth > 0) {
+        std::memcpy(sample.frames, frames + 1,
+                    static_cast<std::size_t>(sample.depth) * sizeof(void*));
+      }
+      record_sample(block_ptr, sample);
+      bytes_until_sample = next_sample_distance(interval);
+      in_profiler = false;
+    }
+    write_requested_profile();
+  }
+}
+
+bool profile_drop(std::byte* block_ptr, ProfileSample* sample) {
+  bool found = false;
+  if constexpr (PROFILE) {
+    std::uintptr_t key = reinterpret_cast<std::uintptr_t>(block_ptr);
+    // a dump request alone gets here before the table may have been mapped
+    if ((profile_state.load(std::memory_order_acquire) & PROFILE_SAMPLED) &&
+        find_slot(key) != NO_SLOT) {
+      std::lock_guard<std::mutex> lock(profile_mutex);
+      std::size_t slot = find_slot(key);
+      if (slot != NO_SLOT) {
+        if (sample != nullptr) {
+          *sample = table_samples[slot];
+        }
+        remove_slot(slot);
+        found = true;
+      }
+    }
+    write_requested_profile();
+  }
+  return found;
+}
+
+void profile_restore(std::byte* block_ptr, const ProfileSample& sample) {
+  if constexpr (PROFILE) {
+    record_sample(block_ptr, sample);
+  }
+}
+
+void profile_reset() {
+  std::lock_guard<std::mutex> lock(profile_mutex);
+  if (table_keys != nullptr) {
+    begin_write();
+    for (std::size_t slot = 0; slot < PROFILE_TABLE_SIZE; ++slot) {
+      table_keys[slot].store(0, std::memory_order_relaxed);
+    }
+    end_write();
+  }
+  num_samples = 0;
+  profile_state.fetch_and(~PROFILE_SAMPLED, std::memory_order_relaxed);
+}
+
+/*
+ * Start sampling, mapping the table on first use.
+ */
+int mm_profile_start(std::size_t interval) {
+  if (!PROFILE) {
+    errno = ENOSYS;
+    return -1;
+  }
+  if (interval > 0) {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    if (table_keys == nullptr) {
+      std::size_t keys_size = PROFILE_TABLE_SIZE * sizeof(*table_keys);
+      std::size_t size =
+          keys_size + PROFILE_TABLE_SIZE * sizeof(*table_samples);
+      size = (size + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+      std::byte* table = mem_map(size);
+      if (table == nullptr) {
+        return -1;
+      }
+      // the mapping is zeroed, i.e. every slot is empty
+      table_keys = reinterpret_cast<std::atomic<std::uintptr_t>*>(table);
+      table_samples = reinterpret_cast<ProfileSample*>(table + keys_size);
+    }
+  }
+  sample_interval.store(interval, std::memory_order_relaxed);
+  if (interval > 0) {
+    profile_state.fetch_or(PROFILE_SAMPLING, std::memory_order_relaxed);
+  } else {
+    profile_state.fetch_and(~PROFILE_SAMPLING, std::memory_order_relaxed);
+  }
+  return 0;
+}
+
+/*
+ * Write the live samples to path.
+ */
+int mm_profile_dump(const char* path) {
+  if (!PROFILE) {
+    errno = ENOSYS;
+    return -1;
+  }
+  bool was_in_profiler = in_profiler;
+  in_profiler = true;
+  int result = write_profile(path);
+  in_profiler = was_in_profiler;
+  return result;
+}
+
+/*
+ * Install a handler for signo that requests a profile. Writing a file is not
+ * async-signal-safe, so the handler only sets PROFILE_DUMP.
+ */
+int mm_profile_dump_on_signal(int signo, const char* path) {
+  if (!PROFILE) {
+    errno = ENOSYS;
+    return -1;
+  }
+  std::size_t length = std::strlen(path);
+  if (length >= sizeof(signal_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  std::memcpy(signal_path, path, length + 1);
+
+  struct sigaction action {};
+  action.sa_handler = handle_signal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  return sigaction(signo, &action, nullptr);
+}
+
+/*
+ * Put a sample of block_ptr into the table. Samples that do not fit are
+ * dropped.
+ */
+static void record_sample(std::byte* block_ptr, const ProfileSample& sample) {
+  std::lock_guard<std::mutex> lock(profile_mutex);
+  if (table_keys == nullptr || 2 * num_samples >= PROFILE_TABLE_SIZE) {
+    return;
+  }
+  std::uintptr_t key = reinterpret_cast<std::uintptr_t>(block_ptr);
+  std::size_t slot = home_slot(key);
+  while (table_keys[slot].load(std::memory_order_relaxed) != 0) {
+    slot = (slot + 1) & SLOT_MASK;
+  }
+  table_samples[slot] = sample;
+  begin_write();
+  table_keys[slot].store(key, std::memory_order_relaxed);
+  end_write();
+  // pairs with the acquire in profile_take
+  if (++num_samples == 1) {
+    profile_state.fetch_or(PROFILE_SAMPLED, std::memory_order_release);
+  }
+}
+
+/*
+ * Number of bytes until the next sample: exponentially distributed with mean
+ * interval, so that every allocated byte is equally likely to be sampled.
+ */
+static int64_t next_sample_distance(std::size_t interval) {
+  if (rng_state == 0) {
+    // every thread has a state at a different address
+    rng_state = reinterpret_cast<std::uintptr_t>(&rng_state);
+  }
+  // splitmix64
+  uint64_t z = (rng_state += 0x9e3779b97f4a7c15);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+  z ^= z >> 31;
+  // uniform in (0, 1]
+  double uniform = static_cast<double>((z >> 11) + 1) * 0x1.0p-53;
+  double distance = -std::log(uniform) * static_cast<double>(interval);
+  return distance < 0x1.0p62 ? static_cast<int64_t>(distance) : INT64_MAX;
+}
+
+static std::size_t home_slot(std::uintptr_t key) {
+  return static_cast<std::size_t>(((key >> 4) * 0x9e3779b97f4a7c15) >> 32) &
+         SLOT_MASK;
+}
+
+/*
+ * Find the slot of a block. Safe to call without profile_mutex: a lookup that
+ * overlapped a change of the table is retried.
+ *
+ * @return the slot or NO_SLOT if the block has no sample.
+ */
+static std::size_t find_slot(std::uintptr_t key) {
+  for (;;) {
+    uint64_t seq = table_seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      continue;
+    }
+    std::size_t slot = home_slot(key);
+    std::uintptr_t slot_key;
+    while ((slot_key = table_keys[slot].load(std::memory_order_relaxed)) != 0 &&
+           slot_key != key) {
+      slot = (slot + 1) & SLOT_MASK;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (table_seq.load(std::memory_order_relaxed) == seq) {
+      return slot_key == key ? slot : NO_SLOT;
+    }
+  }
+}
+
+/*
+ * Bracket a change of table_keys. Callers hold profile_mutex.
+ */
+static void begin_write() {
+  table_seq.store(table_seq.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+static void end_write() {
+  table_seq.store(table_seq.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_release);
+}
+
+/*
+ * Empty a slot. Later entries of the same probe sequence are shifted back
+ * into the hole so that lookups can stop at the first empty slot.
+ */
+static void remove_slot(std::size_t slot) {
+  begin_write();
+  std::size_t hole = slot;
+  for (std::size_t i = (slot + 1) & SLOT_MASK;; i = (i + 1) & SLOT_MASK) {
+    std::uintptr_t key = table_keys[i].load(std::memory_order_relaxed);
+    if (key == 0) {
+      break;
+    }
+    // the entry may move back if the hole is between its home and i
+    if (((i - home_slot(key)) & SLOT_MASK) >= ((i - hole) & SLOT_MASK)) {
+      table_keys[hole].store(key, std::memory_order_relaxed);
+      table_samples[hole] = table_samples[i];
+      hole = i;
+    }
+  }
+  table_keys[hole].store(0, std::memory_order_relaxed);
+  end_write();
+  if (--num_samples == 0) {
+    profile_state.fetch_and(~PROFILE_SAMPLED, std::memory_order_relaxed);
+  }
+}
+
+/*
+ * Write the profile. Nothing in here allocates, so it is safe to call from
+ * inside the allocator.
+ *
+ * @return 0 on success, -1 (with errno set) if the file could not be
+ * written.
+ */
+static int write_profile(const char* path) {
+  ProfileWriter writer;
+  writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (writer.fd < 0) {
+    return -1;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(profile_mutex);
+    std::size_t count = 0;
+    std::size_t bytes = 0;
+    for (std::size_t slot = 0; table_keys != nullptr && slot < NO_SLOT;
+         ++slot) {
+      if (table_keys[slot].load(std::memory_order_relaxed) != 0) {
+        ++count;
+        bytes += table_samples[slot].size;
+      }
+    }
+    // only live blocks are kept, so they are the allocated totals as well
+    print(&writer, "heap profile: {}: {} [{}: {}] @ heap_v2/{}\n", count,
+          bytes, count, bytes, sample_interval.load(std::memory_order_relaxed));
+    for (std::size_t slot = 0; table_keys != nullptr && slot < NO_SLOT;
+         ++slot) {
+      if (table_keys[slot].load(std::memory_order_relaxed) == 0) {
+        continue;
+      }
+      const ProfileSample& sample = table_samples[slot];
+      print(&writer, "1: {} [1: {}] @", sample.size, sample.size);
+      for (int i = 0; i < sample.depth; ++i) {
+        print(&writer, " {}", fmt::ptr(sample.frames[i]));
+      }
+      append(&writer, "\n", 1);
+    }
+  }
+
+  // the mappings let pprof symbolize the stacks
+  print(&writer, "\nMAPPED_LIBRARIES:\n");
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps >= 0) {
+    char buffer[4096];
+    ssize_t length;
+    while ((length = read(maps, buffer, sizeof(buffer))) > 0) {
+      append(&writer, buffer, static_cast<std::size_t>(length));
+    }
+    close(maps);
+  }
+  flush(&writer);
+
+  bool ok = writer.ok;
+  if (close(writer.fd) != 0) {
+    ok = false;
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Write the profile requested by a signal, if there is one and the calling
+ * thread is not in the profiler already.
+ */
+static void write_requested_profile() {
+  if (!in_profiler &&
+      (profile_state.load(std::memory_order_relaxed) & PROFILE_DUMP) &&
+      (profile_state.fetch_and(~PROFILE_DUMP, std::memory_order_acquire) &
+       PROFILE_DUMP)) {
+    in_profiler = true;
+    write_profile(signal_path);
+    in_profiler = false;
+  }
+}
+
+template <typename... Args>
+static void print(ProfileWriter* writer, fmt::format_string<Args...> format,
+                  Args&&... args) {
+  char line[256];
+  auto result = fmt::format_to_n(line, sizeof(line), format,
+                                 std::forward<Args>(args)...);
+  append(writer, line, std::min(result.size, sizeof(line)));
+}
+
+static void append(ProfileWriter* writer, const char* data,
+                   std::size_t size) {
+  while (size > 0) {
+    if (writer->used == sizeof(writer->buffer)) {
+      flush(writer);
+    }
+    std::size_t chunk = std::min(size, sizeof(writer->buffer) - writer->used);
+    std::memcpy(writer->buffer + writer->used, data, chunk);
+    writer->used += chunk;
+    data += chunk;
+    size -= chunk;
+  }
+}
+
+static void flush(ProfileWriter* writer) {
+  std::size_t written = 0;
+  while (writer->ok && written < writer->used) {
+    ssize_t length = write(writer->fd, writer->buffer + written,
+                             writer->used - written);
+    if (length < 0 && errno != EINTR) {
+      writer->ok = false;
+    } else if (length > 0) {
+      written += static_cast<std::size_t>(length);
+    }
+  }
+  writer->used = 0;
+}
+
+static void handle_signal(int) {
+  profile_state.fetch_or(PROFILE_DUMP, std::memory_order_release);
+}
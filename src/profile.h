@@ -0,0 +1,116 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <atomic>
+#include <cstddef>
+
+/*
+ * Sampling heap profiler behind mm_profile_start and mm_profile_dump. Every
+ * thread counts down the bytes it allocates; when the count runs out the
+ * allocation is sampled: its call stack is recorded in a table keyed by the
+ * block's address and the next count is drawn from an exponential
+ * distribution with the sampling interval as its mean (so that sampling is a
+ * Poisson process over the allocated bytes, as in tcmalloc). Freeing a
+ * sampled block drops its entry.
+ *
+ * Whether there is anything to do is kept in a single word, profile_state,
+ * which the inline functions below load: when sampling is off an allocation
+ * costs that relaxed load, and while no block is sampled a free costs the
+ * same. Dumps requested by a signal are written by the next allocation or
+ * free that sees the request, sampled or not.
+ *
+ * The table is a linear probing hash table in a mapping of its own, so that
+ * the profiler never allocates through the allocator it is profiling. It is
+ * changed under a mutex; frees look their block up without taking it (under
+ * a sequence lock), since most freed blocks are not sampled.
+ *
+ * Profiling is compiled in with -DMM_PROFILE=<0|1>.
+ */
+#ifndef MM_PROFILE
+#define MM_PROFILE 1
+#endif
+constexpr bool PROFILE = MM_PROFILE;
+constexpr std::size_t PROFILE_MAX_DEPTH = 32; /* frames per call stack */
+/* table slots, at most half of which are used */
+constexpr std::size_t PROFILE_TABLE_SIZE = 1 << 15;
+static_assert((PROFILE_TABLE_SIZE & (PROFILE_TABLE_SIZE - 1)) == 0,
+              "table size must be a power of two");
+
+/* bits of profile_state */
+constexpr unsigned PROFILE_SAMPLING = 1; /* the sampling interval is not 0 */
+constexpr unsigned PROFILE_SAMPLED = 2;  /* some blocks have a sample */
+constexpr unsigned PROFILE_DUMP = 4;     /* a signal requested a profile */
+extern std::atomic<unsigned> profile_state;
+
+/* the call stack of a sampled block */
+struct ProfileSample {
+  std::size_t size; /* requested size */
+  int depth;        /* number of frames */
+  void* frames[PROFILE_MAX_DEPTH];
+};
+
+/*
+ * Count an allocation of size bytes that got block_ptr, see profile_alloc.
+ * Never inlined: the recorded call stack skips exactly this function's frame.
+ */
+[[gnu::noinline]] void profile_count(std::byte* block_ptr, std::size_t size);
+
+/*
+ * Drop the sample of block_ptr, see profile_take.
+ */
+bool profile_drop(std::byte* block_ptr, ProfileSample* sample);
+
+/*
+ * Count an allocation of size bytes that got block_ptr and sample it if the
+ * calling thread's count ran out. Must be called outside of any arena lock,
+ * directly from the mm_* function, whose frame starts the call stack.
+ */
+[[gnu::always_inline]] inline void profile_alloc(std::byte* block_ptr,
+                                                 std::size_t size) {
+  if constexpr (PROFILE) {
+    if (profile_state.load(std::memory_order_relaxed) &
+        (PROFILE_SAMPLING | PROFILE_DUMP)) {
+      profile_count(block_ptr, size);
+    }
+  }
+}
+
+/*
+ * Drop the sample of block_ptr, if there is one, and keep a copy of it in
+ * sample. Must be called outside of any arena lock and before the block is
+ * freed, so that its address cannot be handed out (and sampled) again while
+ * it is still in the table.
+ *
+ * @return true if block_ptr had a sample.
+ */
+inline bool profile_take(std::byte* block_ptr, ProfileSample* sample) {
+  if constexpr (PROFILE) {
+    // pairs with the release in record_sample, which comes after the table
+    // was mapped
+    if (profile_state.load(std::memory_order_acquire) &
+        (PROFILE_SAMPLED | PROFILE_DUMP)) {
+      return profile_drop(block_ptr, sample);
+    }
+  }
+  return false;
+}
+
+/*
+ * Drop the sample of block_ptr, if there is one, see profile_take.
+ */
+inline void profile_free(std::byte* block_ptr) {
+  profile_take(block_ptr, nullptr);
+}
+
+/*
+ * Put a sample taken by profile_take back, for a block that stayed where it
+ * was. Must be called outside of any arena lock.
+ */
+void profile_restore(std::byte* block_ptr, const ProfileSample& sample);
+
+/*
+ * Drop all samples. Must not race with any other call.
+ */
+void profile_reset();
+
+#endif
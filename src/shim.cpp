@@ -0,0 +1,246 @@
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "mm.h"
+
+/*
+ * Interposition shim: malloc, free and friends plus the C++ operator new and
+ * operator delete family on top of the allocator, so that it can replace the
+ * system allocator of an unmodified binary:
+ *
+ *   LD_PRELOAD=libmmshim.so ./binary
+ *
+ * The shim is linked together with the allocator into its own library, which
+ * is built without AddressSanitizer (that would interpose malloc as well).
+ *
+ * Bootstrapping: the dynamic loader and libc call malloc before any
+ * constructor of this library has run, and the allocator's first calls in a
+ * thread allocate themselves (registering the destructors of its thread
+ * locals goes through calloc). Neither needs special handling: the
+ * allocator's globals are constant initialized, arenas initialize themselves
+ * on first use without allocating, and a recursive call only ever finds
+ * thread locals that are already set up. The profiler does not sample
+ * allocations made while it records a sample.
+ *
+ * malloc(0) returns a unique pointer, as glibc's does.
+ *
+ * The library is built with -fvisibility=hidden; the functions below are
+ * exported explicitly, since interposing them is the point of the shim.
+ */
+
+// forward declarations
+static void* new_block(std::size_t size, std::size_t alignment, bool nothrow);
+
+#pragma GCC visibility push(default)
+
+extern "C" {
+
+void* malloc(std::size_t size) {
+  void* ptr = mm_malloc(size > 0 ? size : 1);
+  if (ptr == nullptr) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+void free(void* ptr) { mm_free(static_cast<std::byte*>(ptr)); }
+
+void* calloc(std::size_t count, std::size_t size) {
+  if (count == 0 || size == 0) {
+    count = size = 1;
+  }
+  void* ptr = mm_calloc(count, size);
+  if (ptr == nullptr) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+void* realloc(void* ptr, std::size_t size) {
+  if (ptr == nullptr) {
+    return malloc(size);
+  }
+  void* new_ptr = mm_realloc(static_cast<std::byte*>(ptr), size);
+  if (new_ptr == nullptr && size > 0) {
+    errno = ENOMEM;
+  }
+  return new_ptr;
+}
+
+void* reallocarray(void* ptr, std::size_t count, std::size_t size) {
+  std::size_t total;
+  if (__builtin_mul_overflow(count, size, &total)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  return realloc(ptr, total);
+}
+
+int posix_memalign(void** ptr, std::size_t alignment, std::size_t size) {
+  if (alignment % sizeof(void*) != 0 ||
+      (alignment & (alignment - 1)) != 0 || alignment == 0) {
+    return EINVAL;
+  }
+  void* block = mm_memalign(alignment, size > 0 ? size : 1);
+  if (block == nullptr) {
+    return ENOMEM;
+  }
+  *ptr = block;
+  return 0;
+}
+
+void* memalign(std::size_t alignment, std::size_t size) {
+  void* ptr = mm_memalign(alignment, size > 0 ? size : 1);
+  if (ptr == nullptr && errno != EINVAL) {
+    errno = ENOMEM;
+  }
+  return ptr;
+}
+
+/* like glibc, any size is accepted and not only multiples of alignment */
+void* aligned_alloc(std::size_t alignment, std::size_t size) {
+  return memalign(alignment, size);
+}
+
+void* valloc(std::size_t size) {
+  return memalign(static_cast<std::size_t>(sysconf(_SC_PAGESIZE)), size);
+}
+
+void* pvalloc(std::size_t size) {
+  std::size_t page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+std::size_t malloc_usable_size(void* ptr) {
+  return mm_usable_size(static_cast<std::byte*>(ptr));
+}
+
+int malloc_trim(std::size_t) { return mm_trim(); }
+
+}  // extern "C"
+
+void* operator new(std::size_t size) { return new_block(size, 0, false); }
+
+void* operator new[](std::size_t size) { return new_block(size, 0, false); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return new_block(size, 0, true);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return new_block(size, 0, true);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return new_block(size, static_cast<std::size_t>(alignment), false);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+  return new_block(size, static_cast<std::size_t>(alignment), false);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+  return new_block(size, static_cast<std::size_t>(alignment), true);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+  return new_block(size, static_cast<std::size_t>(alignment), true);
+}
+
+void operator delete(void* ptr) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+void operator delete[](void* ptr) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept {
+  mm_free_sized(static_cast<std::byte*>(ptr), size);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept {
+  mm_free_sized(static_cast<std::byte*>(ptr), size);
+}
+
+/*
+ * Aligned blocks are freed without their size: it is the size of the object,
+ * not of the block that was allocated for it.
+ */
+void operator delete(void* ptr, std::align_val_t) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+void operator delete(void* ptr, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+void operator delete[](void* ptr, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+  mm_free(static_cast<std::byte*>(ptr));
+}
+
+#pragma GCC visibility pop
+
+/*
+ * Allocate a block for operator new. Out of memory, the new handler is called
+ * until it either makes an allocation succeed or there is none left.
+ *
+ * @param alignment alignment of the block, 0 for the default alignment.
+ * @param nothrow return nullptr instead of throwing std::bad_alloc.
+ */
+static void* new_block(std::size_t size, std::size_t alignment, bool nothrow) {
+  if (size == 0) {
+    size = 1;
+  }
+  for (;;) {
+    void* ptr =
+        alignment > 0 ? mm_memalign(alignment, size) : mm_malloc(size);
+    if (ptr != nullptr) {
+      return ptr;
+    }
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) {
+      if (nothrow) {
+        return nullptr;
+      }
+      throw std::bad_alloc();
+    }
+    if (!nothrow) {
+      handler();
+      continue;
+    }
+    try {
+      handler();
+    } catch (const std::bad_alloc&) {
+      return nullptr;
+    }
+  }
+}
@@ -0,0 +1,234 @@
+#include "slab.h"
+
+#include <fmt/format.h>
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#include "block.h"
+#include "memlib.h"
+
+/*
+ * This file implements the slab runs of an arena, see slab.h.
+ */
+
+// forward declarations
+static SlabRun* get_run(std::byte* slot_ptr);
+static std::byte* get_slot_ptr(SlabRun* run, std::size_t index);
+static std::size_t get_num_slots(std::size_t slot_size);
+static SlabRun* new_run(SlabHeap* slabs, std::size_t slot_size);
+static void push_run(SlabRun** list, SlabRun* run);
+static void unlink_run(SlabRun** list, SlabRun* run);
+
+int slab_init(SlabHeap* slabs) {
+  *slabs = SlabHeap{};
+  return mem_init(&slabs->region);
+}
+
+/*
+ * Allocate a slot from the first run with a free slot of this size.
+ */
+std::byte* slab_malloc(SlabHeap* slabs, std::size_t slot_size) {
+  std::size_t slab_class = slot_size / DOUBLE_SIZE - 1;
+  SlabRun* run = slabs->partial_runs[slab_class];
+
+  if (run == nullptr) {
+    if ((run = new_run(slabs, slot_size)) == nullptr) {
+      return nullptr;
+    }
+    push_run(&slabs->partial_runs[slab_class], run);
+  }
+
+  std::size_t word = 0;
+  while (run->free_bitmap[word] == 0) {
+    ++word;
+  }
+  std::size_t bit = std::countr_zero(run->free_bitmap[word]);
+  run->free_bitmap[word] &= ~(uint64_t{1} << bit);
+
+  if (--run->free_slots == 0) {
+    unlink_run(&slabs->partial_runs[slab_class], run);
+  }
+  return get_slot_ptr(run, word * 64 + bit);
+}
+
+/*
+ * Return a slot to its run. A run that becomes empty is given to the empty
+ * runs unless it is the only run with free slots of its size, which avoids
+ * taking a new run on the very next allocation.
+ */
+void slab_free(SlabHeap* slabs, std::byte* slot_ptr) {
+  SlabRun* run = get_run(slot_ptr);
+  std::size_t slab_class = run->slot_size / DOUBLE_SIZE - 1;
+  std::size_t index =
+      static_cast<std::size_t>(slot_ptr - get_slot_ptr(run, 0)) /
+      run->slot_size;
+
+  run->free_bitmap[index / 64] |= uint64_t{1} << (index % 64);
+
+  if (run->free_slots++ == 0) {
+    push_run(&slabs->partial_runs[slab_class], run);
+  }
+  if (run->free_slots == get_num_slots(run->slot_size) &&
+      (run->next != nullptr || run->prev != nullptr)) {
+    unlink_run(&slabs->partial_runs[slab_class], run);
+    push_run(&slabs->empty_runs, run);
+  }
+}
+
+std::size_t slab_get_slot_size(std::byte* slot_ptr) {
+  return get_run(slot_ptr)->slot_size;
+}
+
+/*
+ * Checks every run: the slot size, the count of free slots against the
+ * bitmap, and that runs are in the right list.
+ */
+bool slab_checkheap(SlabHeap* slabs, int verbose) {
+  std::size_t listed_runs = 0;
+  bool ok = true;
+
+  for (std::size_t slab_class = 0; slab_class < NUM_SLAB_CLASSES;
+       ++slab_class) {
+    for (SlabRun* run = slabs->partial_runs[slab_class]; run != nullptr;
+         run = run->next) {
+      if (run->slot_size != (slab_class + 1) * DOUBLE_SIZE ||
+          run->free_slots == 0) {
+        fmt::print("Error: run {} is in the wrong list\n", fmt::ptr(run));
+        ok = false;
+      }
+      ++listed_runs;
+    }
+  }
+
+  std::byte* run_ptr = slabs->region.heap_start;
+  for (; run_ptr != nullptr && run_ptr < slabs->region.heap_brk;
+       run_ptr += SLAB_RUN_SIZE) {
+    SlabRun* run = reinterpret_cast<SlabRun*>(run_ptr);
+    std::size_t num_slots = get_num_slots(run->slot_size);
+    std::size_t free_slots = 0;
+
+    for (std::size_t word = 0; word < SLAB_BITMAP_WORDS; ++word) {
+      free_slots += std::popcount(run->free_bitmap[word]);
+    }
+    if (verbose) {
+      fmt::print("{}: run of {} byte slots, {}/{} free\n", fmt::ptr(run),
+                 run->slot_size, run->free_slots, num_slots);
+    }
+    if (free_slots != run->free_slots || free_slots > num_slots) {
+      fmt::print("Error: free slot count of run {} does not match bitmap\n",
+                 fmt::ptr(run));
+      ok = false;
+    }
+  }
+
+  std::size_t empty_runs = 0;
+  for (SlabRun* run = slabs->empty_runs; run != nullptr; run = run->next) {
+    if (run->free_slots != get_num_slots(run->slot_size)) {
+      fmt::print("Error: run {} is in use but listed as empty\n",
+                 fmt::ptr(run));
+      ok = false;
+    }
+    ++empty_runs;
+  }
+  listed_runs += empty_runs;
+
+  std::size_t total_runs = static_cast<std::size_t>(
+                               slabs->region.heap_brk -
+                               slabs->region.heap_start) /
+                           SLAB_RUN_SIZE;
+  if (listed_runs > total_runs) {
+    fmt::print("Error: more runs listed than there are runs\n");
+    ok = false;
+  }
+  return ok;
+}
+
+void slab_teardown(SlabHeap* slabs) {
+  mem_teardown(&slabs->region);
+  *slabs = SlabHeap{};
+}
+
+/*
+ * Runs are aligned to SLAB_RUN_SIZE.
+ */
+static SlabRun* get_run(std::byte* slot_ptr) {
+  return reinterpret_cast<SlabRun*>(reinterpret_cast<std::uintptr_t>(slot_ptr) &
+                                    ~(SLAB_RUN_SIZE - 1));
+}
+
+static std::byte* get_slot_ptr(SlabRun* run, std::size_t index) {
+  return reinterpret_cast<std::byte*>(run) + SLAB_RUN_HEADER_SIZE +
+         index * run->slot_size;
+}
+
+static std::size_t get_num_slots(std::size_t slot_size) {
+  return (SLAB_RUN_SIZE - SLAB_RUN_HEADER_SIZE) / slot_size;
+}
+
+/*
+ * Get a run for slot_size: an empty run if there is one, otherwise a new one
+ * from the slab region.
+ *
+ * @return pointer to the run with all slots free or nullptr if the region is
+ * out of memory.
+ */
+static SlabRun* new_run(SlabHeap* slabs, std::size_t slot_size) {
+  SlabRun* run = slabs->empty_runs;
+
+  if (run != nullptr) {
+    unlink_run(&slabs->empty_runs, run);
+  } else {
+    std::byte* run_ptr = mem_sbrk(&slabs->region, SLAB_RUN_SIZE);
+    if (run_ptr == nullptr) {
+      return nullptr;
+    }
+    run = reinterpret_cast<SlabRun*>(run_ptr);
+  }
+
+  std::size_t num_slots = get_num_slots(slot_size);
+  run->next = nullptr;
+  run->prev = nullptr;
+  run->slot_size = static_cast<uint32_t>(slot_size);
+  run->free_slots = static_cast<uint32_t>(num_slots);
+  for (std::size_t word = 0; word < SLAB_BITMAP_WORDS; ++word) {
+    std::size_t first_slot = word * 64;
+    if (num_slots >= first_slot + 64) {
+      run->free_bitmap[word] = ~uint64_t{0};
+    } else if (num_slots > first_slot) {
+      run->free_bitmap[word] = (uint64_t{1} << (num_slots - first_slot)) - 1;
+    } else {
+      run->free_bitmap[word] = 0;
+    }
+  }
+  return run;
+}
+
+/*
+ * Insert a run at the head of a list.
+ */
+static void push_run(SlabRun** list, SlabRun* run) {
+  run->prev = nullptr;
+  run->next = *list;
+  if (*list != nullptr) {
+    (*list)->prev = run;
+  }
+  *list = run;
+}
+
+/*
+ * Remove a run from a list.
+ */
+static void unlink_run(SlabRun** list, SlabRun* run) {
+  if (run->prev != nullptr) {
+    run->prev->next = run->next;
+  } else {
+    *list = run->next;
+  }
+  if (run->next != nullptr) {
+    run->next->prev = run->prev;
+  }
+  run->next = nullptr;
+  run->prev = nullptr;
+}
@@ -0,0 +1,112 @@
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "block.h"
+#include "memlib.h"
+
+/*
+ * Slabs: requests of at most SLAB_MAX_SIZE bytes are not worth a heap block
+ * (MIN_BLOCK_SIZE bytes with header, footer and free list links). They are
+ * served from runs of SLAB_RUN_SIZE bytes carved out of a memory region of
+ * their own. Each run is split into equal slots of one slot size (a multiple
+ * of DOUBLE_SIZE) and starts with a SlabRun that records which slots are
+ * free in a bitmap. Runs are aligned to SLAB_RUN_SIZE so the run of a slot is
+ * found by masking the slot's address; slots have no header at all.
+ *
+ * Runs with free slots are kept in one list per slot size. A run that becomes
+ * empty is moved to a list of empty runs that any slot size can reuse.
+ */
+/* up to two slot sizes, all below the smallest heap block */
+constexpr std::size_t SLAB_MAX_SIZE =
+    MIN_BLOCK_SIZE - DOUBLE_SIZE < 2 * DOUBLE_SIZE
+        ? MIN_BLOCK_SIZE - DOUBLE_SIZE
+        : 2 * DOUBLE_SIZE;
+constexpr std::size_t NUM_SLAB_CLASSES = SLAB_MAX_SIZE / DOUBLE_SIZE;
+constexpr std::size_t SLAB_RUN_SIZE = 1 << 12; /* 4 KB */
+constexpr std::size_t SLAB_BITMAP_WORDS =
+    SLAB_RUN_SIZE / DOUBLE_SIZE / 64; /* enough bits for the smallest slots */
+static_assert(SLAB_MAX_SIZE < MIN_BLOCK_SIZE,
+              "slot sizes and heap block sizes must not overlap");
+
+struct SlabRun {
+  SlabRun* next; /* runs of the same list */
+  SlabRun* prev;
+  uint32_t slot_size;
+  uint32_t free_slots;
+  uint64_t free_bitmap[SLAB_BITMAP_WORDS]; /* bit i is set iff slot i is free */
+};
+/* slots start right after the run metadata, rounded to 2 * DOUBLE_SIZE */
+constexpr std::size_t SLAB_RUN_HEADER_SIZE =
+    (sizeof(SlabRun) + 2 * DOUBLE_SIZE - 1) & ~(2 * DOUBLE_SIZE - 1);
+
+/*
+ * The slabs of one arena. Like the arena itself they are not synchronized;
+ * callers hold the arena's mutex.
+ */
+struct SlabHeap {
+  MemRegion region;
+  SlabRun* partial_runs[NUM_SLAB_CLASSES] = {}; /* runs with free slots */
+  SlabRun* empty_runs = nullptr;                /* runs without used slots */
+};
+
+/*
+ * Slot size used for a request of size bytes.
+ *
+ * @param size number of bytes requested, at most SLAB_MAX_SIZE.
+ */
+constexpr std::size_t slab_slot_size(std::size_t size) {
+  return (size + DOUBLE_SIZE - 1) & ~(DOUBLE_SIZE - 1);
+}
+
+/*
+ * Does slot_ptr point into the slab region?
+ */
+inline bool slab_contains(const SlabHeap* slabs, const std::byte* slot_ptr) {
+  return slot_ptr >= slabs->region.heap_start &&
+         slot_ptr < slabs->region.heap_max_addr;
+}
+
+/*
+ * Set up the slab region.
+ *
+ * @return 0 on success, -1 if the region could not be reserved.
+ */
+int slab_init(SlabHeap* slabs);
+
+/*
+ * Allocate a slot.
+ *
+ * @param slot_size slot size as returned by slab_slot_size.
+ * @return pointer to the slot or nullptr if the region is out of memory.
+ */
+std::byte* slab_malloc(SlabHeap* slabs, std::size_t slot_size);
+
+/*
+ * Return a slot to its run.
+ *
+ * @param slot_ptr pointer to an allocated slot of this slab heap.
+ */
+void slab_free(SlabHeap* slabs, std::byte* slot_ptr);
+
+/*
+ * Size of the slot slot_ptr points to.
+ */
+std::size_t slab_get_slot_size(std::byte* slot_ptr);
+
+/*
+ * Checks the runs and their bitmaps for correctness.
+ *
+ * @param verbose Prints every run if verbose is not equal to 0.
+ * @return false (after printing an error) if a run is corrupted.
+ */
+bool slab_checkheap(SlabHeap* slabs, int verbose);
+
+/*
+ * Release the slab region. This invalidates all slots handed out.
+ */
+void slab_teardown(SlabHeap* slabs);
+
+#endif
@@ -0,0 +1,142 @@
+#include "stats.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/*
+ * This file implements the per-thread counters, see stats.h. The counters of
+ * a thread are registered in a list on its first call; when the thread exits
+ * they are added to retired and unregistered.
+ */
+
+struct ThreadStats {
+  std::atomic<uint64_t> allocs{0};
+  std::atomic<uint64_t> frees{0};
+  std::atomic<uint64_t> reallocs{0};
+  /* may go negative: blocks are freed by other threads too */
+  std::atomic<int64_t> bytes_in_use{0};
+  std::atomic<uint64_t> allocs_by_class[MM_STATS_NUM_CLASSES] = {};
+  ThreadStats* prev = nullptr; /* list of all live threads */
+  ThreadStats* next = nullptr;
+
+  ThreadStats();
+  ~ThreadStats();
+};
+
+static std::mutex stats_mutex;
+static ThreadStats* thread_stats = nullptr; /* head of the list */
+static MmStats retired{};                   /* counters of exited threads */
+static int64_t retired_bytes_in_use = 0;
+
+static thread_local ThreadStats tstats;
+
+// forward declarations
+template <typename T>
+static void add(std::atomic<T>* counter, T value);
+static void add_thread(const ThreadStats& thread, MmStats* stats,
+                       int64_t* bytes_in_use);
+
+void stats_alloc(std::size_t size, std::size_t bytes, std::size_t count) {
+  if constexpr (STATS) {
+    add(&tstats.allocs, uint64_t{count});
+    add(&tstats.bytes_in_use, static_cast<int64_t>(bytes));
+    add(&tstats.allocs_by_class[stats_class(size)], uint64_t{count});
+  }
+}
+
+void stats_free(std::size_t bytes, std::size_t count) {
+  if constexpr (STATS) {
+    add(&tstats.frees, uint64_t{count});
+    add(&tstats.bytes_in_use, -static_cast<int64_t>(bytes));
+  }
+}
+
+void stats_realloc(std::size_t old_bytes, std::size_t new_bytes) {
+  if constexpr (STATS) {
+    add(&tstats.reallocs, uint64_t{1});
+    add(&tstats.bytes_in_use, static_cast<int64_t>(new_bytes) -
+                                  static_cast<int64_t>(old_bytes));
+  }
+}
+
+void stats_collect(MmStats* stats) {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  int64_t bytes_in_use = retired_bytes_in_use;
+
+  stats->allocs += retired.allocs;
+  stats->frees += retired.frees;
+  stats->reallocs += retired.reallocs;
+  for (std::size_t i = 0; i < MM_STATS_NUM_CLASSES; ++i) {
+    stats->allocs_by_class[i] += retired.allocs_by_class[i];
+  }
+  for (ThreadStats* thread = thread_stats; thread != nullptr;
+       thread = thread->next) {
+    add_thread(*thread, stats, &bytes_in_use);
+  }
+  stats->bytes_in_use += bytes_in_use > 0 ? bytes_in_use : 0;
+}
+
+void stats_reset() {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  retired = MmStats{};
+  retired_bytes_in_use = 0;
+  for (ThreadStats* thread = thread_stats; thread != nullptr;
+       thread = thread->next) {
+    thread->allocs.store(0, std::memory_order_relaxed);
+    thread->frees.store(0, std::memory_order_relaxed);
+    thread->reallocs.store(0, std::memory_order_relaxed);
+    thread->bytes_in_use.store(0, std::memory_order_relaxed);
+    for (std::atomic<uint64_t>& count : thread->allocs_by_class) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+ThreadStats::ThreadStats() {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  next = thread_stats;
+  if (thread_stats != nullptr) {
+    thread_stats->prev = this;
+  }
+  thread_stats = this;
+}
+
+ThreadStats::~ThreadStats() {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  add_thread(*this, &retired, &retired_bytes_in_use);
+  if (prev != nullptr) {
+    prev->next = next;
+  } else {
+    thread_stats = next;
+  }
+  if (next != nullptr) {
+    next->prev = prev;
+  }
+}
+
+/*
+ * Add value to a counter that only the calling thread writes. A plain load
+ * and store is enough and avoids a locked read-modify-write.
+ */
+template <typename T>
+static void add(std::atomic<T>* counter, T value) {
+  counter->store(counter->load(std::memory_order_relaxed) + value,
+                 std::memory_order_relaxed);
+}
+
+/*
+ * Add the counters of one thread to stats. Callers hold stats_mutex.
+ */
+static void add_thread(const ThreadStats& thread, MmStats* stats,
+                       int64_t* bytes_in_use) {
+  stats->allocs += thread.allocs.load(std::memory_order_relaxed);
+  stats->frees += thread.frees.load(std::memory_order_relaxed);
+  stats->reallocs += thread.reallocs.load(std::memory_order_relaxed);
+  *bytes_in_use += thread.bytes_in_use.load(std::memory_order_relaxed);
+  for (std::size_t i = 0; i < MM_STATS_NUM_CLASSES; ++i) {
+    stats->allocs_by_class[i] +=
+        thread.allocs_by_class[i].load(std::memory_order_relaxed);
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <bit>
+#include <cstddef>
+
+#include "mm.h"
+
+/*
+ * Per-thread call counters behind mm_stats. Every thread counts its own
+ * allocations and frees without any synchronization beyond relaxed atomics
+ * (each counter has a single writer); stats_collect adds up the counters of
+ * all live threads plus those of threads that have exited.
+ *
+ * Counting is chosen at build time with -DMM_STATS=<0|1>.
+ */
+#ifndef MM_STATS
+#define MM_STATS 1
+#endif
+constexpr bool STATS = MM_STATS;
+
+/*
+ * Size class of size bytes, see MmStats.
+ */
+inline std::size_t stats_class(std::size_t size) {
+  std::size_t size_class = size > 0 ? std::bit_width(size - 1) : 0;
+  return size_class < MM_STATS_NUM_CLASSES ? size_class
+                                           : MM_STATS_NUM_CLASSES - 1;
+}
+
+/*
+ * Count count allocations of size bytes that got blocks of bytes bytes in
+ * total.
+ */
+void stats_alloc(std::size_t size, std::size_t bytes, std::size_t count);
+
+/*
+ * Count count frees of blocks of bytes bytes in total.
+ */
+void stats_free(std::size_t bytes, std::size_t count);
+
+/*
+ * Count a resize of a block from old_bytes to new_bytes bytes.
+ */
+void stats_realloc(std::size_t old_bytes, std::size_t new_bytes);
+
+/*
+ * Add the counters of all threads to stats.
+ */
+void stats_collect(MmStats* stats);
+
+/*
+ * Zero the counters of all threads. Must not race with any other call.
+ */
+void stats_reset();
+
+#endif
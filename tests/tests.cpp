@@ -1,10 +1,134 @@
 #define CATCH_CONFIG_MAIN
 #include <fmt/format.h>
 
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <catch2/catch.hpp>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory_resource>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
+#include "heap.h"
 #include "mm.h"
 
+/* alignment the allocator was built with, see -DMM_ALIGNMENT */
+#ifndef MM_ALIGNMENT
+#define MM_ALIGNMENT 16
+#endif
+#ifndef MM_STATS
+#define MM_STATS 1
+#endif
+#ifndef MM_PROFILE
+#define MM_PROFILE 1
+#endif
+#ifndef MM_HUGEPAGES
+#define MM_HUGEPAGES 0
+#endif
+#ifndef MM_NUMA
+#define MM_NUMA 0
+#endif
+#ifndef MM_MADV_FREE
+#define MM_MADV_FREE 0
+#endif
+
+/*
+ * First line of a file.
+ */
+static std::string first_line(const char* path) {
+  std::ifstream file(path);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+/*
+ * Everything printed to stdout while running fn.
+ */
+template <typename F>
+static std::string stdout_of(F fn) {
+  std::fflush(stdout);
+  std::FILE* capture = std::tmpfile();
+  int saved = dup(STDOUT_FILENO);
+  dup2(fileno(capture), STDOUT_FILENO);
+  fn();
+  std::fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+
+  std::string output;
+  std::rewind(capture);
+  for (int c = std::fgetc(capture); c != EOF; c = std::fgetc(capture)) {
+    output += static_cast<char>(c);
+  }
+  std::fclose(capture);
+  return output;
+}
+
+/*
+ * Resident set size of the process in bytes.
+ */
+static std::size_t resident_bytes() {
+  std::size_t total = 0;
+  std::size_t resident = 0;
+  std::FILE* statm = std::fopen("/proc/self/statm", "r");
+  if (statm != nullptr) {
+    if (std::fscanf(statm, "%zu %zu", &total, &resident) != 2) {
+      resident = 0;
+    }
+    std::fclose(statm);
+  }
+  return resident * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+/*
+ * Value of a field of the mapping that contains addr in /proc/self/smaps, -1
+ * if there is no such mapping or field.
+ */
+static long smaps_field(const std::byte* addr, const std::string& field) {
+  std::ifstream smaps("/proc/self/smaps");
+  std::uintptr_t target = reinterpret_cast<std::uintptr_t>(addr);
+  bool inside = false;
+  std::string line;
+  while (std::getline(smaps, line)) {
+    unsigned long start;
+    unsigned long end;
+    if (std::sscanf(line.c_str(), "%lx-%lx ", &start, &end) == 2) {
+      inside = start <= target && target < end;
+    } else if (inside && line.compare(0, field.size(), field) == 0) {
+      return std::stol(line.substr(field.size() + 1));
+    }
+  }
+  return -1;
+}
+
+/*
+ * Allocate count blocks of size bytes and touch all their pages.
+ */
+static std::vector<std::byte*> allocate_touched(int count, std::size_t size) {
+  std::vector<std::byte*> blocks;
+  for (int i = 0; i < count; ++i) {
+    std::byte* block = mm_malloc(size);
+    REQUIRE(block != nullptr);
+    for (std::size_t offset = 0; offset < size; offset += 4096) {
+      block[offset] = std::byte{1};
+    }
+    blocks.push_back(block);
+  }
+  return blocks;
+}
+
 TEST_CASE("Can Allocate Memory", "[allocate]") {
   mm_init();
 
@@ -35,7 +159,7 @@ TEST_CASE("Realloc works", "[realloc]") {
   std::byte* ptr = mm_malloc(20);
   int put_val = 20;
   *reinterpret_cast<int*>(ptr) = put_val;
-  mm_realloc(ptr, 30);
+  ptr = mm_realloc(ptr, 30);
   int read_val = *reinterpret_cast<int*>(ptr);
 
   REQUIRE(read_val == put_val);
@@ -43,3 +167,1225 @@ TEST_CASE("Realloc works", "[realloc]") {
   mm_free(ptr);
   mm_teardown();
 }
+
+TEST_CASE("Freed blocks are reused", "[free_list]") {
+  mm_init();
+
+  std::byte* first = mm_malloc(64);
+  std::byte* guard = mm_malloc(64);
+  mm_free(first);
+  std::byte* second = mm_malloc(64);
+  REQUIRE(second == first);
+
+  mm_free(second);
+  mm_free(guard);
+  mm_teardown();
+}
+
+TEST_CASE("Interleaved allocations keep their contents", "[free_list]") {
+  mm_init();
+
+  constexpr int num_blocks = 256;
+  std::byte* blocks[num_blocks];
+  for (int i = 0; i < num_blocks; ++i) {
+    blocks[i] = mm_malloc(16 + (i % 7) * 24);
+    REQUIRE(blocks[i] != nullptr);
+    *reinterpret_cast<int*>(blocks[i]) = i;
+  }
+  // free every other block so that the free list holds fragmented blocks
+  for (int i = 0; i < num_blocks; i += 2) {
+    mm_free(blocks[i]);
+  }
+  for (int i = 0; i < num_blocks; i += 2) {
+    blocks[i] = mm_malloc(16 + (i % 5) * 24);
+    REQUIRE(blocks[i] != nullptr);
+    *reinterpret_cast<int*>(blocks[i]) = i;
+  }
+  for (int i = 0; i < num_blocks; ++i) {
+    REQUIRE(*reinterpret_cast<int*>(blocks[i]) == i);
+    mm_free(blocks[i]);
+  }
+  mm_teardown();
+}
+
+TEST_CASE("Small requests are served from their own size class",
+          "[size_classes]") {
+  mm_init();
+
+  // sizes above the thread cache limit so that the free lists are used
+  std::byte* small = mm_malloc(300);
+  std::byte* guard1 = mm_malloc(300);
+  std::byte* large = mm_malloc(3000);
+  std::byte* guard2 = mm_malloc(300);
+  mm_free(small);
+  mm_free(large);
+
+  // with a single LIFO list the 3000 byte block would be found first
+  std::byte* reused = mm_malloc(300);
+  REQUIRE(reused == small);
+
+  mm_free(reused);
+  mm_free(guard1);
+  mm_free(guard2);
+  mm_teardown();
+}
+
+TEST_CASE("Realloc grows into a free successor in place", "[realloc]") {
+  mm_init();
+
+  std::byte* ptr = mm_malloc(320);
+  std::byte* next = mm_malloc(640);
+  std::byte* guard = mm_malloc(320);
+  *reinterpret_cast<int*>(ptr) = 42;
+  mm_free(next);
+
+  std::byte* grown = mm_realloc(ptr, 800);
+  REQUIRE(grown == ptr);
+  REQUIRE(*reinterpret_cast<int*>(grown) == 42);
+
+  mm_free(grown);
+  mm_free(guard);
+  mm_teardown();
+}
+
+TEST_CASE("Realloc shrinks in place and frees the tail", "[realloc]") {
+  mm_init();
+
+  std::byte* ptr = mm_malloc(1024);
+  std::byte* guard = mm_malloc(320);
+  std::byte* shrunk = mm_realloc(ptr, 16);
+  REQUIRE(shrunk == ptr);
+
+  // the split off tail is handed out again
+  std::byte* tail = mm_malloc(512);
+  REQUIRE(tail > shrunk);
+  REQUIRE(tail < guard);
+
+  mm_free(tail);
+  mm_free(shrunk);
+  mm_free(guard);
+  mm_teardown();
+}
+
+TEST_CASE("Realloc grows the last block by extending the heap", "[realloc]") {
+  mm_init();
+
+  // use up the initial chunk so that ptr ends up at the top of the heap
+  std::byte* ptr = mm_malloc(4000);
+  std::byte* grown = ptr;
+  for (std::size_t size = 8000; size <= 64000; size += 8000) {
+    grown = mm_realloc(grown, size);
+    REQUIRE(grown == ptr);
+  }
+
+  mm_free(grown);
+  mm_teardown();
+}
+
+TEST_CASE("Threads can allocate and free concurrently", "[threads]") {
+  mm_init();
+
+  auto worker = [](int id) {
+    std::vector<std::byte*> blocks(512, nullptr);
+    for (int round = 0; round < 20; ++round) {
+      for (std::size_t i = 0; i < blocks.size(); ++i) {
+        blocks[i] = mm_malloc(8 + (i % 40) * 8 + (i % 3) * 200);
+        REQUIRE(blocks[i] != nullptr);
+        *reinterpret_cast<int*>(blocks[i]) = id;
+      }
+      for (std::byte* block : blocks) {
+        REQUIRE(*reinterpret_cast<int*>(block) == id);
+        mm_free(block);
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int id = 0; id < 4; ++id) {
+    threads.emplace_back(worker, id);
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  mm_teardown();
+}
+
+TEST_CASE("Blocks can be freed by a different thread", "[threads]") {
+  mm_init();
+
+  std::vector<std::byte*> blocks;
+  std::thread producer([&blocks] {
+    for (int i = 0; i < 2000; ++i) {
+      blocks.push_back(mm_malloc(16 + (i % 50) * 16));
+      REQUIRE(blocks.back() != nullptr);
+    }
+  });
+  producer.join();
+
+  std::thread consumer([&blocks] {
+    for (std::byte* block : blocks) {
+      mm_free(block);
+    }
+  });
+  consumer.join();
+
+  // a thread that only frees never sets up an arena of its own
+  std::byte* ptr = mm_malloc(64);
+  REQUIRE(ptr != nullptr);
+  std::size_t heap_size = mm_stats().heap_size;
+  std::thread([ptr] { mm_free(ptr); }).join();
+  REQUIRE(mm_stats().heap_size == heap_size);
+  mm_teardown();
+}
+
+TEST_CASE("Blocks freed by other threads are reused by their arena",
+          "[threads]") {
+  mm_init();
+
+  // blocks too large for the thread cache, freed by four threads at once
+  // while the owner keeps allocating
+  bool all_allocated = true;
+  std::size_t grown = 0;
+  std::thread owner([&all_allocated, &grown] {
+    std::vector<std::byte*> blocks(4000);
+    for (std::byte*& block : blocks) {
+      block = mm_malloc(512);
+      all_allocated = all_allocated && block != nullptr;
+    }
+    std::size_t heap_size = mm_stats().heap_size;
+
+    std::vector<std::thread> freers;
+    for (std::size_t id = 0; id < 4; ++id) {
+      freers.emplace_back([&blocks, id] {
+        for (std::size_t i = id; i < blocks.size(); i += 4) {
+          mm_free(blocks[i]);
+        }
+      });
+    }
+    std::vector<std::byte*> more;
+    for (int i = 0; i < 100; ++i) {
+      more.push_back(mm_malloc(512));
+    }
+    for (std::thread& freer : freers) {
+      freer.join();
+    }
+    for (std::byte*& block : blocks) {
+      block = mm_malloc(512);
+      all_allocated = all_allocated && block != nullptr;
+    }
+    // the queued blocks made room for the second round
+    grown = mm_stats().heap_size - heap_size;
+    for (std::byte* block : blocks) {
+      mm_free(block);
+    }
+    for (std::byte* block : more) {
+      mm_free(block);
+    }
+  });
+  owner.join();
+
+  REQUIRE(all_allocated);
+  REQUIRE(grown <= 100 * 1024);
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("The heap grows past 20 MB", "[memlib]") {
+  mm_init();
+
+  // below the mmap threshold so that the blocks come from the heap
+  std::vector<std::byte*> blocks;
+  for (int i = 0; i < 256; ++i) {
+    std::byte* block = mm_malloc(100000);
+    REQUIRE(block != nullptr);
+    block[100000 - 1] = std::byte{1};
+    blocks.push_back(block);
+  }
+  for (std::byte* block : blocks) {
+    mm_free(block);
+  }
+  mm_teardown();
+}
+
+TEST_CASE("Freed memory is given back to the OS", "[memlib]") {
+  // below the mmap threshold so that the blocks come from the heap
+  constexpr std::size_t block_size = 1 << 16;
+  constexpr std::size_t released = 16 << 20;
+  mm_init();
+  // MADV_FREE pages stay resident until the system runs short of memory, so
+  // there only the heap shrinking can be seen
+  auto trimmed_since = [](std::size_t resident, std::size_t heap_size) {
+    return MM_MADV_FREE ? mm_stats().heap_size + released < heap_size
+                        : resident_bytes() + released < resident;
+  };
+
+  SECTION("Freeing the top of the heap trims it") {
+    std::vector<std::byte*> blocks = allocate_touched(512, block_size);
+    std::size_t before = resident_bytes();
+    std::size_t heap_size = mm_stats().heap_size;
+    for (std::byte* block : blocks) {
+      mm_free(block);
+    }
+    REQUIRE(trimmed_since(before, heap_size));
+  }
+
+  SECTION("mm_trim releases free blocks in the middle of the heap") {
+    std::vector<std::byte*> blocks = allocate_touched(512, block_size);
+    // keeps the freed blocks from reaching the top of the heap
+    std::byte* guard = mm_malloc(64);
+    REQUIRE(guard != nullptr);
+    std::size_t before = resident_bytes();
+    for (std::byte* block : blocks) {
+      mm_free(block);
+    }
+    REQUIRE(mm_trim() == 1);
+    if (!MM_MADV_FREE) {
+      REQUIRE(resident_bytes() + released < before);
+    }
+
+    // released memory can be used again
+    blocks = allocate_touched(512, block_size);
+    for (std::byte* block : blocks) {
+      mm_free(block);
+    }
+    mm_free(guard);
+  }
+
+  SECTION("Blocks of a thread that has exited are given back when freed") {
+    std::vector<std::byte*> blocks(512);
+    bool all_allocated = true;
+    std::thread([&blocks, &all_allocated] {
+      for (std::byte*& block : blocks) {
+        block = mm_malloc(block_size);
+        all_allocated = all_allocated && block != nullptr;
+        for (std::size_t offset = 0; block != nullptr && offset < block_size;
+             offset += 4096) {
+          block[offset] = std::byte{1};
+        }
+      }
+    }).join();
+    REQUIRE(all_allocated);
+
+    // the blocks' arena never allocates again
+    std::size_t before = resident_bytes();
+    std::size_t heap_size = mm_stats().heap_size;
+    for (std::byte* block : blocks) {
+      mm_free(block);
+    }
+    REQUIRE(trimmed_since(before, heap_size));
+  }
+
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("Heaps are backed by huge pages", "[hugepages]") {
+  constexpr std::uintptr_t huge_page = 1 << 21;
+  mm_init();
+
+  // the first block of a fresh heap is right at its start
+  std::byte* block = mm_malloc(3000);
+  REQUIRE(block != nullptr);
+  std::byte* other = mm_malloc(3000);
+  REQUIRE(other != nullptr);
+  if (MM_HUGEPAGES) {
+    REQUIRE(reinterpret_cast<std::uintptr_t>(block) % huge_page < 4096);
+    if (first_line("/sys/kernel/mm/transparent_hugepage/enabled")
+            .find("[never]") == std::string::npos) {
+      REQUIRE(smaps_field(block, "THPeligible") == 1);
+    }
+  }
+  REQUIRE(smaps_field(block, "Size") > 0);
+
+  mm_free(block);
+  mm_free(other);
+  mm_teardown();
+}
+
+TEST_CASE("Arenas prefer the NUMA node of their threads", "[numa]") {
+  mm_init();
+
+  // every thread's blocks come from an arena bound to its node
+  struct Placement {
+    bool allocated = false;
+    int mode = -1;      /* memory policy of the block, -1 if unknown */
+    int node = -1;      /* node of the block's page, -1 if unknown */
+    int cpu_node = -1;  /* node the thread ran on */
+  };
+  std::vector<Placement> placements(4);
+  std::vector<std::thread> threads;
+  for (Placement& placement : placements) {
+    threads.emplace_back([&placement] {
+      std::byte* block = mm_malloc(3000);
+      placement.allocated = block != nullptr;
+      if (block == nullptr) {
+        return;
+      }
+      block[0] = std::byte{1};
+      unsigned int cpu_node = 0;
+      if (getcpu(nullptr, &cpu_node) == 0) {
+        placement.cpu_node = static_cast<int>(cpu_node);
+      }
+      if (syscall(SYS_get_mempolicy, &placement.mode, nullptr, 0, block,
+                  MPOL_F_ADDR) != 0 ||
+          syscall(SYS_get_mempolicy, &placement.node, nullptr, 0, block,
+                  MPOL_F_ADDR | MPOL_F_NODE) != 0) {
+        placement.mode = placement.node = -1;
+      }
+      mm_free(block);
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (const Placement& placement : placements) {
+    REQUIRE(placement.allocated);
+    if (placement.mode >= 0) {  // the kernel has memory policies
+      REQUIRE(placement.mode == (MM_NUMA ? MPOL_PREFERRED : MPOL_DEFAULT));
+    }
+    if (MM_NUMA && placement.node >= 0 && placement.cpu_node >= 0) {
+      REQUIRE(placement.node == placement.cpu_node);
+    }
+  }
+
+  mm_teardown();
+}
+
+TEST_CASE("Huge blocks are mapped on their own", "[huge]") {
+  constexpr std::size_t huge_size = 1 << 20;
+  mm_init();
+
+  std::byte* ptr = mm_malloc(huge_size);
+  REQUIRE(ptr != nullptr);
+  for (std::size_t i = 0; i < huge_size; i += 1000) {
+    ptr[i] = static_cast<std::byte>(i / 1000);
+  }
+
+  SECTION("Freeing a huge block") { mm_free(ptr); }
+
+  SECTION("Remapping keeps the contents") {
+    ptr = mm_realloc(ptr, 8 * huge_size);
+    REQUIRE(ptr != nullptr);
+    ptr[8 * huge_size - 1] = std::byte{1};
+    ptr = mm_realloc(ptr, huge_size / 2);
+    REQUIRE(ptr != nullptr);
+    for (std::size_t i = 0; i < huge_size / 2; i += 1000) {
+      REQUIRE(ptr[i] == static_cast<std::byte>(i / 1000));
+    }
+    REQUIRE(mm_checkheap(0) == 0);
+    mm_free(ptr);
+  }
+
+  SECTION("Blocks move between the heap and their own mapping") {
+    ptr = mm_realloc(ptr, 3000);
+    REQUIRE(ptr != nullptr);
+    for (std::size_t i = 0; i < 3000; i += 1000) {
+      REQUIRE(ptr[i] == static_cast<std::byte>(i / 1000));
+    }
+    ptr = mm_realloc(ptr, 2 * huge_size);
+    REQUIRE(ptr != nullptr);
+    for (std::size_t i = 0; i < 3000; i += 1000) {
+      REQUIRE(ptr[i] == static_cast<std::byte>(i / 1000));
+    }
+    mm_free(ptr);
+  }
+
+  SECTION("Teardown unmaps huge blocks that are still allocated") {}
+
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("Allocated blocks can be filled up to their last byte", "[block]") {
+  mm_init();
+
+  // sizes around the header overhead and the rounding to DOUBLE_SIZE
+  std::vector<std::byte*> blocks;
+  std::vector<std::size_t> sizes;
+  for (std::size_t size = 1; size <= 300; ++size) {
+    std::byte* block = mm_malloc(size);
+    REQUIRE(block != nullptr);
+    std::memset(block, static_cast<int>(size), size);
+    blocks.push_back(block);
+    sizes.push_back(size);
+  }
+  // free every other block so the remaining ones sit next to free blocks
+  for (std::size_t i = 0; i < blocks.size(); i += 2) {
+    mm_free(blocks[i]);
+  }
+  for (std::size_t i = 1; i < blocks.size(); i += 2) {
+    for (std::size_t j = 0; j < sizes[i]; ++j) {
+      REQUIRE(blocks[i][j] == static_cast<std::byte>(sizes[i]));
+    }
+    mm_free(blocks[i]);
+  }
+
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("Tiny requests are packed into slab runs", "[slab]") {
+  mm_init();
+
+  std::vector<std::byte*> blocks;
+  for (int i = 0; i < 1000; ++i) {
+    std::byte* block = mm_malloc(8);
+    REQUIRE(block != nullptr);
+    std::memset(block, i % 256, 8);
+    blocks.push_back(block);
+  }
+  // slots of one alignment unit without any header, plus a little run
+  // metadata
+  auto [lowest, highest] = std::minmax_element(blocks.begin(), blocks.end());
+  REQUIRE(*highest - *lowest < 1000 * (MM_ALIGNMENT + 1));
+
+  for (int i = 0; i < 1000; ++i) {
+    for (int j = 0; j < 8; ++j) {
+      REQUIRE(blocks[i][j] == static_cast<std::byte>(i % 256));
+    }
+  }
+
+  SECTION("Slots are reused after being freed") {
+    for (std::byte* block : blocks) {
+      mm_free(block);
+    }
+    std::byte* ptr = mm_malloc(16);
+    REQUIRE(ptr != nullptr);
+    mm_free(ptr);
+  }
+
+  SECTION("Slots grow into heap blocks") {
+    std::byte* ptr = mm_realloc(blocks[10], 100);
+    REQUIRE(ptr != nullptr);
+    for (int j = 0; j < 8; ++j) {
+      REQUIRE(ptr[j] == static_cast<std::byte>(10));
+    }
+    mm_free(ptr);
+  }
+
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("Blocks can be allocated and freed in batches", "[batch]") {
+  mm_init();
+
+  for (std::size_t size : {8, 100, 3000}) {
+    std::byte* blocks[500];
+    REQUIRE(mm_malloc_batch(size, blocks, 500) == 500);
+    for (int i = 0; i < 500; ++i) {
+      std::memset(blocks[i], i % 256, size);
+    }
+    for (int i = 0; i < 500; ++i) {
+      for (std::size_t j = 0; j < size; ++j) {
+        REQUIRE(blocks[i][j] == static_cast<std::byte>(i % 256));
+      }
+    }
+    REQUIRE(mm_checkheap(0) == 0);
+
+    // a mix of batch and single frees, in no particular order
+    std::reverse(std::begin(blocks), std::end(blocks));
+    mm_free(blocks[0]);
+    blocks[0] = nullptr;
+    mm_free_batch(blocks, 500);
+    REQUIRE(mm_checkheap(0) == 0);
+  }
+
+  std::byte* ptr = mm_malloc(64);
+  REQUIRE(ptr != nullptr);
+  mm_free(ptr);
+  mm_teardown();
+}
+
+TEST_CASE("Usable size and sized free", "[size]") {
+  mm_init();
+
+  REQUIRE(mm_usable_size(nullptr) == 0);
+
+  bool free_usable = false;
+  for (std::size_t size : {1, 8, 13, 20, 100, 1000, 100000, 131071, 1 << 20}) {
+    std::byte* ptr = mm_malloc(size);
+    REQUIRE(ptr != nullptr);
+    std::size_t usable = mm_usable_size(ptr);
+    REQUIRE(usable >= size);
+    REQUIRE(usable < size + 2 * 4096);
+    // all of the slack can be used
+    std::memset(ptr, 0xab, usable);
+    REQUIRE(mm_checkheap(0) == 0);
+
+    // either size may be passed to a sized free
+    mm_free_sized(ptr, free_usable ? usable : size);
+    free_usable = !free_usable;
+  }
+
+  std::byte* ptr = mm_malloc(64);
+  ptr = mm_realloc(ptr, 40);
+  REQUIRE(mm_usable_size(ptr) >= 40);
+  mm_free_sized(ptr, 40);
+
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("Aligned allocation", "[align]") {
+  mm_init();
+
+  std::vector<std::byte*> blocks;
+  for (std::size_t alignment : {16, 32, 64, 4096, 1 << 16, 1 << 20}) {
+    for (std::size_t size : {1, 100, 5000, 200000}) {
+      std::byte* ptr = mm_memalign(alignment, size);
+      REQUIRE(ptr != nullptr);
+      REQUIRE(reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0);
+      REQUIRE(mm_usable_size(ptr) >= size);
+      std::memset(ptr, 0xcd, size);
+      blocks.push_back(ptr);
+    }
+  }
+  REQUIRE(mm_checkheap(0) == 0);
+
+  // aligned blocks are ordinary blocks
+  blocks[0] = mm_realloc(blocks[0], 300);
+  REQUIRE(blocks[0] != nullptr);
+  REQUIRE(blocks[0][0] == std::byte{0xcd});
+  for (std::byte* block : blocks) {
+    mm_free(block);
+  }
+  REQUIRE(mm_checkheap(0) == 0);
+
+  std::byte* ptr = mm_aligned_alloc(64, 128);
+  REQUIRE(ptr != nullptr);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(ptr) % 64 == 0);
+  mm_free(ptr);
+
+  errno = 0;
+  REQUIRE(mm_memalign(48, 100) == nullptr);
+  REQUIRE(errno == EINVAL);
+  errno = 0;
+  REQUIRE(mm_aligned_alloc(64, 100) == nullptr);
+  REQUIRE(errno == EINVAL);
+
+  // large alignments get huge blocks even for small sizes, which a sized
+  // free must unmap as well
+  std::size_t mapped_size = mm_stats().mapped_size;
+  for (std::size_t size : {1, 4096, 5000}) {
+    ptr = mm_memalign(1 << 20, size);
+    REQUIRE(ptr != nullptr);
+    REQUIRE(mm_stats().mapped_size > mapped_size);
+    mm_free_sized(ptr, size);
+    REQUIRE(mm_stats().mapped_size == mapped_size);
+  }
+
+  mm_teardown();
+}
+
+TEST_CASE("Blocks are aligned to MM_ALIGNMENT", "[align]") {
+  mm_init();
+
+  auto aligned = [](std::byte* ptr) {
+    return reinterpret_cast<std::uintptr_t>(ptr) % MM_ALIGNMENT == 0;
+  };
+  std::vector<std::byte*> blocks;
+  for (std::size_t size = 1; size <= 600; size += 7) {
+    std::byte* ptr = mm_malloc(size);
+    REQUIRE(ptr != nullptr);
+    REQUIRE(aligned(ptr));
+    blocks.push_back(ptr);
+  }
+  for (std::size_t i = 0; i < blocks.size(); i += 2) {
+    blocks[i] = mm_realloc(blocks[i], 1000 + i);
+    REQUIRE(blocks[i] != nullptr);
+    REQUIRE(aligned(blocks[i]));
+  }
+  std::byte* huge = mm_malloc(1 << 20);
+  REQUIRE(huge != nullptr);
+  REQUIRE(aligned(huge));
+  blocks.push_back(huge);
+
+  std::byte* batch[64];
+  REQUIRE(mm_malloc_batch(40, batch, 64) == 64);
+  for (std::byte* ptr : batch) {
+    REQUIRE(aligned(ptr));
+    blocks.push_back(ptr);
+  }
+
+  for (std::byte* block : blocks) {
+    mm_free(block);
+  }
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("Blocks freed by another thread are coalesced before the heap grows",
+          "[free_list]") {
+  mm_init();
+
+  std::vector<std::byte*> blocks;
+  for (int i = 0; i < 200; ++i) {
+    blocks.push_back(mm_malloc(64));
+    REQUIRE(blocks.back() != nullptr);
+  }
+  std::byte* guard = mm_malloc(64);
+  REQUIRE(guard != nullptr);
+
+  // blocks of another arena bypass the thread cache of the freeing thread
+  std::thread([&blocks] {
+    for (std::byte* block : blocks) {
+      mm_free(block);
+    }
+  }).join();
+
+  // only the freed blocks merged together (with the gap in front of the
+  // first batch) can hold this without new memory
+  std::size_t heap_size = mm_stats().heap_size;
+  std::byte* highest = *std::max_element(blocks.begin(), blocks.end());
+  std::byte* ptr = mm_malloc(8000);
+  REQUIRE(ptr != nullptr);
+  REQUIRE(ptr < highest);
+  REQUIRE(mm_stats().heap_size == heap_size);
+  REQUIRE(mm_checkheap(0) == 0);
+
+  mm_free(ptr);
+  mm_free(guard);
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("Statistics count calls and heap work", "[stats]") {
+  mm_init();
+
+  std::vector<std::byte*> blocks;
+  for (int i = 0; i < 50; ++i) {
+    blocks.push_back(mm_malloc(3000));
+    REQUIRE(blocks.back() != nullptr);
+  }
+  std::byte* huge = mm_malloc(1 << 20);
+  REQUIRE(huge != nullptr);
+
+  MmStats stats = mm_stats();
+  REQUIRE(stats.heap_size >= 50 * 3000);
+  REQUIRE(stats.mapped_size >= (1 << 20));
+  REQUIRE(stats.find_fit_calls >= 50);
+  REQUIRE(stats.extend_heap_calls > 0);
+  if (MM_STATS) {
+    REQUIRE(stats.allocs == 51);
+    REQUIRE(stats.allocs_by_class[12] == 50);  // (2048, 4096]
+    REQUIRE(stats.allocs_by_class[20] == 1);
+    REQUIRE(stats.bytes_in_use >= 50 * 3000 + (1 << 20));
+  }
+
+  // freeing every other block leaves holes that cannot be coalesced
+  for (std::size_t i = 0; i < blocks.size(); i += 2) {
+    mm_free(blocks[i]);
+  }
+  MmStats holes = mm_stats();
+  REQUIRE(holes.free_blocks >= 25);
+  REQUIRE(holes.free_bytes >= 25 * 3000);
+  REQUIRE(holes.free_blocks_by_class[12] >= 25);
+  if (MM_STATS) {
+    REQUIRE(holes.frees == 25);
+    REQUIRE(holes.bytes_in_use <= stats.bytes_in_use - 25 * 3000);
+  }
+
+  // the rest fills the holes, counted by a thread that then exits
+  std::thread([&blocks] {
+    for (std::size_t i = 1; i < blocks.size(); i += 2) {
+      mm_free(blocks[i]);
+    }
+  }).join();
+  huge = mm_realloc(huge, 1 << 21);
+  REQUIRE(huge != nullptr);
+  MmStats freed = mm_stats();
+  REQUIRE(freed.coalesces >= 25);
+  REQUIRE(freed.free_blocks < holes.free_blocks);
+  if (MM_STATS) {
+    REQUIRE(freed.frees == 50);
+    REQUIRE(freed.reallocs == 1);
+    REQUIRE(freed.bytes_in_use >= (1 << 21));
+    REQUIRE(freed.bytes_in_use < (1 << 21) + 4096);
+  }
+  mm_free(huge);
+
+  mm_teardown();
+  MmStats reset = mm_stats();
+  REQUIRE(reset.allocs == 0);
+  REQUIRE(reset.heap_size == 0);
+  REQUIRE(reset.coalesces == 0);
+}
+
+TEST_CASE("Bytes in use add up over every way of allocating and freeing",
+          "[stats]") {
+  mm_init();
+  std::size_t base = mm_stats().bytes_in_use;
+
+  std::vector<std::pair<std::byte*, std::size_t>> blocks;
+  for (std::size_t size : {1, 24, 100, 256, 1000, 5000, 200000}) {
+    blocks.emplace_back(mm_malloc(size), size);
+    blocks.emplace_back(mm_calloc(1, size), size);
+    blocks.emplace_back(mm_memalign(256, size), size);
+    blocks.emplace_back(mm_malloc_isolated(size), size);
+    blocks.emplace_back(mm_realloc(mm_malloc(size), size * 3), size * 3);
+  }
+  std::byte* batch[16];
+  std::size_t num_blocks = mm_malloc_batch(300, batch, 16);
+  for (std::size_t i = 0; i < num_blocks; ++i) {
+    blocks.emplace_back(batch[i], 300);
+  }
+  for (const auto& [block, size] : blocks) {
+    REQUIRE(block != nullptr);
+  }
+  if (MM_STATS) {
+    REQUIRE(mm_stats().bytes_in_use > base);
+  }
+
+  // freed with and without their sizes, by this thread and another one;
+  // aligned blocks can be larger than their size says, see mm_stats
+  for (std::size_t i = 0; i < blocks.size(); i += 3) {
+    if (i % 5 == 2 || i % 5 == 3) {
+      mm_free(blocks[i].first);
+    } else {
+      mm_free_sized(blocks[i].first, blocks[i].second);
+    }
+  }
+  for (std::size_t i = 1; i < blocks.size(); i += 3) {
+    mm_free(blocks[i].first);
+  }
+  std::thread([&blocks] {
+    for (std::size_t i = 2; i < blocks.size(); i += 3) {
+      mm_free(blocks[i].first);
+    }
+  }).join();
+  if (MM_STATS) {
+    REQUIRE(mm_stats().bytes_in_use == base);
+  }
+  mm_teardown();
+}
+
+TEST_CASE("Incremental heap checks follow a changing heap", "[mm]") {
+  mm_init();
+
+  std::vector<std::byte*> blocks(256, nullptr);
+  uint64_t seed = 7;
+  for (int i = 0; i < 20000; ++i) {
+    seed = seed * 6364136223846793005 + 1442695040888963407;
+    std::size_t slot = (seed >> 33) % blocks.size();
+    std::size_t size = 1 + (seed >> 17) % 4096;
+    if (blocks[slot] == nullptr) {
+      blocks[slot] = mm_malloc(size);
+    } else if (size % 3 == 0) {
+      blocks[slot] = mm_realloc(blocks[slot], size);
+    } else {
+      mm_free(blocks[slot]);
+      blocks[slot] = nullptr;
+    }
+    REQUIRE(mm_checkheap_step(1 + i % 3) == 0);
+  }
+  for (std::byte* block : blocks) {
+    mm_free(block);
+  }
+  REQUIRE(mm_checkheap_step(1 << 12) == 0);
+
+  // a free block between two allocated blocks with a broken free list link
+  std::byte* lower = mm_malloc(3000);
+  std::byte* middle = mm_malloc(3000);
+  std::byte* upper = mm_malloc(3000);
+  mm_free(middle);
+  std::byte* link;
+  std::memcpy(&link, middle, sizeof(link));
+  std::byte* broken = middle + 1;
+  std::memcpy(middle, &broken, sizeof(broken));
+  int status = 0;
+  std::string output =
+      stdout_of([&status] { status = mm_checkheap_step(1 << 12); });
+  REQUIRE(status == -1);
+  REQUIRE(output.find("bad free list links") != std::string::npos);
+  std::memcpy(middle, &link, sizeof(link));
+  REQUIRE(mm_checkheap_step(1 << 12) == 0);
+  mm_free(lower);
+  mm_free(upper);
+
+  mm_teardown();
+}
+
+/*
+ * Is the block all zero?
+ */
+static bool all_zero(const std::byte* block, std::size_t size) {
+  return std::all_of(block, block + size,
+                     [](std::byte b) { return b == std::byte{0}; });
+}
+
+TEST_CASE("Sizes known at compile time take the small block path",
+          "[size_class]") {
+  mm_init();
+
+  // every size gets a block that fits it, rounded up to its size class
+  // (plus a rest too small to split off)
+  constexpr std::size_t slack = 96;
+  std::vector<std::byte*> blocks;
+  for (std::size_t size = 1; size <= MM_SMALL_SIZE_MAX + 64; ++size) {
+    std::byte* block = mm_malloc(size);
+    REQUIRE(block != nullptr);
+    REQUIRE(mm_usable_size(block) >= size);
+    REQUIRE(mm_usable_size(block) < size + slack);
+    blocks.push_back(block);
+  }
+
+  std::byte* tiny = mm_malloc<1>();
+  std::byte* node = mm_malloc<sizeof(std::pair<void*, long>)>();
+  std::byte* largest = mm_malloc<MM_SMALL_SIZE_MAX>();
+  std::byte* large = mm_malloc<MM_SMALL_SIZE_MAX + 1>();
+  REQUIRE(mm_usable_size(tiny) >= 1);
+  REQUIRE(mm_usable_size(tiny) < 1 + slack);
+  REQUIRE(mm_usable_size(node) >= sizeof(std::pair<void*, long>));
+  REQUIRE(mm_usable_size(largest) >= MM_SMALL_SIZE_MAX);
+  REQUIRE(mm_usable_size(largest) < MM_SMALL_SIZE_MAX + slack);
+  REQUIRE(mm_usable_size(large) > MM_SMALL_SIZE_MAX);
+  if (MM_STATS) {
+    REQUIRE(mm_stats().allocs == blocks.size() + 4);
+  }
+
+  for (std::byte* block : {tiny, node, largest, large}) {
+    mm_free(block);
+  }
+  for (std::byte* block : blocks) {
+    mm_free(block);
+  }
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("Calloc returns zeroed memory", "[calloc]") {
+  mm_init();
+
+  errno = 0;
+  REQUIRE(mm_calloc(SIZE_MAX / 2, 3) == nullptr);
+  REQUIRE(errno == ENOMEM);
+  REQUIRE(mm_calloc(0, 16) == nullptr);
+
+  // reused blocks are dirty, blocks from fresh pages and huge blocks are not
+  std::vector<std::byte*> blocks(128, nullptr);
+  std::vector<std::size_t> sizes(blocks.size(), 0);
+  uint64_t seed = 11;
+  for (int i = 0; i < 20000; ++i) {
+    seed = seed * 6364136223846793005 + 1442695040888963407;
+    std::size_t slot = (seed >> 33) % blocks.size();
+    std::size_t size = 1 + (seed >> 17) % (i % 64 == 0 ? 300000 : 8192);
+    if (blocks[slot] != nullptr) {
+      std::memset(blocks[slot], 0xff, sizes[slot]);
+      mm_free(blocks[slot]);
+      blocks[slot] = nullptr;
+    } else if (size % 2 == 0) {
+      blocks[slot] = mm_malloc(size);
+    } else {
+      blocks[slot] = mm_calloc(1, size);
+      REQUIRE(blocks[slot] != nullptr);
+      REQUIRE(all_zero(blocks[slot], size));
+    }
+    sizes[slot] = size;
+    if (i % 5000 == 0) {
+      mm_trim();
+    }
+  }
+  for (std::size_t slot = 0; slot < blocks.size(); ++slot) {
+    if (blocks[slot] != nullptr) {
+      std::memset(blocks[slot], 0xff, sizes[slot]);
+      mm_free(blocks[slot]);
+    }
+  }
+  REQUIRE(mm_checkheap(0) == 0);
+
+  // the top of the heap was trimmed and grows again
+  mm_trim();
+  std::byte* block = mm_calloc(100, 1000);
+  REQUIRE(block != nullptr);
+  REQUIRE(all_zero(block, 100000));
+  mm_free(block);
+
+  mm_teardown();
+}
+
+TEST_CASE("Isolated blocks share no cache line", "[isolated]") {
+  mm_init();
+  constexpr std::uintptr_t line = 64;
+
+  // isolated blocks between ordinary ones
+  std::vector<std::pair<std::byte*, std::size_t>> isolated;
+  std::vector<std::byte*> ordinary;
+  for (std::size_t size = 1; size < 300; size += 7) {
+    ordinary.push_back(mm_malloc(size));
+    std::byte* block = mm_malloc_isolated(size);
+    REQUIRE(block != nullptr);
+    REQUIRE(reinterpret_cast<std::uintptr_t>(block) % line == 0);
+    REQUIRE(mm_usable_size(block) >= size);
+    isolated.emplace_back(block, (size + line - 1) & ~(line - 1));
+  }
+  for (std::byte* block : ordinary) {
+    std::size_t usable = mm_usable_size(block);
+    for (auto [lines, size] : isolated) {
+      REQUIRE((block + usable <= lines || block >= lines + size));
+    }
+  }
+
+  // a size class of its own
+  REQUIRE(mm_set_isolated(24, true) == 0);
+  std::byte* counter = mm_malloc(24);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(counter) % line == 0);
+  std::byte* zeroed = mm_calloc(3, 8);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(zeroed) % line == 0);
+  REQUIRE(all_zero(zeroed, 24));
+  REQUIRE(mm_set_isolated(24, false) == 0);
+  REQUIRE(mm_set_isolated(0, true) == -1);
+  REQUIRE(mm_set_isolated(4096, true) == -1);
+  mm_free(counter);
+  mm_free(zeroed);
+
+  // batches of heap blocks start on a line
+  std::byte* batch[2][10];
+  REQUIRE(mm_malloc_batch(200, batch[0], 10) == 10);
+  REQUIRE(mm_malloc_batch(200, batch[1], 10) == 10);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(batch[0][0]) % line == 0);
+  REQUIRE(reinterpret_cast<std::uintptr_t>(batch[1][0]) % line == 0);
+  mm_free_batch(batch[0], 10);
+  mm_free_batch(batch[1], 10);
+
+  for (auto [block, size] : isolated) {
+    mm_free(block);
+  }
+  for (std::byte* block : ordinary) {
+    mm_free(block);
+  }
+  REQUIRE(mm_checkheap(0) == 0);
+  mm_teardown();
+}
+
+TEST_CASE("Heap profiles hold the sampled blocks that are still allocated",
+          "[profile]") {
+  if (!MM_PROFILE) {
+    REQUIRE(mm_profile_start(1) == -1);
+    return;
+  }
+  mm_init();
+  const char* path = "heap-profile-test.prof";
+
+  // blocks are far larger than the average distance between samples
+  REQUIRE(mm_profile_start(1) == 0);
+  std::vector<std::byte*> blocks;
+  for (int i = 0; i < 100; ++i) {
+    blocks.push_back(mm_malloc(1000));
+  }
+  REQUIRE(mm_profile_dump(path) == 0);
+  REQUIRE(first_line(path) ==
+          "heap profile: 100: 100000 [100: 100000] @ heap_v2/1");
+
+  // freed blocks drop out, a resized block keeps a sample of its new size
+  for (int i = 0; i < 50; ++i) {
+    mm_free(blocks[i]);
+  }
+  blocks[50] = mm_realloc(blocks[50], 3000);
+  REQUIRE(mm_profile_dump(path) == 0);
+  REQUIRE(first_line(path) ==
+          "heap profile: 50: 52000 [50: 52000] @ heap_v2/1");
+  std::ifstream profile(path);
+  std::string line;
+  std::getline(profile, line);
+  std::getline(profile, line);
+  REQUIRE(line.find("] @ 0x") != std::string::npos);
+
+  // a block that cannot be resized keeps its sample
+  REQUIRE(mm_realloc(blocks[50], std::size_t{1} << 60) == nullptr);
+  REQUIRE(mm_profile_dump(path) == 0);
+  REQUIRE(first_line(path) ==
+          "heap profile: 50: 52000 [50: 52000] @ heap_v2/1");
+
+  // a signal makes the next allocation write a profile
+  std::remove(path);
+  REQUIRE(mm_profile_dump_on_signal(SIGUSR2, path) == 0);
+  std::raise(SIGUSR2);
+  std::byte* ptr = mm_malloc(1000);
+  REQUIRE(first_line(path) ==
+          "heap profile: 51: 53000 [51: 53000] @ heap_v2/1");
+
+  // blocks allocated while sampling is off are not sampled
+  REQUIRE(mm_profile_start(0) == 0);
+  mm_free(mm_malloc(1000));
+
+  // a signal while sampling is off makes the next free write a profile
+  std::remove(path);
+  std::raise(SIGUSR2);
+  mm_free(ptr);
+  REQUIRE(first_line(path) ==
+          "heap profile: 50: 52000 [50: 52000] @ heap_v2/0");
+  std::signal(SIGUSR2, SIG_DFL);
+
+  for (std::size_t i = 50; i < blocks.size(); ++i) {
+    mm_free(blocks[i]);
+  }
+  REQUIRE(mm_profile_dump(path) == 0);
+  REQUIRE(first_line(path) == "heap profile: 0: 0 [0: 0] @ heap_v2/0");
+  std::remove(path);
+
+  mm_teardown();
+}
+
+TEST_CASE("Heaps of their own are released in one step", "[heap]") {
+  mm_init();
+  ExplicitFreeListHeap heap;
+  REQUIRE(heap.stats().heap_size == 0);
+
+  // small, medium, aligned and large blocks all come from the heap's region
+  std::vector<std::byte*> blocks;
+  for (int i = 0; i < 1000; ++i) {
+    std::size_t size = 1 + static_cast<std::size_t>(i * 37 % 2000);
+    std::byte* ptr = heap.malloc(size);
+    REQUIRE(ptr != nullptr);
+    std::memset(ptr, i & 0xff, size);
+    blocks.push_back(ptr);
+  }
+  std::byte* aligned = heap.memalign(4096, 100);
+  REQUIRE(reinterpret_cast<uintptr_t>(aligned) % 4096 == 0);
+  std::byte* large = heap.malloc(1 << 20);
+  REQUIRE(large != nullptr);
+  REQUIRE(heap.usable_size(large) >= (1 << 20));
+  for (std::byte* ptr : {blocks[0], aligned, large}) {
+    REQUIRE(heap.contains(ptr));
+  }
+  std::byte* global = mm_malloc(100);
+  REQUIRE_FALSE(heap.contains(global));
+  mm_free(global);
+
+  // blocks keep their contents when others are freed and resized
+  for (std::size_t i = 0; i < blocks.size(); i += 2) {
+    heap.free(blocks[i]);
+  }
+  blocks[1] = heap.realloc(blocks[1], 5000);
+  REQUIRE(blocks[1] != nullptr);
+  REQUIRE(blocks[1][36] == std::byte{1});
+  for (std::size_t i = 3; i < blocks.size(); i += 2) {
+    std::size_t size = 1 + i * 37 % 2000;
+    REQUIRE(blocks[i][size - 1] == static_cast<std::byte>(i & 0xff));
+  }
+  REQUIRE(heap.checkheap(0) == 0);
+  REQUIRE(heap.stats().heap_size > (1 << 20));
+
+  // releasing the heap drops all blocks, the heap can be used again
+  heap.release();
+  REQUIRE(heap.stats().heap_size == 0);
+  REQUIRE_FALSE(heap.contains(large));
+  std::byte* ptr = heap.malloc(100);
+  REQUIRE(ptr != nullptr);
+  heap.free(ptr);
+  REQUIRE(heap.checkheap(0) == 0);
+
+  mm_teardown();
+}
+
+TEST_CASE("Containers can allocate from a heap of their own", "[heap]") {
+  ExplicitFreeListHeap heap;
+
+  HeapResource resource(&heap);
+  std::pmr::vector<int> values(&resource);
+  std::pmr::map<int, std::pmr::string> names(&resource);
+  for (int i = 0; i < 10000; ++i) {
+    values.push_back(i);
+    names.emplace(i, std::to_string(i) + " is a long enough name");
+  }
+  REQUIRE(heap.contains(reinterpret_cast<std::byte*>(values.data())));
+  REQUIRE(names.at(1234) == "1234 is a long enough name");
+  HeapResource other(&heap);
+  REQUIRE(resource == other);
+  REQUIRE_FALSE(resource == *std::pmr::new_delete_resource());
+
+  using Allocator = HeapAllocator<long>;
+  std::vector<long, Allocator> longs{Allocator(&heap)};
+  for (long i = 0; i < 1000; ++i) {
+    longs.push_back(i);
+  }
+  REQUIRE(heap.contains(reinterpret_cast<std::byte*>(longs.data())));
+  REQUIRE(longs[999] == 999);
+  REQUIRE(longs.get_allocator() == HeapAllocator<char>(&heap));
+  struct alignas(64) Line {
+    char bytes[64];
+  };
+  HeapAllocator<Line> lines(longs.get_allocator());
+  Line* line = lines.allocate(3);
+  REQUIRE(reinterpret_cast<uintptr_t>(line) % 64 == 0);
+  lines.deallocate(line, 3);
+  REQUIRE(heap.checkheap(0) == 0);
+}
+
+TEST_CASE("Heaps roll back to a checkpoint", "[heap]") {
+  ExplicitFreeListHeap heap;
+  REQUIRE(heap.rollback() == -1);
+
+  // blocks from before the checkpoint, with holes between them
+  std::vector<std::byte*> before;
+  for (int i = 0; i < 200; ++i) {
+    std::size_t size = 1 + static_cast<std::size_t>(i * 53 % 700);
+    before.push_back(heap.malloc(size));
+    std::memset(before.back(), i & 0xff, size);
+  }
+  for (std::size_t i = 0; i < before.size(); i += 3) {
+    heap.free(before[i]);
+    before[i] = nullptr;
+  }
+  auto check_before = [&]() {
+    for (std::size_t i = 0; i < before.size(); ++i) {
+      std::size_t size = 1 + i * 53 % 700;
+      if (before[i] != nullptr) {
+        REQUIRE(before[i][size - 1] == static_cast<std::byte>(i & 0xff));
+      }
+    }
+  };
+
+  REQUIRE(heap.checkpoint() == 0);
+  REQUIRE(heap.checkpoint() == -1);
+  std::size_t heap_size = 0;
+  for (int round = 0; round < 20; ++round) {
+    if (round > 0) {
+      REQUIRE(heap.checkpoint() == 0);
+    }
+    for (int i = 0; i < 500; ++i) {
+      std::size_t size = 1 + static_cast<std::size_t>(i * 97 % 3000);
+      std::byte* ptr =
+          i % 50 == 0 ? heap.memalign(256, size) : heap.malloc(size);
+      REQUIRE(ptr != nullptr);
+      std::memset(ptr, 0xee, size);
+      if (i % 4 == 0) {
+        heap.free(ptr);
+      }
+    }
+    REQUIRE(heap.checkheap(0) == 0);
+    REQUIRE(heap.rollback() == 0);
+    REQUIRE(heap.rollback() == -1);
+    REQUIRE(heap.checkheap(0) == 0);
+    check_before();
+    // every round reuses the memory of the one before
+    if (round == 1) {
+      heap_size = heap.stats().heap_size;
+    } else if (round > 1) {
+      REQUIRE(heap.stats().heap_size <= heap_size);
+    }
+  }
+
+  // older blocks freed or moved under a checkpoint stay until it is cleared
+  REQUIRE(heap.checkpoint() == 0);
+  std::byte* held = before[1];
+  heap.free(held);
+  before[1] = nullptr;
+  before[2] = heap.realloc(before[2], 5000);
+  REQUIRE(before[2][1] == std::byte{2});
+  std::byte* later = heap.malloc(100);
+  REQUIRE(heap.checkheap(0) == 0);
+  REQUIRE(heap.commit() == 0);
+  REQUIRE(heap.commit() == -1);
+  REQUIRE(heap.checkheap(0) == 0);
+  REQUIRE(before[2][1] == std::byte{2});
+  check_before();
+  heap.free(later);
+  for (std::byte* ptr : before) {
+    heap.free(ptr);
+  }
+  REQUIRE(heap.checkheap(0) == 0);
+  REQUIRE(heap.stats().free_blocks >= 1);
+}